@@ -0,0 +1,43 @@
+\ The core wordset, compiled by the stage-1 interpreter into the boot
+\ image that ships inside bbforth. The primitives are built in; these are
+\ the words made out of them.
+
+\ -- Constants ------------------------------------------------------------
+\ Comparisons leave 1 for true
+1 CONSTANT TRUE
+0 CONSTANT FALSE
+32 CONSTANT BL
+1 CELLS CONSTANT CELL
+
+\ -- Stack manipulation ---------------------------------------------------
+: NIP ( x1 x2 -- x2 ) SWAP DROP ;
+: TUCK ( x1 x2 -- x2 x1 x2 ) SWAP OVER ;
+: -ROT ( x1 x2 x3 -- x3 x1 x2 ) ROT ROT ;
+: 2NIP ( x1 x2 x3 x4 -- x3 x4 ) 2SWAP 2DROP ;
+
+\ -- Arithmetic and comparison --------------------------------------------
+: SQUARE ( n -- n*n ) DUP * ;
+: CUBE ( n -- n*n*n ) DUP DUP * * ;
+: 0<> ( x -- flag ) 0= 0= ;
+: 0> ( n -- flag ) 0 > ;
+: <> ( x1 x2 -- flag ) = 0= ;
+: U> ( u1 u2 -- flag ) SWAP U< ;
+: NOT ( x -- flag ) 0= ;
+: WITHIN ( n lo hi -- flag ) OVER - -ROT - SWAP U< ;
+: S>D ( n -- d ) DUP 0< NEGATE ;
+: D0= ( d -- flag ) OR 0= ;
+: D0< ( d -- flag ) NIP 0< ;
+: D2* ( d -- d*2 ) 2DUP D+ ;
+: UM+ ( u1 u2 -- ud ) 0 TUCK D+ ;
+
+\ -- Memory ---------------------------------------------------------------
+: CELL+ ( a-addr -- a-addr' ) CELL + ;
+: CELL- ( a-addr -- a-addr' ) CELL - ;
+: CHAR+ ( c-addr -- c-addr' ) 1+ ;
+: CHARS ( n -- n ) ;
+: 2@ ( a-addr -- x1 x2 ) DUP CELL+ @ SWAP @ ;
+: 2! ( x1 x2 a-addr -- ) SWAP OVER ! CELL+ ! ;
+: 1+! ( a-addr -- ) 1 SWAP +! ;
+: 1-! ( a-addr -- ) -1 SWAP +! ;
+: BLANK ( c-addr u -- ) BL FILL ;
+: FLOAT+ ( f-addr -- f-addr' ) 8 + ;
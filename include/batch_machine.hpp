@@ -0,0 +1,86 @@
+#ifndef BATCH_MACHINE_H
+#define BATCH_MACHINE_H
+
+#include <cstddef>
+#include <memory>
+
+#include "compiler.hpp"
+#include "dictionary.hpp"
+
+/*
+ * Runs one program over many independent data stacks ("lanes") in lockstep.
+ *
+ * The stacks are stored structure-of-arrays: row k holds slot k of every
+ * lane's stack, contiguously, with slot 0 at the bottom. Each instruction is
+ * decoded once for the whole batch and then loops over the lanes of the rows
+ * it touches, so dispatch is paid once per batch instead of once per lane,
+ * and the loops vectorize. Stack manipulation moves whole rows.
+ *
+ * All lanes always have the same depth. That holds for any code whose stack
+ * effects don't depend on the data; instructions that do (?DUP) or that need
+ * the rest of a VirtualMachine are rejected.
+ */
+class BatchMachine {
+  public:
+    explicit BatchMachine(size_t lanes,
+                          size_t size = DATA_STACK_DEFAULT_SIZE);
+
+    BatchMachine(const BatchMachine&) = delete;
+
+    size_t lanes() const {
+      return myLanes;
+    }
+
+    size_t depth() const {
+      return myDepth;
+    }
+
+    /*
+     * Push a row holding one value per lane, lane 0 first.
+     */
+    bool push(const UCell *values);
+
+    /*
+     * Pop the top row into values, lane 0 first.
+     */
+    bool pop(UCell *values);
+
+    /*
+     * Slot k of every lane's stack, counting from the bottom. Only rows
+     * below depth() hold values.
+     */
+    UCell *row(size_t k) {
+      return mypRows.get() + k * myLanes;
+    }
+
+    /*
+     * Run code to completion on every lane. Calls are followed into
+     * pDictionary, which is needed if code makes any.
+     */
+    bool execute(const Code &code, const Dictionary *pDictionary = nullptr);
+
+  private:
+    // Run code from ip up to its EXIT or end. nesting counts calls, to stop
+    // runaway recursion.
+    bool run(const Code &code, size_t ip, const Dictionary *pDictionary,
+             size_t nesting);
+    bool step(const Instruction &instruction);
+    // Instructions without a fast path, one lane at a time
+    bool evaluateLanes(const Instruction &instruction,
+                       const StackEffect &effect);
+    bool shuffle(const StackEffect &effect);
+
+    // A pure operation on every lane, its inputs checked already
+    template<enum OpCode op>
+    void lanes();
+
+    size_t myLanes;
+    size_t mySize;
+    size_t myDepth;
+    std::unique_ptr<UCell[]> mypRows;
+    // Rows a shuffle reads from while it overwrites the stack
+    std::unique_ptr<UCell[]> mypScratch;
+};
+
+
+#endif // BATCH_MACHINE_H
@@ -0,0 +1,174 @@
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include <cstddef>
+#include <vector>
+
+#include "operation.hpp"
+
+/*
+ * Optimizing tier.
+ *
+ * The compiler abstractly interprets the stack effect of each instruction in
+ * a definition, which turns the definition into SSA values over a virtual
+ * stack. Stack manipulation (SWAP, ROT, OVER, ...) only renames values, so
+ * it never reaches the compiled form. The remaining operations are assigned
+ * to a small register file. Data stack memory is only touched when a basic
+ * block is entered (inputs are popped into registers) or left (live values
+ * are spilled back), and around instructions the compiler can't model.
+ *
+ * The machine runs a word in this form when it's a leaf, one that makes no
+ * calls: a leaf's code never changes once it's defined, and it runs from
+ * start to EXIT without a safepoint. Every other word is interpreted.
+ */
+
+
+/*
+ * How many cells an opcode consumes and produces. shuffle is non-null for
+ * pure stack manipulation: output i is a copy of input shuffle[i], where
+ * input 0 is the deepest input.
+ */
+struct StackEffect {
+  size_t inputs;
+  size_t outputs;
+  const unsigned char *shuffle;
+};
+
+// Most cells an operation that isn't a shuffle consumes and produces
+const size_t MAX_INPUTS = 4;
+const size_t MAX_OUTPUTS = 2;
+
+/*
+ * Look up the static stack effect of an opcode. Returns false if the opcode
+ * doesn't have one (e.g. ?DUP, which depends on its input).
+ */
+bool stackEffect(enum OpCode opcode, StackEffect &effect);
+
+
+const size_t REGISTER_FILE_SIZE = 32;
+
+/*
+ * A basic block in register form.
+ */
+class RegisterBlock {
+  public:
+    bool operator()(DataStack &ds) const;
+
+    size_t inputCount() const {
+      return myInputs.size();
+    }
+
+    size_t outputCount() const {
+      return myOutputs.size();
+    }
+
+    size_t instructionCount() const {
+      return myNodes.size();
+    }
+
+    size_t registerCount() const {
+      return myRegisterCount;
+    }
+
+  private:
+    friend class Compiler;
+
+    // An instruction, with its inputs and outputs in registers
+    struct Node {
+      Instruction instruction;
+      size_t inputs;
+      size_t outputs;
+      size_t src[MAX_INPUTS];
+      size_t dst[MAX_OUTPUTS];
+    };
+
+    // Registers the inputs are popped into, top of stack first
+    std::vector<size_t> myInputs;
+    std::vector<Node> myNodes;
+    // Registers that are spilled on exit, deepest first
+    std::vector<size_t> myOutputs;
+    size_t myRegisterCount;
+};
+
+/*
+ * A compiled definition: register blocks, separated by instructions the
+ * compiler can't model (?DUP, memory, calls), which run through the normal
+ * dispatch.
+ */
+class CompiledCode {
+  public:
+    CompiledCode()
+      : mySteps{},
+      myBlocks{},
+      myLeaf{true}
+    {
+    }
+
+    bool operator()(DataStack &ds) const;
+
+    /*
+     * Run a leaf against vm's stacks and data space. Fails at an
+     * instruction that isn't a leaf's.
+     */
+    bool operator()(VirtualMachine &vm) const;
+
+    /*
+     * Whether the code makes no calls and has nothing the dictionary
+     * rewrites in place, so the machine can run it in this form.
+     */
+    bool leaf() const {
+      return myLeaf;
+    }
+
+    size_t blockCount() const {
+      return myBlocks.size();
+    }
+
+    const RegisterBlock &block(size_t i) const {
+      return myBlocks[i];
+    }
+
+  private:
+    friend class Compiler;
+
+    struct Step {
+      bool isBlock;
+      size_t iBlock;
+      Instruction instruction;
+    };
+
+    std::vector<Step> mySteps;
+    std::vector<RegisterBlock> myBlocks;
+    bool myLeaf;
+};
+
+
+class Compiler {
+  public:
+    /*
+     * Compile code into register form. Returns false if code contains an
+     * invalid opcode or is missing an operand.
+     */
+    bool compile(const Code &code, CompiledCode &compiled);
+
+  private:
+    using Node = RegisterBlock::Node;
+
+    void beginBlock();
+    size_t popValue();
+    void apply(const Instruction &instruction, const StackEffect &effect);
+    void endBlock(CompiledCode &compiled);
+    void allocate(RegisterBlock &block);
+
+    // Number of SSA values in the current block. Nodes refer to values
+    // until allocate() replaces them with registers.
+    size_t myValueCount;
+    std::vector<Node> myNodes;
+    // Values of the block inputs, top of the entry stack first
+    std::vector<size_t> myInputs;
+    // Virtual stack, deepest first
+    std::vector<size_t> myStack;
+};
+
+
+#endif // COMPILER_H
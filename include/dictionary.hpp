@@ -0,0 +1,196 @@
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "compiler.hpp"
+#include "operation.hpp"
+#include "virtual_machine.hpp"
+
+// Addresses that don't start a leaf word, in the dictionary's leaf index
+const uint32_t NOT_COMPILED = static_cast<uint32_t>(-1);
+
+/*
+ * Named definitions, compiled into one contiguous code space. A word's
+ * execution token (xt) is the address of its first instruction, and every
+ * body is terminated by an EXIT. Leaf words are compiled by the optimizing
+ * tier as well.
+ */
+class Dictionary {
+  public:
+    struct Word {
+      std::string name;
+      size_t xt;
+      // Cells in the body, not counting the EXIT
+      size_t length;
+    };
+
+    Dictionary();
+
+    Dictionary(const Dictionary&) = delete;
+
+    /*
+     * Compile body into the code space under name. Returns the new word's
+     * execution token. Calls to VALUE and deferred words are made generic,
+     * to be quickened when they first run, and EXECUTE of a constant xt
+     * becomes a call.
+     */
+    size_t define(const std::string &name, const Code &body);
+
+    /*
+     * Look up the most recent definition of name.
+     */
+    bool find(const std::string &name, size_t &xt) const;
+
+    bool isWord(size_t xt) const {
+      return word(xt) != nullptr;
+    }
+
+    /*
+     * Whether the word at xt is a VALUE or deferred word, which calls to it
+     * are quickened against.
+     */
+    bool isIndirect(size_t xt) const;
+
+    /*
+     * The word at xt in register form, or nullptr if it has to be
+     * interpreted. Every call asks, so this is an index, not a search.
+     */
+    const CompiledCode *compiled(size_t xt) const {
+      if (xt >= myLeaves.size() || myLeaves[xt] == NOT_COMPILED) {
+        return nullptr;
+      }
+      return &myCompiled[myLeaves[xt]];
+    }
+
+    /*
+     * Copy the body of the word at xt, without its EXIT, with any quickened
+     * sites in it put back to their generic form, e.g. for inlining.
+     */
+    bool body(size_t xt, Code &code) const;
+
+    /*
+     * Remove the word at xt and everything defined after it.
+     */
+    bool forget(size_t xt);
+
+    /*
+     * Clones of words with some of their arguments folded in, keyed by the
+     * original word and the argument values.
+     */
+    bool findSpecialization(size_t xt, const Code &arguments,
+                            size_t &clone) const;
+    void addSpecialization(size_t xt, const Code &arguments, size_t clone);
+
+    /*
+     * Overwrite the code at address in place, for rewrites that never need
+     * to be undone.
+     */
+    bool patch(size_t address, const Code &cells);
+
+    /*
+     * Overwrite the instruction at site with a specialized form that stays
+     * valid only as long as the word at target doesn't change. The generic
+     * form is kept so it can be put back.
+     */
+    bool quicken(size_t site, size_t target, const Code &cells);
+
+    /*
+     * Change the value of a VALUE word, or the target of a deferred word,
+     * and put back every site quickened against it. kind is OPCODE_VALUE
+     * or OPCODE_DEFER, and has to match the word.
+     */
+    bool update(size_t xt, enum OpCode kind, UCell value);
+
+    /*
+     * Make this dictionary a copy of other, reusing its storage where it
+     * can.
+     */
+    void restore(const Dictionary &other);
+
+    /*
+     * Replace the whole dictionary with words compiled into code, e.g. from
+     * an image. Returns false, leaving the dictionary alone, if the words
+     * aren't in order or their bodies aren't in code.
+     */
+    bool load(const Code &code, const std::vector<Word> &words);
+
+    /*
+     * Like load(), for code with quickened sites in it, e.g. from a
+     * checkpoint: genericCode and quickenedSites are what genericSites()
+     * and quickenedSites() returned.
+     */
+    bool load(const Code &code, const std::vector<Word> &words,
+              const std::map<size_t, Code> &genericCode,
+              const std::multimap<size_t, size_t> &quickenedSites);
+
+    /*
+     * The code space with every quickened site put back to its generic
+     * form, which stays valid however the words it depends on change.
+     */
+    Code genericCode() const;
+
+    const std::vector<Word> &words() const {
+      return myWords;
+    }
+
+    /*
+     * The generic code of every quickened site, by site, and the sites
+     * quickened against each word, by word.
+     */
+    const std::map<size_t, Code> &genericSites() const {
+      return myGenericCode;
+    }
+
+    const std::multimap<size_t, size_t> &quickenedSites() const {
+      return myQuickenedSites;
+    }
+
+    /*
+     * Address the next definition will be compiled to.
+     */
+    size_t here() const {
+      return myCode.size();
+    }
+
+    const Code &code() const {
+      return myCode;
+    }
+
+  private:
+    using Specialization = std::pair<size_t, std::vector<UCell::type>>;
+
+    const Word *word(size_t xt) const;
+    static Specialization specialization(size_t xt, const Code &arguments);
+    // Put the generic code back at every site quickened against target
+    void invalidate(size_t target);
+    // Give the calls in the word at xt the form they first run in
+    void prepare(size_t xt);
+    // Compile the word at xt, if it's a leaf the tier does something for
+    void compile(size_t xt, const Code &body);
+
+    Code myCode;
+    std::vector<Word> myWords;
+    std::map<Specialization, size_t> mySpecializations;
+    // Generic code of every quickened site, by site. A site can be quickened
+    // again after its first rewrite; this is always what was there before
+    // the first one.
+    std::map<size_t, Code> myGenericCode;
+    // Quickened sites, by the word they depend on. Entries can outlive the
+    // quickening they were made for, which is harmless: putting the generic
+    // code back is always correct.
+    std::multimap<size_t, size_t> myQuickenedSites;
+    // Leaf words in register form, in the order they were defined
+    std::vector<CompiledCode> myCompiled;
+    // Where in myCompiled each address's word is, or NOT_COMPILED, decided
+    // when the word is defined
+    std::vector<uint32_t> myLeaves;
+};
+
+
+#endif // DICTIONARY_H
@@ -0,0 +1,55 @@
+#ifndef FORK_SERVER_H
+#define FORK_SERVER_H
+
+#include <cstddef>
+#include <string>
+
+#include "virtual_machine.hpp"
+
+/*
+ * Runs jobs against a warm machine, each in a process of its own.
+ *
+ * The server listens on a Unix socket. For every connection it fork()s,
+ * and the child runs the job on the machine it inherited, copy-on-write,
+ * then exits; nothing a job does reaches the server or any other job, and
+ * none of them pays for booting. A job is Forth source, read until the
+ * client shuts down its side of the connection, so an entry word's name
+ * on its own is a job too. The reply is one line: "ok" and the data stack
+ * left behind, deepest first, or "error" and the word the job stopped at.
+ */
+class ForkServer {
+  public:
+    explicit ForkServer(VirtualMachine &vm);
+
+    ForkServer(const ForkServer&) = delete;
+
+    /*
+     * Closes the socket and removes it.
+     */
+    ~ForkServer();
+
+    /*
+     * Listen on a new socket at path.
+     */
+    bool listen(const std::string &path);
+
+    /*
+     * Accept count jobs, or go on forever if count is 0, then wait for the
+     * ones still running. Returns false if the socket fails.
+     */
+    bool serve(size_t count = 0);
+
+  private:
+    // In the child: run the job on connection and exit
+    void runJob(int connection);
+    // Wait for finished children, or all of them if block is true
+    void reap(bool block);
+
+    VirtualMachine &myVm;
+    int mySocket;
+    std::string myPath;
+    size_t myChildren;
+};
+
+
+#endif // FORK_SERVER_H
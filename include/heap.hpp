@@ -0,0 +1,101 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <cstddef>
+
+#include "virtual_machine.hpp"
+
+// Granularity the heap takes memory from the data space in
+const size_t HEAP_PAGE_SIZE = 4096;
+// Smallest block, header included
+const size_t HEAP_MIN_BLOCK = 16;
+// Small blocks come in power-of-two size classes up to this
+const size_t HEAP_MAX_SMALL_BLOCK = 2048;
+const size_t HEAP_SIZE_CLASSES = 8;
+
+/*
+ * The heap behind ALLOCATE, FREE and RESIZE. It lives in the VM's data
+ * space, so allocated memory is addressed like any other, and takes whole
+ * pages off the top of it.
+ *
+ * Every block starts with a one-cell header holding the block's size. Small
+ * blocks are rounded up to a size class and bump-allocated out of the
+ * current page; freed ones go on a free list per class. Large blocks take
+ * whole pages and go on a single first-fit list when they're freed. A freed
+ * block is marked free in its header, so that freeing it twice fails, and
+ * links to the next one in the cell after it. The lists are kept in the data space itself, so the only
+ * state outside it is their heads, and clear() frees everything at once in
+ * constant time.
+ */
+class Heap {
+  public:
+    explicit Heap(DataSpace &space);
+
+    Heap(const Heap&) = delete;
+
+    /*
+     * Allocate size bytes, aligned to the cell size. Returns false if the
+     * data space is full.
+     */
+    bool allocate(UCell::type size, UCell::type &address);
+
+    /*
+     * Free a block allocate() returned. Returns false if address isn't one.
+     */
+    bool free(UCell::type address);
+
+    /*
+     * Grow or shrink the block at address to size bytes, moving it if it
+     * has to. On failure the block is left alone.
+     */
+    bool resize(UCell::type address, UCell::type size, UCell::type &moved);
+
+    /*
+     * Regions are heap blocks allocated from by bump pointer, for data
+     * that all dies at once. The first cell of a region holds the address
+     * of its free space; releasing the region resets it, and freeing the
+     * region as a block gives the memory back to the heap.
+     */
+    bool allocateRegion(UCell::type size, UCell::type &region);
+    bool regionAllocate(UCell::type region, UCell::type size,
+                        UCell::type &address);
+    bool releaseRegion(UCell::type region);
+
+    /*
+     * Free every block and give all pages back to the data space.
+     */
+    void clear();
+
+    /*
+     * The heap's bookkeeping outside the data space, for checkpoints: the
+     * heads of the free lists and the page small blocks are cut from.
+     */
+    struct State {
+      UCell::type free[HEAP_SIZE_CLASSES];
+      UCell::type large;
+      UCell::type bump;
+      UCell::type bumpEnd;
+    };
+
+    State state() const;
+    void setState(const State &state);
+
+  private:
+    // Total size of the block at address, header included
+    bool blockSize(UCell::type address, UCell::type &size) const;
+    // First byte past the end of a region, which has to be a live block
+    bool regionEnd(UCell::type region, UCell::type &end) const;
+    // Take a block of size bytes from a list, or from the data space
+    bool takeSmall(size_t sizeClass, UCell::type &block);
+    bool takeLarge(UCell::type &size, UCell::type &block);
+
+    DataSpace &mySpace;
+    UCell::type myFree[HEAP_SIZE_CLASSES];
+    UCell::type myLarge;
+    // Unused part of the page small blocks are being cut from
+    UCell::type myBump;
+    UCell::type myBumpEnd;
+};
+
+
+#endif // HEAP_H
@@ -0,0 +1,104 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "virtual_machine.hpp"
+
+/*
+ * Images: a machine's dictionary and data space in a file, to start from
+ * instead of compiling everything again.
+ *
+ * Every address in the machine is an offset (xts into the code space, data
+ * addresses into the data space), so an image is position-independent and
+ * loads without a relocation pass. The data space is stored page-aligned
+ * at the end of the file and mapped copy-on-write, so only the pages a
+ * program writes to are ever copied, and machines that load the same file
+ * or shared memory share the rest. The code and word list are read
+ * straight into the dictionary.
+ *
+ * Images are in the machine's own byte order and cell width, and are only
+ * loaded by a build that matches.
+ */
+
+// The data space starts on a multiple of this, which covers any page size
+const uint64_t IMAGE_ALIGNMENT = 64 * 1024;
+const uint32_t IMAGE_VERSION = 3;
+
+struct ImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t cellBits;
+  uint64_t codeCells;
+  uint64_t wordCount;
+  // Bytes of word list after the code
+  uint64_t wordBytes;
+  // Bytes of machine state after the word list, in checkpoints only
+  uint64_t stateBytes;
+  uint64_t dataOffset;
+  uint64_t dataSize;
+  uint64_t here;
+};
+
+/*
+ * Write vm's dictionary and the allocated part of its data space to path.
+ * The heap isn't saved. The image is written to path.tmp and renamed over
+ * path, so machines that loaded the old one keep their mapping of it.
+ */
+bool saveImage(VirtualMachine &vm, const std::string &path);
+
+/*
+ * Replace vm's dictionary and data space with the image at path, and mark
+ * the result booted. Returns false, leaving vm alone, if path isn't an
+ * image this build can load.
+ */
+bool loadImage(VirtualMachine &vm, const std::string &path);
+
+/*
+ * Load the image open on fd, which can be a file or shared memory. fd is
+ * left open.
+ */
+bool loadImage(VirtualMachine &vm, int fd);
+
+/*
+ * Put vm's image in shared memory, for many processes to load without each
+ * keeping a copy of its data space: every loader maps the same pages, and
+ * only the ones it writes to are copied. fd is set to a descriptor for it.
+ *
+ * With an empty name the image is an anonymous memfd, sealed so nothing can
+ * change it, for handing to children or over a Unix socket. Otherwise it's
+ * the POSIX shared memory object name, which outlives the process until
+ * it's shm_unlink()ed. Sharing under a name again replaces the object
+ * there with a new one; machines that loaded the old one keep it.
+ */
+bool shareImage(VirtualMachine &vm, const std::string &name, int &fd);
+
+/*
+ * Load the image shared under name.
+ */
+bool loadSharedImage(VirtualMachine &vm, const std::string &name);
+
+/*
+ * Load an image that's already in memory, e.g. one linked into the
+ * executable. The allocated part of its data space is copied into vm's own,
+ * which has to be big enough, so image can be read-only.
+ */
+bool loadImage(VirtualMachine &vm, const unsigned char *image, size_t size);
+
+/*
+ * Checkpoints: a machine stopped partway through running, e.g. between
+ * runOnce() calls, saved so it can carry on later or in another process.
+ * A checkpoint is an image with the machine's stacks, next instruction,
+ * heap and quickened code added, and the whole data space rather than the
+ * part below HERE; loading one maps the data space the same way.
+ *
+ * Loading a checkpoint doesn't change what reset() goes back to, and
+ * checkpoints and images aren't interchangeable.
+ */
+bool saveCheckpoint(VirtualMachine &vm, const std::string &path);
+bool loadCheckpoint(VirtualMachine &vm, const std::string &path);
+
+
+#endif // IMAGE_H
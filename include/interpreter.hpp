@@ -0,0 +1,74 @@
+#ifndef INTERPRETER_H
+#define INTERPRETER_H
+
+#include <cstddef>
+#include <string>
+
+#include "operation.hpp"
+#include "virtual_machine.hpp"
+
+/*
+ * A stage-1 text interpreter, just enough to compile the core wordset from
+ * Forth source into a boot image.
+ *
+ * Source is read a whitespace-delimited word at a time. Outside a
+ * definition, numbers are pushed and words are executed right away; between
+ * : and ; they're compiled, and the definition goes through
+ * VirtualMachine::define() like any other. Besides the primitives and the
+ * dictionary, it knows the defining words VARIABLE, CONSTANT and VALUE,
+ * TO, ' and ['], and \ and ( comments. Numbers are decimal, or hex with a
+ * leading $, and can be negative.
+ */
+class Interpreter {
+  public:
+    explicit Interpreter(VirtualMachine &vm);
+
+    Interpreter(const Interpreter&) = delete;
+
+    /*
+     * Interpret source. Returns false at the first word that can't be
+     * interpreted, or if source ends inside a definition.
+     */
+    bool interpret(const std::string &source);
+
+    /*
+     * The word interpretation stopped at, after interpret() returns false.
+     */
+    const std::string &error() const {
+      return myError;
+    }
+
+  private:
+    // Next word of the source into name, or false at the end
+    bool next(std::string &name);
+    // Skip past the next delimiter, or to the end
+    void skipPast(char delimiter);
+    bool interpretWord(const std::string &name);
+    bool compileWord(const std::string &name);
+    // Name the next word and define it as body
+    bool defineNext(const Code &body);
+    // Execution token of the word named by the next word of the source
+    bool tick(size_t &xt);
+    bool fail(const std::string &name);
+
+    VirtualMachine &myVm;
+    std::string mySource;
+    size_t myiNext;
+    bool myCompiling;
+    std::string myName;
+    Code myBody;
+    std::string myError;
+};
+
+/*
+ * Look up the primitive named name, e.g. DUP or +.
+ */
+bool primitive(const std::string &name, enum OpCode &opcode);
+
+/*
+ * Parse name as a number the way the interpreter does.
+ */
+bool parseNumber(const std::string &name, UCell &value);
+
+
+#endif // INTERPRETER_H
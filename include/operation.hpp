@@ -4,6 +4,7 @@
 #define OPERATION_H
 
 #include <cstdint>
+#include <cstring>
 #include <cmath>
 #include <algorithm>
 #include <functional>
@@ -50,6 +51,92 @@ enum OpCode {
   OPCODE_STAR_SLASH, // (n1*n2)/n3
   OPCODE_STAR_SLASH_MOD, // n1*n2 = n3*n5 + n4
 
+  /* - single-Cell division by a constant                                   */
+  // These are followed by the divisor, magic multiplier and shift
+  OPCODE_SLASH_CONSTANT,
+  OPCODE_MOD_CONSTANT,
+  OPCODE_SLASH_MOD_CONSTANT,
+  OPCODE_STAR_SLASH_MOD_CONSTANT,
+
+  /* - double-Cell arithmetic                                               */
+  // A double cell is two cells on the stack, the high cell on top
+  OPCODE_D_PLUS,
+  OPCODE_D_MINUS,
+  OPCODE_D_NEGATE,
+  OPCODE_UM_STAR, // u1*u2 = ud
+  OPCODE_M_STAR, // n1*n2 = d
+  OPCODE_UM_SLASH_MOD, // ud = u1*u3 + u2
+  OPCODE_FM_SLASH_MOD, // d = n1*n3 + n2, floored
+  OPCODE_SM_SLASH_REM, // d = n1*n3 + n2, truncated
+  OPCODE_M_STAR_SLASH, // (d1*n1)/n2, with a triple-cell intermediate
+
+  /* - double-Cell comparison                                               */
+  OPCODE_D_LESS_THAN,
+  OPCODE_D_EQUALS,
+
+  /* -- FLOATING POINT ---------------------------------------------------- */
+  // These work on the float stack, and the data stack where a cell goes in
+  // or comes out
+  OPCODE_F_PLUS,
+  OPCODE_F_MINUS,
+  OPCODE_F_STAR,
+  OPCODE_F_SLASH,
+  OPCODE_F_STAR_PLUS, // r1*r2 + r3, fused
+  OPCODE_F_SQRT,
+  OPCODE_F_LESS_THAN,
+  OPCODE_S_TO_F,
+  OPCODE_F_TO_S,
+  OPCODE_F_LITERAL, // followed by the float, in FLOAT_CELLS cells
+
+  /* -- VECTOR ------------------------------------------------------------ */
+  // These work lane-wise on the vector stack, and the data stack where
+  // cells go in or come out
+  OPCODE_V_PLUS,
+  OPCODE_V_STAR,
+  OPCODE_V_AND,
+  OPCODE_V_MIN,
+  OPCODE_V_MAX,
+  OPCODE_V_SUM, // sum of the lanes, onto the data stack
+  OPCODE_V_LOAD, // ( a-addr -- ), the VECTOR_LANES cells at a-addr
+  OPCODE_V_STORE, // ( a-addr -- ), lane 0 at a-addr
+
+  /* -- MEMORY ------------------------------------------------------------ */
+  // These work on the data space, and fail on a bad address when it's
+  // checked
+  OPCODE_FETCH,
+  OPCODE_STORE,
+  OPCODE_C_FETCH,
+  OPCODE_C_STORE,
+  OPCODE_PLUS_STORE,
+  OPCODE_F_FETCH,
+  OPCODE_F_STORE,
+  OPCODE_HERE,
+  OPCODE_ALLOT,
+  OPCODE_COMMA,
+  OPCODE_C_COMMA,
+  OPCODE_ALIGN,
+  OPCODE_CELLS, // n * the cell size in bytes; doesn't touch the data space
+  // Bulk memory and strings, with the C library doing the work
+  OPCODE_MOVE,
+  OPCODE_FILL,
+  OPCODE_ERASE,
+  OPCODE_CMOVE, // copies byte by byte from low addresses up, overlap and all
+  OPCODE_COMPARE,
+  OPCODE_SEARCH,
+  // The heap, in pages off the top of the data space. These push an ior,
+  // 0 on success, instead of failing.
+  OPCODE_ALLOCATE,
+  OPCODE_FREE,
+  OPCODE_RESIZE,
+  // Regions: heap blocks allocated from by bump pointer and released at
+  // once. These push an ior, too.
+  OPCODE_REGION,
+  OPCODE_R_ALLOT,
+  OPCODE_R_FREE_ALL,
+
+
+  /* -- SYSTEM ------------------------------------------------------------ */
+  OPCODE_SAVE_IMAGE, // ( c-addr u -- ior ), to the file named by the string
 
   /* -- STACK MANIPULATION ------------------------------------------------ */
   OPCODE_DROP,
@@ -64,11 +151,163 @@ enum OpCode {
   OPCODE_TWO_SWAP,
 
 
+  /* -- LITERALS ---------------------------------------------------------- */
+  OPCODE_LITERAL, // followed by the value
+  // Body of a VALUE word, followed by the value. Runs like a literal, but TO
+  // can change it.
+  OPCODE_VALUE,
+
+
+  /* -- CONTROL ----------------------------------------------------------- */
+  OPCODE_CALL, // followed by the xt
+  // CALL of a VALUE or deferred word that hasn't run yet, followed by the
+  // xt. Its first run quickens it into its final form.
+  OPCODE_CALL_GENERIC,
+  OPCODE_EXIT,
+  OPCODE_EXECUTE,
+  // EXECUTE with an inline cache, followed by up to two xts it has seen
+  OPCODE_EXECUTE_CACHED,
+  // Body of a deferred word, followed by the xt it currently jumps to
+  OPCODE_DEFER,
+  OPCODE_TO, // followed by the xt of a VALUE word
+  OPCODE_IS, // followed by the xt of a deferred word
+  // Filler left behind when an instruction is quickened into a shorter one
+  OPCODE_NOOP,
+
 
   OPCODE_LAST,
 };
 
 
+const size_t MAX_OPERANDS = 3;
+
+// Unused entry of an inline cache. Never an xt, since it's past the end of
+// any code space.
+const UCell::type EMPTY_CACHE_ENTRY = static_cast<UCell::type>(-1);
+
+// Cells a float takes up as an operand
+const size_t FLOAT_CELLS = (sizeof(Float) + sizeof(UCell) - 1) / sizeof(UCell);
+static_assert(FLOAT_CELLS <= MAX_OPERANDS, "floats don't fit in an operand");
+
+/*
+ * An opcode together with the operands that follow it in the instruction
+ * stream.
+ */
+struct Instruction {
+  enum OpCode opcode;
+  UCell operands[MAX_OPERANDS];
+};
+
+
+/*
+ * Signed division by a constant as a multiply-high, an add and a shift
+ * (Hacker's Delight, chapter 10). The quotient is truncated toward zero,
+ * exactly like dividing with /.
+ */
+struct MagicDivisor {
+  UCell divisor;
+  UCell magic;
+  UCell shift;
+
+  SCell quotient(SCell n) const {
+    using Signed = SCell::type;
+    using Unsigned = UCell::type;
+
+    Signed d = SCell{divisor}.get(), m = SCell{magic}.get(), q;
+    q = static_cast<Signed>((static_cast<Cells::DoubleSigned>(m) * n.get()) >> CELL_BITS);
+    if (d > 0 && m < 0) {
+      q = static_cast<Signed>(static_cast<Unsigned>(q) + n.get());
+    } else if (d < 0 && m > 0) {
+      q = static_cast<Signed>(static_cast<Unsigned>(q) - n.get());
+    }
+    q >>= shift.get();
+    q += static_cast<Unsigned>(q) >> (CELL_BITS - 1);
+
+    return SCell{q};
+  }
+
+  SCell remainder(SCell n, SCell q) const {
+    return SCell{n.get() - q.get() * SCell{divisor}.get()};
+  }
+
+  /*
+   * n1*n2 = divisor*q + r, for OPCODE_STAR_SLASH_MOD. The magic multiplier
+   * only works on single cells, so a product that doesn't fit one is divided
+   * natively.
+   */
+  void divideProduct(SCell n1, SCell n2, SCell &r, SCell &q) const {
+    using DoubleSigned = Cells::DoubleSigned;
+    using Signed = SCell::type;
+
+    const DoubleSigned d = static_cast<DoubleSigned>(n1.get()) * n2.get();
+    const Signed n = static_cast<Signed>(d);
+    if (d != n) {
+      r = SCell{static_cast<Signed>(d % SCell{divisor}.get())};
+      q = SCell{static_cast<Signed>(d / SCell{divisor}.get())};
+      return;
+    }
+    q = quotient(SCell{n});
+    r = remainder(SCell{n}, q);
+  }
+};
+
+/*
+ * The float stored in the FLOAT_CELLS operand cells starting at cells.
+ */
+inline Float floatOf(const UCell *cells) {
+  Float f;
+  std::memcpy(&f, cells, sizeof(Float));
+  return f;
+}
+
+inline void floatCells(Float f, UCell *cells) {
+  for (size_t i = 0; i < FLOAT_CELLS; i++) {
+    cells[i] = UCell{0};
+  }
+  std::memcpy(cells, &f, sizeof(Float));
+}
+
+/*
+ * Double cells, as native integers twice as wide as a cell. On the stack the
+ * high cell goes on top of the low cell.
+ */
+using DoubleSigned = Cells::DoubleSigned;
+using DoubleUnsigned = Cells::DoubleUnsigned;
+
+inline DoubleUnsigned joinDouble(UCell low, UCell high) {
+  return static_cast<DoubleUnsigned>(high.get()) << CELL_BITS | low.get();
+}
+
+inline void splitDouble(DoubleUnsigned d, UCell &low, UCell &high) {
+  low = UCell{static_cast<UCell::type>(d)};
+  high = UCell{static_cast<UCell::type>(d >> CELL_BITS)};
+}
+
+/*
+ * d = n*q + r, with the quotient rounded toward negative infinity.
+ */
+inline void floorDivide(DoubleSigned d, SCell n, SCell &r, SCell &q) {
+  DoubleSigned quotient = d / n.get(), remainder = d % n.get();
+  if (remainder != 0 && (remainder < 0) != (n.get() < 0)) {
+    quotient--;
+    remainder += n.get();
+  }
+  r = SCell{static_cast<SCell::type>(remainder)};
+  q = SCell{static_cast<SCell::type>(quotient)};
+}
+
+/*
+ * (d*n1)/n2 through a triple-cell intermediate, rounded toward zero.
+ */
+DoubleSigned scaleDouble(DoubleSigned d, SCell n1, SCell n2);
+
+/*
+ * Compute the magic multiplier and shift for divisor. Returns false for 0,
+ * 1 and -1, which don't need one.
+ */
+bool magicDivisor(SCell divisor, MagicDivisor &md);
+
+
 template<unsigned int opcode>
 class Operation {
   public:
@@ -116,6 +355,10 @@ Cell<T> operator%(Cell<T> lhs, const Cell<T>& rhs) {
 }
 template<class T>
 Cell<T> operator-(Cell<T> lhs); // TODO
+template<>
+inline SCell operator-(SCell lhs) {
+  return SCell{-lhs.get()};
+}
 namespace std {
   template<class T>
   const Cell<T> abs(Cell<T>& lhs) {
@@ -133,23 +376,23 @@ namespace std {
 
 /* - Arithmetic ------------------------------------------------------------ */
 template<class T>
-Cell<T> operator+(Cell<T> lhs, const T& rhs) {
+Cell<T> operator+(Cell<T> lhs, const typename Cell<T>::type& rhs) {
   return lhs + Cell<T>{rhs};
 }
 template<class T>
-Cell<T> operator-(Cell<T> lhs, const T& rhs) {
+Cell<T> operator-(Cell<T> lhs, const typename Cell<T>::type& rhs) {
   return lhs - Cell<T>{rhs};
 }
 template<class T>
-Cell<T> operator*(Cell<T> lhs, const T& rhs) {
+Cell<T> operator*(Cell<T> lhs, const typename Cell<T>::type& rhs) {
   return lhs * Cell<T>{rhs};
 }
 template<class T>
-Cell<T> operator/(Cell<T> lhs, const T& rhs) {
+Cell<T> operator/(Cell<T> lhs, const typename Cell<T>::type& rhs) {
   return lhs / Cell<T>{rhs};
 }
 template<class T>
-Cell<T> operator%(Cell<T> lhs, const T& rhs) {
+Cell<T> operator%(Cell<T> lhs, const typename Cell<T>::type& rhs) {
   return lhs % Cell<T>{rhs};
 }
 
@@ -196,218 +439,694 @@ Cell<T> operator==(Cell<T> lhs, const Cell<T>& rhs) {
 }
 
 template<class T>
-Cell<T> operator<(Cell<T> lhs, const T& rhs) {
+Cell<T> operator<(Cell<T> lhs, const typename Cell<T>::type& rhs) {
   return Cell<T>{lhs.get() < rhs};
 }
 template<class T>
-Cell<T> operator>(Cell<T> lhs, const T& rhs) {
+Cell<T> operator>(Cell<T> lhs, const typename Cell<T>::type& rhs) {
   return Cell<T>{lhs.get() > rhs};
 }
 template<class T>
-Cell<T> operator<=(Cell<T> lhs, const T& rhs) {
+Cell<T> operator<=(Cell<T> lhs, const typename Cell<T>::type& rhs) {
   return Cell<T>{lhs.get() <= rhs};
 }
 template<class T>
-Cell<T> operator>=(Cell<T> lhs, const T& rhs) {
+Cell<T> operator>=(Cell<T> lhs, const typename Cell<T>::type& rhs) {
   return Cell<T>{lhs.get() >= rhs};
 }
 template<class T>
-Cell<T> operator==(Cell<T> lhs, const T& rhs) {
+Cell<T> operator==(Cell<T> lhs, const typename Cell<T>::type& rhs) {
   return Cell<T>{lhs.get() == rhs};
 }
 
+/*
+ * An Operation on cells alone, defined on values: evaluate() takes the
+ * inputs and gives the outputs deepest first, as they are on the stack. On
+ * the data stack it pops its inputs and pushes its outputs, failing if there
+ * aren't enough; the optimizing tier, constant folding and the batch machine
+ * evaluate the same definition on registers, literals and lanes. The
+ * cheapest ones are defined here, so that the batch machine's lane loops
+ * inline them and vectorize.
+ */
+template<class Op, size_t nInputs, size_t nOutputs>
+class PureOperation {
+  public:
+    static const size_t INPUTS = nInputs;
+    static const size_t OUTPUTS = nOutputs;
+
+    bool operator()(DataStack &ds) const {
+      UCell in[nInputs], out[nOutputs];
+      if (!ds.popN(in, nInputs)) {
+        return false;
+      }
+      static_cast<const Op *>(this)->evaluate(in, out);
+      return ds.pushN(out, nOutputs);
+    }
+};
+
 template<>
-class Operation<OPCODE_PLUS> {
+class Operation<OPCODE_PLUS>
+  : public PureOperation<Operation<OPCODE_PLUS>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const {
+      out[0] = in[0] + in[1];
+    }
 };
 template<>
-class Operation<OPCODE_ONE_PLUS> {
+class Operation<OPCODE_ONE_PLUS>
+  : public PureOperation<Operation<OPCODE_ONE_PLUS>, 1, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const {
+      out[0] = in[0] + static_cast<UCell::type>(1);
+    }
 };
 template<>
-class Operation<OPCODE_MINUS> {
+class Operation<OPCODE_MINUS>
+  : public PureOperation<Operation<OPCODE_MINUS>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const {
+      out[0] = in[0] - in[1];
+    }
 };
 template<>
-class Operation<OPCODE_ONE_MINUS> {
+class Operation<OPCODE_ONE_MINUS>
+  : public PureOperation<Operation<OPCODE_ONE_MINUS>, 1, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const {
+      out[0] = in[0] - static_cast<UCell::type>(1);
+    }
 };
 template<>
-class Operation<OPCODE_STAR> {
+class Operation<OPCODE_STAR>
+  : public PureOperation<Operation<OPCODE_STAR>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const {
+      out[0] = in[0] * in[1];
+    }
 };
 template<>
-class Operation<OPCODE_SLASH> {
+class Operation<OPCODE_SLASH>
+  : public PureOperation<Operation<OPCODE_SLASH>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_MOD> {
+class Operation<OPCODE_MOD>
+  : public PureOperation<Operation<OPCODE_MOD>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_SLASH_MOD> {
+class Operation<OPCODE_SLASH_MOD>
+  : public PureOperation<Operation<OPCODE_SLASH_MOD>, 2, 2> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_NEGATE> {
+class Operation<OPCODE_NEGATE>
+  : public PureOperation<Operation<OPCODE_NEGATE>, 1, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const {
+      SCell n1{in[0]};
+      out[0] = std::negate<SCell>{}(n1);
+    }
 };
 template<>
-class Operation<OPCODE_ABS> {
+class Operation<OPCODE_ABS>
+  : public PureOperation<Operation<OPCODE_ABS>, 1, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_MIN> {
+class Operation<OPCODE_MIN>
+  : public PureOperation<Operation<OPCODE_MIN>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const {
+      SCell n1{in[0]}, n2{in[1]};
+      out[0] = std::min<SCell::type>(n1, n2);
+    }
 };
 template<>
-class Operation<OPCODE_MAX> {
+class Operation<OPCODE_MAX>
+  : public PureOperation<Operation<OPCODE_MAX>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const {
+      SCell n1{in[0]}, n2{in[1]};
+      out[0] = std::max<SCell::type>(n1, n2);
+    }
 };
 template<>
-class Operation<OPCODE_AND> {
+class Operation<OPCODE_AND>
+  : public PureOperation<Operation<OPCODE_AND>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const {
+      out[0] = in[0] & in[1];
+    }
 };
 template<>
-class Operation<OPCODE_OR> {
+class Operation<OPCODE_OR>
+  : public PureOperation<Operation<OPCODE_OR>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const {
+      out[0] = in[0] | in[1];
+    }
 };
 template<>
-class Operation<OPCODE_XOR> {
+class Operation<OPCODE_XOR>
+  : public PureOperation<Operation<OPCODE_XOR>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const {
+      out[0] = in[0] ^ in[1];
+    }
 };
 template<>
-class Operation<OPCODE_INVERT> {
+class Operation<OPCODE_INVERT>
+  : public PureOperation<Operation<OPCODE_INVERT>, 1, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_LSHIFT> {
+class Operation<OPCODE_LSHIFT>
+  : public PureOperation<Operation<OPCODE_LSHIFT>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_RSHIFT> {
+class Operation<OPCODE_RSHIFT>
+  : public PureOperation<Operation<OPCODE_RSHIFT>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_TWO_STAR> {
+class Operation<OPCODE_TWO_STAR>
+  : public PureOperation<Operation<OPCODE_TWO_STAR>, 1, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_TWO_SLASH> {
+class Operation<OPCODE_TWO_SLASH>
+  : public PureOperation<Operation<OPCODE_TWO_SLASH>, 1, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_LESS_THAN> {
+class Operation<OPCODE_LESS_THAN>
+  : public PureOperation<Operation<OPCODE_LESS_THAN>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_EQUALS> {
+class Operation<OPCODE_EQUALS>
+  : public PureOperation<Operation<OPCODE_EQUALS>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_GREATER_THAN> {
+class Operation<OPCODE_GREATER_THAN>
+  : public PureOperation<Operation<OPCODE_GREATER_THAN>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_ZERO_LESS_THAN> {
+class Operation<OPCODE_ZERO_LESS_THAN>
+  : public PureOperation<Operation<OPCODE_ZERO_LESS_THAN>, 1, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_ZERO_EQUALS> {
+class Operation<OPCODE_ZERO_EQUALS>
+  : public PureOperation<Operation<OPCODE_ZERO_EQUALS>, 1, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_U_LESS_THAN> {
+class Operation<OPCODE_U_LESS_THAN>
+  : public PureOperation<Operation<OPCODE_U_LESS_THAN>, 2, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_STAR_SLASH> {
+class Operation<OPCODE_STAR_SLASH>
+  : public PureOperation<Operation<OPCODE_STAR_SLASH>, 3, 1> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
 };
 template<>
-class Operation<OPCODE_STAR_SLASH_MOD> {
+class Operation<OPCODE_STAR_SLASH_MOD>
+  : public PureOperation<Operation<OPCODE_STAR_SLASH_MOD>, 3, 2> {
   public:
-    void operator()(DataStack &ds);
+    void evaluate(const UCell *in, UCell *out) const;
+};
+template<>
+class Operation<OPCODE_D_PLUS>
+  : public PureOperation<Operation<OPCODE_D_PLUS>, 4, 2> {
+  public:
+    void evaluate(const UCell *in, UCell *out) const;
+};
+template<>
+class Operation<OPCODE_D_MINUS>
+  : public PureOperation<Operation<OPCODE_D_MINUS>, 4, 2> {
+  public:
+    void evaluate(const UCell *in, UCell *out) const;
+};
+template<>
+class Operation<OPCODE_D_NEGATE>
+  : public PureOperation<Operation<OPCODE_D_NEGATE>, 2, 2> {
+  public:
+    void evaluate(const UCell *in, UCell *out) const;
+};
+template<>
+class Operation<OPCODE_UM_STAR>
+  : public PureOperation<Operation<OPCODE_UM_STAR>, 2, 2> {
+  public:
+    void evaluate(const UCell *in, UCell *out) const;
+};
+template<>
+class Operation<OPCODE_M_STAR>
+  : public PureOperation<Operation<OPCODE_M_STAR>, 2, 2> {
+  public:
+    void evaluate(const UCell *in, UCell *out) const;
+};
+template<>
+class Operation<OPCODE_UM_SLASH_MOD>
+  : public PureOperation<Operation<OPCODE_UM_SLASH_MOD>, 3, 2> {
+  public:
+    void evaluate(const UCell *in, UCell *out) const;
+};
+template<>
+class Operation<OPCODE_FM_SLASH_MOD>
+  : public PureOperation<Operation<OPCODE_FM_SLASH_MOD>, 3, 2> {
+  public:
+    void evaluate(const UCell *in, UCell *out) const;
+};
+template<>
+class Operation<OPCODE_SM_SLASH_REM>
+  : public PureOperation<Operation<OPCODE_SM_SLASH_REM>, 3, 2> {
+  public:
+    void evaluate(const UCell *in, UCell *out) const;
+};
+template<>
+class Operation<OPCODE_M_STAR_SLASH>
+  : public PureOperation<Operation<OPCODE_M_STAR_SLASH>, 4, 2> {
+  public:
+    void evaluate(const UCell *in, UCell *out) const;
+};
+template<>
+class Operation<OPCODE_D_LESS_THAN>
+  : public PureOperation<Operation<OPCODE_D_LESS_THAN>, 4, 1> {
+  public:
+    void evaluate(const UCell *in, UCell *out) const;
+};
+template<>
+class Operation<OPCODE_D_EQUALS>
+  : public PureOperation<Operation<OPCODE_D_EQUALS>, 4, 1> {
+  public:
+    void evaluate(const UCell *in, UCell *out) const;
+};
+template<>
+class Operation<OPCODE_SLASH_CONSTANT>
+  : public PureOperation<Operation<OPCODE_SLASH_CONSTANT>, 1, 1> {
+  public:
+    Operation(const MagicDivisor &divisor)
+      : myDivisor(divisor) { }
+
+    void evaluate(const UCell *in, UCell *out) const;
+
+  private:
+    MagicDivisor myDivisor;
+};
+template<>
+class Operation<OPCODE_MOD_CONSTANT>
+  : public PureOperation<Operation<OPCODE_MOD_CONSTANT>, 1, 1> {
+  public:
+    Operation(const MagicDivisor &divisor)
+      : myDivisor(divisor) { }
+
+    void evaluate(const UCell *in, UCell *out) const;
+
+  private:
+    MagicDivisor myDivisor;
+};
+template<>
+class Operation<OPCODE_SLASH_MOD_CONSTANT>
+  : public PureOperation<Operation<OPCODE_SLASH_MOD_CONSTANT>, 1, 2> {
+  public:
+    Operation(const MagicDivisor &divisor)
+      : myDivisor(divisor) { }
+
+    void evaluate(const UCell *in, UCell *out) const;
+
+  private:
+    MagicDivisor myDivisor;
+};
+template<>
+class Operation<OPCODE_STAR_SLASH_MOD_CONSTANT>
+  : public PureOperation<Operation<OPCODE_STAR_SLASH_MOD_CONSTANT>, 2, 2> {
+  public:
+    Operation(const MagicDivisor &divisor)
+      : myDivisor(divisor) { }
+
+    void evaluate(const UCell *in, UCell *out) const;
+
+  private:
+    MagicDivisor myDivisor;
 };
 template<>
 class Operation<OPCODE_DROP> {
   public:
-    void operator()(DataStack &ds);
+    bool operator()(DataStack &ds);
 };
 template<>
 class Operation<OPCODE_DUP> {
   public:
-    void operator()(DataStack &ds);
+    bool operator()(DataStack &ds);
 };
 template<>
 class Operation<OPCODE_OVER> {
   public:
-    void operator()(DataStack &ds);
+    bool operator()(DataStack &ds);
 };
 template<>
 class Operation<OPCODE_SWAP> {
   public:
-    void operator()(DataStack &ds);
+    bool operator()(DataStack &ds);
 };
 template<>
 class Operation<OPCODE_ROT> {
   public:
-    void operator()(DataStack &ds);
+    bool operator()(DataStack &ds);
 };
 template<>
 class Operation<OPCODE_QUESTION_DUP> {
   public:
-    void operator()(DataStack &ds);
+    bool operator()(DataStack &ds);
 }; // TODO
 template<>
 class Operation<OPCODE_TWO_DROP> {
   public:
-    void operator()(DataStack &ds);
+    bool operator()(DataStack &ds);
 };
 template<>
 class Operation<OPCODE_TWO_DUP> {
   public:
-    void operator()(DataStack &ds);
+    bool operator()(DataStack &ds);
 };
 template<>
 class Operation<OPCODE_TWO_OVER> {
   public:
-    void operator()(DataStack &ds);
+    bool operator()(DataStack &ds);
 };
 template<>
 class Operation<OPCODE_TWO_SWAP> {
   public:
+    bool operator()(DataStack &ds);
+};
+template<>
+class Operation<OPCODE_LITERAL> {
+  public:
+    Operation(UCell value)
+      : myValue{value} { }
+
     void operator()(DataStack &ds);
+
+  private:
+    UCell myValue;
+};
+
+/* -- Floating point ------------------------------------------------------ */
+template<>
+class Operation<OPCODE_F_PLUS> {
+  public:
+    bool operator()(DataStack &ds, FStack &fs);
+};
+template<>
+class Operation<OPCODE_F_MINUS> {
+  public:
+    bool operator()(DataStack &ds, FStack &fs);
+};
+template<>
+class Operation<OPCODE_F_STAR> {
+  public:
+    bool operator()(DataStack &ds, FStack &fs);
+};
+template<>
+class Operation<OPCODE_F_SLASH> {
+  public:
+    bool operator()(DataStack &ds, FStack &fs);
 };
+template<>
+class Operation<OPCODE_F_STAR_PLUS> {
+  public:
+    bool operator()(DataStack &ds, FStack &fs);
+};
+template<>
+class Operation<OPCODE_F_SQRT> {
+  public:
+    bool operator()(DataStack &ds, FStack &fs);
+};
+template<>
+class Operation<OPCODE_F_LESS_THAN> {
+  public:
+    bool operator()(DataStack &ds, FStack &fs);
+};
+template<>
+class Operation<OPCODE_S_TO_F> {
+  public:
+    bool operator()(DataStack &ds, FStack &fs);
+};
+template<>
+class Operation<OPCODE_F_TO_S> {
+  public:
+    bool operator()(DataStack &ds, FStack &fs);
+};
+template<>
+class Operation<OPCODE_F_LITERAL> {
+  public:
+    Operation(Float value)
+      : myValue{value} { }
+
+    void operator()(DataStack &ds, FStack &fs);
 
+  private:
+    Float myValue;
+};
 
+/* -- Vector ------------------------------------------------------------ */
+template<>
+class Operation<OPCODE_V_PLUS> {
+  public:
+    bool operator()(DataStack &ds, VStack &vs);
+};
+template<>
+class Operation<OPCODE_V_STAR> {
+  public:
+    bool operator()(DataStack &ds, VStack &vs);
+};
+template<>
+class Operation<OPCODE_V_AND> {
+  public:
+    bool operator()(DataStack &ds, VStack &vs);
+};
+template<>
+class Operation<OPCODE_V_MIN> {
+  public:
+    bool operator()(DataStack &ds, VStack &vs);
+};
+template<>
+class Operation<OPCODE_V_MAX> {
+  public:
+    bool operator()(DataStack &ds, VStack &vs);
+};
+template<>
+class Operation<OPCODE_V_SUM> {
+  public:
+    bool operator()(DataStack &ds, VStack &vs);
+};
+template<>
+class Operation<OPCODE_V_LOAD> {
+  public:
+    bool operator()(DataStack &ds, VStack &vs, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_V_STORE> {
+  public:
+    bool operator()(DataStack &ds, VStack &vs, DataSpace &space);
+};
+
+/* -- Memory ------------------------------------------------------------ */
+template<>
+class Operation<OPCODE_FETCH> {
+  public:
+    bool operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_STORE> {
+  public:
+    bool operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_C_FETCH> {
+  public:
+    bool operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_C_STORE> {
+  public:
+    bool operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_PLUS_STORE> {
+  public:
+    bool operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_F_FETCH> {
+  public:
+    bool operator()(DataStack &ds, FStack &fs, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_F_STORE> {
+  public:
+    bool operator()(DataStack &ds, FStack &fs, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_HERE> {
+  public:
+    void operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_ALLOT> {
+  public:
+    bool operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_COMMA> {
+  public:
+    bool operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_C_COMMA> {
+  public:
+    bool operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_ALIGN> {
+  public:
+    bool operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_CELLS>
+  : public PureOperation<Operation<OPCODE_CELLS>, 1, 1> {
+  public:
+    void evaluate(const UCell *in, UCell *out) const;
+};
+template<>
+class Operation<OPCODE_MOVE> {
+  public:
+    bool operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_FILL> {
+  public:
+    bool operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_ERASE> {
+  public:
+    bool operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_CMOVE> {
+  public:
+    bool operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_COMPARE> {
+  public:
+    bool operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_SEARCH> {
+  public:
+    bool operator()(DataStack &ds, DataSpace &space);
+};
+template<>
+class Operation<OPCODE_ALLOCATE> {
+  public:
+    bool operator()(DataStack &ds, Heap &heap);
+};
+template<>
+class Operation<OPCODE_FREE> {
+  public:
+    bool operator()(DataStack &ds, Heap &heap);
+};
+template<>
+class Operation<OPCODE_RESIZE> {
+  public:
+    bool operator()(DataStack &ds, Heap &heap);
+};
+template<>
+class Operation<OPCODE_REGION> {
+  public:
+    bool operator()(DataStack &ds, Heap &heap);
+};
+template<>
+class Operation<OPCODE_R_ALLOT> {
+  public:
+    bool operator()(DataStack &ds, Heap &heap);
+};
+template<>
+class Operation<OPCODE_R_FREE_ALL> {
+  public:
+    bool operator()(DataStack &ds, Heap &heap);
+};
+
+/* -- System ------------------------------------------------------------ */
+template<>
+class Operation<OPCODE_SAVE_IMAGE> {
+  public:
+    bool operator()(DataStack &ds, VirtualMachine &vm);
+};
+
+
+
+/*
+ * Number of cells following opcode in the instruction stream.
+ */
+size_t operandCount(enum OpCode opcode);
+
+/*
+ * Read the instruction at code[i] and advance i past it. Returns false for
+ * an invalid opcode or missing operands.
+ */
+bool decode(const Code &code, size_t &i, Instruction &instruction);
+
+void encode(const Instruction &instruction, Code &code);
+
+/*
+ * Evaluate the pure Operation an instruction stands for on values instead
+ * of stack cells, in and out deepest first. Returns false for instructions
+ * that aren't pure.
+ */
+bool evaluate(const Instruction &instruction, const UCell *in, UCell *out);
+
+/*
+ * Run the Operation for opcode against ds. Returns false for opcodes that
+ * aren't a plain data stack Operation.
+ */
+bool dispatch(enum OpCode opcode, DataStack &ds);
+
+/*
+ * Run an instruction that carries operands against ds.
+ */
+bool dispatch(const Instruction &instruction, DataStack &ds);
+
+/*
+ * Run an instruction against vm's stacks and data space, for the float,
+ * vector, memory and system words. Doesn't cover the control
+ * instructions.
+ */
+bool dispatch(const Instruction &instruction, VirtualMachine &vm);
 
 
 #endif // OPERATION_H
@@ -0,0 +1,62 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <cstddef>
+#include <initializer_list>
+#include <vector>
+
+#include "dictionary.hpp"
+#include "operation.hpp"
+
+/*
+ * Peephole optimizer over the instruction stream.
+ *
+ * Every instruction is appended to the output and then the tail of the
+ * output is matched against the rewrite rules. A rewrite replaces the tail
+ * and feeds its replacement back through the same rules, so rewrites chain:
+ * "2 3 + 4 *" ends up as a single literal.
+ *
+ * Given a dictionary, calls to words whose bodies fit in inlineBudget cells
+ * are replaced by the body itself, which then goes through the rules too.
+ * Calls to words up to specializeBudget cells that are passed literal
+ * arguments go to a clone of the word with the arguments folded in. Clones
+ * are kept in the dictionary and shared by every call with the same
+ * arguments.
+ */
+class Optimizer {
+  public:
+    explicit Optimizer(Dictionary *pDictionary = nullptr,
+                       size_t inlineBudget = 0, size_t specializeBudget = 0);
+
+    /*
+     * Returns false if code contains an invalid opcode or is missing an
+     * operand.
+     */
+    bool optimize(const Code &code, Code &optimized);
+
+  private:
+    void emit(const Instruction &instruction);
+    void replace(size_t n, std::initializer_list<Instruction> with);
+    bool tailIs(std::initializer_list<enum OpCode> opcodes) const;
+
+    // Literals through pure operations
+    bool fold();
+    // Identities and strength reduction
+    bool simplify();
+    // Division by a literal
+    bool divideByConstant();
+    // Calls to small words
+    bool inlineCall(const Instruction &instruction);
+    // Calls with literal arguments
+    bool specializeCall(const Instruction &instruction);
+
+    Dictionary *mypDictionary;
+    size_t myInlineBudget;
+    size_t mySpecializeBudget;
+    std::vector<Instruction> myInstructions;
+    // Words currently being inlined, to stop at recursion
+    std::vector<size_t> myInlining;
+};
+
+
+#endif // OPTIMIZER_H
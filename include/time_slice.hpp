@@ -0,0 +1,51 @@
+#ifndef TIME_SLICE_H
+#define TIME_SLICE_H
+
+#include <atomic>
+#include <cstddef>
+
+#include <time.h>
+
+/*
+ * A one-shot timer that sets a flag when a time slice is up, for
+ * VirtualMachine::run(preempt).
+ *
+ * The timer is a POSIX timer_create() timer that raises SIGALRM with the
+ * flag's address attached, and the handler does nothing but set the flag,
+ * so any number of slices can be running at once, in any threads. Time
+ * slices are fairer than fuel when some words (division, MOVE over a big
+ * buffer) cost far more than others. The handler is installed the first
+ * time a slice is started, replacing any other SIGALRM handler; SIGALRMs
+ * that don't come from a slice's timer are ignored.
+ */
+class TimeSlice {
+  public:
+    TimeSlice();
+
+    TimeSlice(const TimeSlice&) = delete;
+
+    ~TimeSlice();
+
+    /*
+     * Clear the flag and set it again after microseconds. Returns false if
+     * the timer can't be created or set.
+     */
+    bool start(size_t microseconds);
+
+    /*
+     * Stop the timer without setting the flag.
+     */
+    void stop();
+
+    const std::atomic<bool> &expired() const {
+      return myExpired;
+    }
+
+  private:
+    std::atomic<bool> myExpired;
+    timer_t myTimer;
+    bool myCreated;
+};
+
+
+#endif // TIME_SLICE_H
@@ -2,46 +2,81 @@
 #ifndef VIRTUAL_MACHINE_H
 #define VIRTUAL_MACHINE_H
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <memory>
 #include <cmath>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+
+// Cell width in bits, chosen at build time (make CELL_BITS=64)
+#ifndef BBFORTH_CELL_BITS
+#define BBFORTH_CELL_BITS 32
+#endif
+
+// Whether memory accesses are checked against the data space
+// (make CHECKED_MEMORY=0 to turn it off)
+#ifndef BBFORTH_CHECKED_MEMORY
+#define BBFORTH_CHECKED_MEMORY 1
+#endif
+
+/*
+ * The integer types behind cells of a given width, plus integers twice as
+ * wide for intermediates that mustn't overflow.
+ */
+template<unsigned int bits>
+struct CellPolicy;
+
+template<>
+struct CellPolicy<32> {
+  using Signed = int32_t;
+  using Unsigned = uint32_t;
+  using DoubleSigned = int64_t;
+  using DoubleUnsigned = uint64_t;
+};
+
+template<>
+struct CellPolicy<64> {
+  using Signed = int64_t;
+  using Unsigned = uint64_t;
+  using DoubleSigned = __int128;
+  using DoubleUnsigned = unsigned __int128;
+};
 
+using Cells = CellPolicy<BBFORTH_CELL_BITS>;
 
 
+/*
+ * A trivial type, so arrays of cells can be left uninitialized and moved
+ * around with memcpy. Like any trivial type, a default-constructed Cell
+ * holds garbage; value-initialize it (Cell{}) to get 0.
+ */
 template<class T>
 class Cell {
   public:
     using type = T;
 
-    Cell(T data = 0)
+    Cell() = default;
+
+    Cell(T data)
       : value{data}
     {
     }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wnarrowing"
-    Cell(const Cell<unsigned int>& other)
-      : value{other.value} { }
-
-    Cell(const Cell<int>& other)
-      : value{other.value} { }
+    // Reinterprets the bits between signed and unsigned cells. A template is
+    // never a copy constructor, so copying stays trivial.
+    template<class U>
+    Cell(const Cell<U>& other)
+      : value{static_cast<T>(other.value)} { }
 
-    operator Cell<int>() const {
-      return Cell{static_cast<int>(value)};
-    }
-
-    operator Cell<unsigned int>() const {
-      return Cell{static_cast<unsigned int>(value)};
-    }
-
-    operator bool() const {
+    explicit operator bool() const {
       return static_cast<bool>(value);
     }
-#pragma GCC diagnostic pop
-
-    ~Cell()
-    {
-    }
 
     T get() const {
       return value;
@@ -52,79 +87,445 @@ class Cell {
 
 
 
-using SCell = Cell<int>;
-using UCell = Cell<unsigned int>;
+using SCell = Cell<Cells::Signed>;
+using UCell = Cell<Cells::Unsigned>;
+
+static_assert(std::is_trivial<SCell>::value && std::is_trivial<UCell>::value,
+              "cells must be trivial");
+static_assert(sizeof(SCell) == sizeof(UCell),
+              "signed and unsigned cells must have the same layout");
+
+const unsigned int CELL_BITS = sizeof(UCell::type) * 8;
+
+/*
+ * A sequence of instructions, in execution order.
+ */
+using Code = std::vector<UCell>;
 
 
 const size_t DATA_STACK_DEFAULT_SIZE = 256;
 const size_t INSTRUCTION_STACK_DEFAULT_SIZE = 1024;
-
+const size_t FLOAT_STACK_DEFAULT_SIZE = 256;
+const size_t VECTOR_STACK_DEFAULT_SIZE = 64;
+const size_t DATA_SPACE_DEFAULT_SIZE = 64 * 1024;
+// Calls to words with bodies up to this many cells are inlined
+const size_t INLINE_BUDGET_DEFAULT_SIZE = 8;
+// Words with bodies up to this many cells are specialized on literal arguments
+const size_t SPECIALIZE_BUDGET_DEFAULT_SIZE = 64;
+
+/*
+ * A fixed-size stack of trivially copyable elements: cells, or floats.
+ * Values of any type convertible to and from Element can be pushed and
+ * popped, so SCells and UCells share one cell stack.
+ */
+template<class Element>
 class Stack {
   public:
-    Stack(size_t size);
+    Stack(size_t size)
+      : myStackSize{size},
+      mypStack{new Element[size]},
+      myiTop{0}
+    {
+    }
 
     Stack(const Stack&) = delete;
 
+    size_t size() const {
+      return myStackSize;
+    }
+
+    size_t depth() const {
+      return myiTop;
+    }
+
+    void clear() {
+      myiTop = 0;
+    }
+
+    /*
+     * Pop everything above depth.
+     */
+    void truncate(size_t depth) {
+      myiTop = std::min(myiTop, depth);
+    }
+
     template<class T>
-    bool peek(Cell<T> &c) {
-      if (myStackEmpty) {
+    bool peek(T &c) {
+      if (myiTop == 0) {
         return false;
       }
 
-      c = mypStack.get()[myiTop];
+      c = T(mypStack.get()[myiTop - 1]);
 
       return true;
     }
 
     template<class T>
-    bool push(Cell<T> c) {
+    bool push(T c) {
       if (myiTop == myStackSize) {
         return false;
       }
 
-      if (myStackEmpty) {
-        myStackEmpty = false;
+      mypStack[myiTop++] = Element(c);
+
+      return true;
+    };
+
+    template<class T>
+    bool pop(T &c) {
+      if (myiTop == 0) {
+        return false;
       }
 
-      mypStack[++myiTop] = c;
+      c = T(mypStack.get()[--myiTop]);
 
       return true;
-    };
+    }
 
+    /*
+     * Push count elements at once, elements[0] first, so it ends up
+     * deepest. Pushes nothing if they don't all fit.
+     */
     template<class T>
-    bool pop(Cell<T> &c) {
-      if (myStackEmpty) {
+    bool pushN(const T *elements, size_t count) {
+      static_assert(sizeof(T) == sizeof(Element), "element size mismatch");
+      if (myStackSize - myiTop < count) {
         return false;
       }
 
-      if (myiTop == 0) {
-        myStackEmpty = true;
+      std::memcpy(mypStack.get() + myiTop, elements, count * sizeof(Element));
+      myiTop += count;
+
+      return true;
+    }
+
+    /*
+     * Pop the top count elements at once into elements, deepest first: the
+     * reverse of pushN. Pops nothing if there aren't that many.
+     */
+    template<class T>
+    bool popN(T *elements, size_t count) {
+      static_assert(sizeof(T) == sizeof(Element), "element size mismatch");
+      if (myiTop < count) {
+        return false;
       }
 
-      c = mypStack.get()[myiTop--];
+      myiTop -= count;
+      std::memcpy(elements, mypStack.get() + myiTop, count * sizeof(Element));
 
       return true;
     }
 
+    /*
+     * The top count elements in place, deepest first, or nullptr if there
+     * aren't that many. Only valid until the stack is next changed.
+     */
+    const Element *view(size_t count) const {
+      if (myiTop < count) {
+        return nullptr;
+      }
+
+      return mypStack.get() + myiTop - count;
+    }
+
   private:
     size_t myStackSize;
-    std::unique_ptr<UCell[]> mypStack;
-    bool myStackEmpty;
+    std::unique_ptr<Element[]> mypStack;
     size_t myiTop;
 };
 
-class DataStack : public Stack {
+class DataStack : public Stack<UCell> {
   public:
     DataStack(size_t size = DATA_STACK_DEFAULT_SIZE)
       : Stack{size} {}
 };
 
-class InstructionStack : public Stack {
+class InstructionStack : public Stack<UCell> {
   public:
     InstructionStack(size_t size = INSTRUCTION_STACK_DEFAULT_SIZE)
       : Stack{size} {}
 };
 
+/*
+ * Floating-point numbers live on a stack of their own, as in standard
+ * Forth.
+ */
+using Float = double;
+
+class FStack : public Stack<Float> {
+  public:
+    FStack(size_t size = FLOAT_STACK_DEFAULT_SIZE)
+      : Stack{size} {}
+};
+
+/*
+ * An AVX2 register's worth of cells, for the data-parallel words. Vectors
+ * live on a stack of their own, too.
+ */
+const size_t VECTOR_BITS = 256;
+const size_t VECTOR_LANES = VECTOR_BITS / CELL_BITS;
+
+struct Vector {
+  UCell lanes[VECTOR_LANES];
+};
+
+static_assert(std::is_trivial<Vector>::value, "vectors must be trivial");
+
+class VStack : public Stack<Vector> {
+  public:
+    VStack(size_t size = VECTOR_STACK_DEFAULT_SIZE)
+      : Stack{size} {}
+};
+
+/*
+ * Addressable memory, for variables and data structures. Addresses are
+ * byte offsets into the data space. HERE is the first byte not yet
+ * allocated; ALLOT and , move it up. The heap takes pages off the top,
+ * moving the limit HERE can reach down.
+ *
+ * Cells and floats have to be aligned to the cell size, bytes to nothing.
+ * When built with BBFORTH_CHECKED_MEMORY, every access is checked to be
+ * aligned and inside the data space, and a bad one fails. Otherwise
+ * accesses go straight to memory, and a bad address is undefined behavior.
+ * Allocation is always checked.
+ *
+ * The memory is a private mapping of a snapshot: zeroes to start with, or a
+ * file such as an image. Pages are only copied when they're written to, and
+ * rewinding drops the copies, so going back to the snapshot costs nothing
+ * per page and leaves the pages shared with everything else mapping it.
+ */
+class DataSpace {
+  public:
+    DataSpace(size_t size = DATA_SPACE_DEFAULT_SIZE);
+
+    DataSpace(const DataSpace&) = delete;
+
+    ~DataSpace();
+
+    size_t size() const {
+      return mySize;
+    }
+
+    size_t here() const {
+      return myHere;
+    }
+
+    size_t limit() const {
+      return myLimit;
+    }
+
+    /*
+     * Move HERE by n bytes, back if n is negative.
+     */
+    bool allot(SCell::type n) {
+      if (n >= 0 ? myLimit - myHere < static_cast<size_t>(n)
+                 : myHere < 0 - static_cast<size_t>(n)) {
+        return false;
+      }
+
+      myHere += n;
+
+      return true;
+    }
+
+    /*
+     * Round HERE up to the next cell boundary.
+     */
+    bool align() {
+      const size_t misalignment = myHere % sizeof(UCell);
+      return misalignment == 0
+        || allot(static_cast<SCell::type>(sizeof(UCell) - misalignment));
+    }
+
+    template<class T>
+    bool fetch(UCell::type address, T &value) const {
+      if (!valid<T>(address)) {
+        return false;
+      }
+
+      std::memcpy(&value, mypSpace.get() + address, sizeof(T));
+
+      return true;
+    }
+
+    template<class T>
+    bool store(UCell::type address, const T &value) {
+      if (!valid<T>(address)) {
+        return false;
+      }
+
+      std::memcpy(mypSpace.get() + address, &value, sizeof(T));
+      myChanged = true;
+
+      return true;
+    }
+
+    /*
+     * The length bytes at address, for the bulk memory words, or nullptr
+     * if they're not all inside the data space.
+     */
+    unsigned char *bytes(UCell::type address, UCell::type length) {
+#if BBFORTH_CHECKED_MEMORY
+      if (address > mySize || mySize - address < length) {
+        return nullptr;
+      }
+#else
+      (void) length;
+#endif
+      myChanged = true;
+      return mypSpace.get() + address;
+    }
+
+    /*
+     * Store value at HERE and allocate it.
+     */
+    template<class T>
+    bool comma(const T &value) {
+      if (myLimit - myHere < sizeof(T) || !store(myHere, value)) {
+        return false;
+      }
+
+      myHere += sizeof(T);
+
+      return true;
+    }
+
+    /*
+     * Take n bytes off the top of the free space, for the heap, starting
+     * on a multiple of alignment (a power of two).
+     */
+    bool reserve(size_t n, size_t alignment, UCell::type &address) {
+      if (myLimit - myHere < n
+          || ((myLimit - n) & ~(alignment - 1)) < myHere) {
+        return false;
+      }
+
+      myLimit = (myLimit - n) & ~(alignment - 1);
+      address = static_cast<UCell::type>(myLimit);
+
+      return true;
+    }
+
+    /*
+     * Give back everything reserve() took.
+     */
+    void release() {
+      myLimit = mySize;
+    }
+
+    /*
+     * Switch to memory the data space didn't allocate, e.g. a mapped
+     * checkpoint, with its first here bytes allocated. destroy(memory, size)
+     * is called when the data space is done with it. The snapshot stays as
+     * it was.
+     */
+    void adopt(unsigned char *memory, size_t size, size_t here,
+               void (*destroy)(unsigned char *, size_t));
+
+    /*
+     * The same, for memory that's a private read-write mapping of size
+     * bytes of fd at offset, e.g. an image's data. That becomes the
+     * snapshot, with here bytes allocated; fd is duplicated, so the caller
+     * can close it.
+     */
+    void adopt(unsigned char *memory, size_t size, size_t here,
+               void (*destroy)(unsigned char *, size_t), int fd,
+               size_t offset);
+
+    /*
+     * Make the contents below HERE, with zeroes above, what rewind() goes
+     * back to. Unless the data space is still the snapshot it was mapped
+     * from, they're copied into a memfd, once. Throws std::bad_alloc if
+     * they can't be.
+     */
+    void snapshot();
+
+    /*
+     * Go back to the snapshot, with everything above it free.
+     */
+    void rewind();
+
+    /*
+     * Move the top of what HERE can reach, e.g. back to where it was when
+     * a checkpoint was taken.
+     */
+    bool setLimit(size_t limit) {
+      if (limit < myHere || limit > mySize) {
+        return false;
+      }
+
+      myLimit = limit;
+
+      return true;
+    }
+
+    /*
+     * Copy the first n bytes out, for restore().
+     */
+    void save(size_t n, std::vector<unsigned char> &image) const {
+      image.assign(mypSpace.get(), mypSpace.get() + n);
+    }
+
+    /*
+     * Put image back at the bottom, zero everything above it and allocate
+     * exactly it, heap included.
+     */
+    void restore(const std::vector<unsigned char> &image) {
+      std::copy(image.begin(), image.end(), mypSpace.get());
+      std::memset(mypSpace.get() + image.size(), 0, mySize - image.size());
+      myHere = image.size();
+      myLimit = mySize;
+      myChanged = true;
+    }
+
+  private:
+    struct Deleter {
+      void (*destroy)(unsigned char *, size_t);
+      size_t size;
+
+      void operator()(unsigned char *memory) const {
+        destroy(memory, size);
+      }
+    };
+
+    template<class T>
+    bool valid(UCell::type address) const {
+#if BBFORTH_CHECKED_MEMORY
+      const size_t alignment = std::min(sizeof(T), sizeof(UCell));
+      return address <= mySize && mySize - address >= sizeof(T)
+        && address % alignment == 0;
+#else
+      return true;
+#endif
+    }
+
+    // Map mySnapshot privately in place of the memory there is now
+    void mapSnapshot();
+
+    struct Snapshot {
+      // Zeroes if there's no file
+      int fd;
+      size_t offset;
+      size_t size;
+      size_t here;
+    };
+
+    size_t mySize;
+    std::unique_ptr<unsigned char, Deleter> mypSpace;
+    size_t myHere;
+    // Top of what HERE can reach; the heap is above it
+    size_t myLimit;
+    Snapshot mySnapshot;
+    // Whether the memory is a mapping of mySnapshot, and whether anything
+    // might have been written to it since it was mapped
+    bool myMapped;
+    bool myChanged;
+};
+
+
+class Dictionary;
+class Heap;
+struct Instruction;
 
 class VirtualMachine {
   public:
@@ -133,9 +534,160 @@ class VirtualMachine {
 
     bool runOnce();
 
+    /*
+     * Run code to completion against this machine's data stack.
+     */
+    bool execute(const Code &code);
+
+    /*
+     * Call the word at xt and run until it returns.
+     */
+    bool execute(size_t xt);
+
+    /*
+     * Call the word at xt without running it, for a host that runs the
+     * machine a step at a time with runOnce(), until it's no longer
+     * running(). Fails if it's running already.
+     */
+    bool start(size_t xt);
+
+    bool running() const;
+
+    /*
+     * Run a started machine until it stops. Returns false, stopping the
+     * machine, on an error.
+     */
+    bool run();
+
+    /*
+     * Run a started machine until it stops or has made fuel calls, for
+     * bounded execution. The fuel left over is put back in fuel. If the
+     * machine ran out it's still running(), paused just inside the last
+     * call, and another run() carries on from there.
+     *
+     * Without branches in the instruction set, every unbounded computation
+     * recurses, so counting calls bounds the work between checks by the
+     * size of the code. Fuel is checked only when a call is made; an
+     * unfueled run is a separate instantiation of the run loop with no
+     * checks at all.
+     */
+    bool run(size_t &fuel);
+
+    /*
+     * Run a started machine until it stops or preempt is set, e.g. by a
+     * TimeSlice, pausing it the same way as running out of fuel. preempt is
+     * only checked when a call is made, and is left as it is.
+     */
+    bool run(const std::atomic<bool> &preempt);
+
+    /*
+     * Record the dictionary and data space as they are now as the state
+     * reset() goes back to. Until this is called, that's an empty machine.
+     */
+    void markBooted();
+
+    /*
+     * Go back to the state markBooted() recorded: empty stacks and heap,
+     * and the dictionary and data space as they were. The data space's
+     * pages written since are dropped rather than copied over, so a machine
+     * that's been reset holds no private copy of them.
+     */
+    void reset();
+
+    /*
+     * Optimize body and add it to the dictionary as name. Calls to words
+     * that fit in the inline budget are inlined, and calls with literal
+     * arguments to words that fit in the specialize budget go to a clone
+     * specialized on those arguments.
+     */
+    bool define(const std::string &name, const Code &body, size_t &xt);
+
+    void setInlineBudget(size_t cells) {
+      myInlineBudget = cells;
+    }
+
+    void setSpecializeBudget(size_t cells) {
+      mySpecializeBudget = cells;
+    }
+
+    DataStack &dataStack() {
+      return myDataStack;
+    }
+
+    FStack &floatStack() {
+      return myFloatStack;
+    }
+
+    VStack &vectorStack() {
+      return myVectorStack;
+    }
+
+    DataSpace &dataSpace() {
+      return myDataSpace;
+    }
+
+    Heap &heap() {
+      return *mypHeap;
+    }
+
+    Dictionary &dictionary() {
+      return *mypDictionary;
+    }
+
+    /*
+     * Where a running machine is up to, for checkpoints: the next
+     * instruction, and the return addresses.
+     */
+    size_t ip() const {
+      return myIp;
+    }
+
+    void jump(size_t ip) {
+      myIp = ip;
+    }
+
+    InstructionStack &returnStack() {
+      return myInstructionStack;
+    }
+
   private:
+    // What a run loop checks when a call is made
+    enum Safepoint {
+      SAFEPOINT_NONE,
+      SAFEPOINT_FUEL,
+      SAFEPOINT_FLAG,
+    };
+
+    template<enum Safepoint safepoint>
+    bool step();
+    template<enum Safepoint safepoint>
+    bool loop();
+    template<enum Safepoint safepoint>
+    bool call(size_t xt);
+    template<enum Safepoint safepoint>
+    void poll();
+    template<enum Safepoint safepoint>
+    bool executeCached(size_t site, const Instruction &instruction, size_t xt);
+    bool quicken(size_t site, const Instruction &instruction);
+
     DataStack myDataStack;
+    FStack myFloatStack;
+    VStack myVectorStack;
+    DataSpace myDataSpace;
+    std::unique_ptr<Heap> mypHeap;
+    // Return addresses
     InstructionStack myInstructionStack;
+    std::unique_ptr<Dictionary> mypDictionary;
+    // What reset() goes back to, with the data space's snapshot
+    std::unique_ptr<Dictionary> mypBootDictionary;
+    size_t myIp;
+    // Calls a fueled run has left, the flag a preemptible run checks, and
+    // where a run stopped at a safepoint
+    size_t myFuel;
+    const std::atomic<bool> *mypPreempt;
+    size_t myPausedIp;
+    size_t myInlineBudget;
+    size_t mySpecializeBudget;
 };
 
 
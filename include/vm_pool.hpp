@@ -0,0 +1,59 @@
+#ifndef VM_POOL_H
+#define VM_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+#include "virtual_machine.hpp"
+
+/*
+ * A pool of booted VirtualMachines, shared between threads.
+ *
+ * Each machine is built and booted once, and reset() on its way back into
+ * the pool, so a short script doesn't pay for construction or teardown.
+ * The pool is a fixed array of slots that each hold a machine or nothing;
+ * acquire() and release() claim and fill slots with a single atomic
+ * exchange or compare-and-swap each, starting from a rotating index so
+ * threads spread out, and never take a lock. When every slot is empty a
+ * new machine is built, and when every slot is full a released machine is
+ * destroyed, so the pool never blocks.
+ */
+class VMPool {
+  public:
+    /*
+     * Build size machines. boot, if given, is run on each new machine before
+     * it's marked booted, e.g. to define words.
+     */
+    explicit VMPool(size_t size,
+                    std::function<void(VirtualMachine&)> boot = nullptr);
+
+    VMPool(const VMPool&) = delete;
+
+    /*
+     * Every machine has to be released before the pool is destroyed.
+     */
+    ~VMPool();
+
+    /*
+     * A booted machine with empty stacks. Never null.
+     */
+    VirtualMachine *acquire();
+
+    /*
+     * Reset pVm and give it back to the pool.
+     */
+    void release(VirtualMachine *pVm);
+
+  private:
+    VirtualMachine *build() const;
+
+    size_t mySize;
+    std::unique_ptr<std::atomic<VirtualMachine *>[]> mySlots;
+    std::atomic<size_t> myNext;
+    std::function<void(VirtualMachine&)> myBoot;
+};
+
+
+#endif // VM_POOL_H
@@ -0,0 +1,189 @@
+
+#include <algorithm>
+
+#include "batch_machine.hpp"
+
+
+BatchMachine::BatchMachine(size_t lanes, size_t size)
+  : myLanes{lanes},
+  mySize{size},
+  myDepth{0},
+  mypRows{new UCell[lanes * size]},
+  mypScratch{new UCell[lanes * MAX_INPUTS]}
+{
+}
+
+bool BatchMachine::push(const UCell *values) {
+  if (myDepth == mySize) {
+    return false;
+  }
+
+  std::copy(values, values + myLanes, row(myDepth++));
+
+  return true;
+}
+
+bool BatchMachine::pop(UCell *values) {
+  if (myDepth == 0) {
+    return false;
+  }
+
+  const UCell *top = row(--myDepth);
+  std::copy(top, top + myLanes, values);
+
+  return true;
+}
+
+bool BatchMachine::execute(const Code &code, const Dictionary *pDictionary) {
+  return run(code, 0, pDictionary, 0);
+}
+
+bool BatchMachine::run(const Code &code, size_t ip,
+                       const Dictionary *pDictionary, size_t nesting) {
+  Instruction instruction;
+  while (ip < code.size()) {
+    if (!decode(code, ip, instruction)) {
+      return false;
+    }
+
+    switch (instruction.opcode) {
+      case OPCODE_EXIT:
+        return true;
+      case OPCODE_CALL: {
+        const size_t xt = instruction.operands[0].get();
+        // Calls go the same way for every lane, so they're just followed
+        if (!pDictionary || !pDictionary->isWord(xt)
+            || nesting == INSTRUCTION_STACK_DEFAULT_SIZE
+            || !run(pDictionary->code(), xt, pDictionary, nesting + 1)) {
+          return false;
+        }
+        break;
+      }
+      default:
+        if (!step(instruction)) {
+          return false;
+        }
+    }
+  }
+
+  return true;
+}
+
+template<enum OpCode op>
+void BatchMachine::lanes() {
+  using Op = Operation<op>;
+  const size_t base = myDepth - Op::INPUTS;
+
+  for (size_t i = 0; i < myLanes; i++) {
+    UCell in[Op::INPUTS], out[Op::OUTPUTS];
+    for (size_t j = 0; j < Op::INPUTS; j++) {
+      in[j] = row(base + j)[i];
+    }
+    Op{}.evaluate(in, out);
+    for (size_t j = 0; j < Op::OUTPUTS; j++) {
+      row(base + j)[i] = out[j];
+    }
+  }
+  myDepth = base + Op::OUTPUTS;
+}
+
+bool BatchMachine::step(const Instruction &instruction) {
+  StackEffect effect;
+  if (!stackEffect(instruction.opcode, effect)) {
+    return false;
+  }
+  if (myDepth < effect.inputs
+      || mySize - (myDepth - effect.inputs) < effect.outputs) {
+    return false;
+  }
+
+  // The common arithmetic gets loops of its own, with the definition
+  // inlined, which the compiler vectorizes at -O3
+  switch (instruction.opcode) {
+    case OPCODE_PLUS:
+      lanes<OPCODE_PLUS>();
+      return true;
+    case OPCODE_MINUS:
+      lanes<OPCODE_MINUS>();
+      return true;
+    case OPCODE_STAR:
+      lanes<OPCODE_STAR>();
+      return true;
+    case OPCODE_AND:
+      lanes<OPCODE_AND>();
+      return true;
+    case OPCODE_OR:
+      lanes<OPCODE_OR>();
+      return true;
+    case OPCODE_XOR:
+      lanes<OPCODE_XOR>();
+      return true;
+    case OPCODE_MIN:
+      lanes<OPCODE_MIN>();
+      return true;
+    case OPCODE_MAX:
+      lanes<OPCODE_MAX>();
+      return true;
+    case OPCODE_ONE_PLUS:
+      lanes<OPCODE_ONE_PLUS>();
+      return true;
+    case OPCODE_ONE_MINUS:
+      lanes<OPCODE_ONE_MINUS>();
+      return true;
+    case OPCODE_NEGATE:
+      lanes<OPCODE_NEGATE>();
+      return true;
+
+    case OPCODE_LITERAL: {
+      UCell *top = row(myDepth++);
+      std::fill(top, top + myLanes, instruction.operands[0]);
+      return true;
+    }
+    case OPCODE_DROP:
+    case OPCODE_TWO_DROP:
+      myDepth -= effect.inputs;
+      return true;
+    case OPCODE_NOOP:
+      return true;
+
+    default:
+      if (effect.shuffle) {
+        return shuffle(effect);
+      }
+      return evaluateLanes(instruction, effect);
+  }
+}
+
+bool BatchMachine::evaluateLanes(const Instruction &instruction,
+                                 const StackEffect &effect) {
+  const size_t base = myDepth - effect.inputs;
+
+  for (size_t i = 0; i < myLanes; i++) {
+    UCell in[MAX_INPUTS], out[MAX_OUTPUTS];
+    for (size_t j = 0; j < effect.inputs; j++) {
+      in[j] = row(base + j)[i];
+    }
+    if (!evaluate(instruction, in, out)) {
+      return false;
+    }
+    for (size_t j = 0; j < effect.outputs; j++) {
+      row(base + j)[i] = out[j];
+    }
+  }
+  myDepth = base + effect.outputs;
+
+  return true;
+}
+
+bool BatchMachine::shuffle(const StackEffect &effect) {
+  const size_t base = myDepth - effect.inputs;
+
+  std::copy(row(base), row(myDepth), mypScratch.get());
+  for (size_t j = 0; j < effect.outputs; j++) {
+    const UCell *from = mypScratch.get() + effect.shuffle[j] * myLanes;
+    std::copy(from, from + myLanes, row(base + j));
+  }
+  myDepth = base + effect.outputs;
+
+  return true;
+}
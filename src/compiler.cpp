@@ -0,0 +1,567 @@
+
+#include <algorithm>
+
+#include "compiler.hpp"
+#include "dictionary.hpp"
+
+
+/*
+ * Stack effects
+ */
+
+static const unsigned char SHUFFLE_DUP[] = { 0, 0 };
+static const unsigned char SHUFFLE_OVER[] = { 0, 1, 0 };
+static const unsigned char SHUFFLE_SWAP[] = { 1, 0 };
+static const unsigned char SHUFFLE_ROT[] = { 1, 2, 0 };
+static const unsigned char SHUFFLE_TWO_DUP[] = { 0, 1, 0, 1 };
+static const unsigned char SHUFFLE_TWO_OVER[] = { 0, 1, 2, 3, 0, 1 };
+static const unsigned char SHUFFLE_TWO_SWAP[] = { 2, 3, 0, 1 };
+
+// The stack effect of a pure Operation is part of its definition
+template<unsigned int opcode>
+static StackEffect pure() {
+  return StackEffect{Operation<opcode>::INPUTS, Operation<opcode>::OUTPUTS,
+                     nullptr};
+}
+
+bool stackEffect(enum OpCode opcode, StackEffect &effect) {
+  switch (opcode) {
+    case OPCODE_PLUS:
+      effect = pure<OPCODE_PLUS>();
+      return true;
+    case OPCODE_ONE_PLUS:
+      effect = pure<OPCODE_ONE_PLUS>();
+      return true;
+    case OPCODE_MINUS:
+      effect = pure<OPCODE_MINUS>();
+      return true;
+    case OPCODE_ONE_MINUS:
+      effect = pure<OPCODE_ONE_MINUS>();
+      return true;
+    case OPCODE_STAR:
+      effect = pure<OPCODE_STAR>();
+      return true;
+    case OPCODE_SLASH:
+      effect = pure<OPCODE_SLASH>();
+      return true;
+    case OPCODE_MOD:
+      effect = pure<OPCODE_MOD>();
+      return true;
+    case OPCODE_SLASH_MOD:
+      effect = pure<OPCODE_SLASH_MOD>();
+      return true;
+    case OPCODE_NEGATE:
+      effect = pure<OPCODE_NEGATE>();
+      return true;
+    case OPCODE_ABS:
+      effect = pure<OPCODE_ABS>();
+      return true;
+    case OPCODE_MIN:
+      effect = pure<OPCODE_MIN>();
+      return true;
+    case OPCODE_MAX:
+      effect = pure<OPCODE_MAX>();
+      return true;
+    case OPCODE_AND:
+      effect = pure<OPCODE_AND>();
+      return true;
+    case OPCODE_OR:
+      effect = pure<OPCODE_OR>();
+      return true;
+    case OPCODE_XOR:
+      effect = pure<OPCODE_XOR>();
+      return true;
+    case OPCODE_INVERT:
+      effect = pure<OPCODE_INVERT>();
+      return true;
+    case OPCODE_LSHIFT:
+      effect = pure<OPCODE_LSHIFT>();
+      return true;
+    case OPCODE_RSHIFT:
+      effect = pure<OPCODE_RSHIFT>();
+      return true;
+    case OPCODE_TWO_STAR:
+      effect = pure<OPCODE_TWO_STAR>();
+      return true;
+    case OPCODE_TWO_SLASH:
+      effect = pure<OPCODE_TWO_SLASH>();
+      return true;
+    case OPCODE_LESS_THAN:
+      effect = pure<OPCODE_LESS_THAN>();
+      return true;
+    case OPCODE_EQUALS:
+      effect = pure<OPCODE_EQUALS>();
+      return true;
+    case OPCODE_GREATER_THAN:
+      effect = pure<OPCODE_GREATER_THAN>();
+      return true;
+    case OPCODE_ZERO_LESS_THAN:
+      effect = pure<OPCODE_ZERO_LESS_THAN>();
+      return true;
+    case OPCODE_ZERO_EQUALS:
+      effect = pure<OPCODE_ZERO_EQUALS>();
+      return true;
+    case OPCODE_U_LESS_THAN:
+      effect = pure<OPCODE_U_LESS_THAN>();
+      return true;
+    case OPCODE_STAR_SLASH:
+      effect = pure<OPCODE_STAR_SLASH>();
+      return true;
+    case OPCODE_STAR_SLASH_MOD:
+      effect = pure<OPCODE_STAR_SLASH_MOD>();
+      return true;
+    case OPCODE_SLASH_CONSTANT:
+      effect = pure<OPCODE_SLASH_CONSTANT>();
+      return true;
+    case OPCODE_MOD_CONSTANT:
+      effect = pure<OPCODE_MOD_CONSTANT>();
+      return true;
+    case OPCODE_SLASH_MOD_CONSTANT:
+      effect = pure<OPCODE_SLASH_MOD_CONSTANT>();
+      return true;
+    case OPCODE_STAR_SLASH_MOD_CONSTANT:
+      effect = pure<OPCODE_STAR_SLASH_MOD_CONSTANT>();
+      return true;
+    case OPCODE_D_PLUS:
+      effect = pure<OPCODE_D_PLUS>();
+      return true;
+    case OPCODE_D_MINUS:
+      effect = pure<OPCODE_D_MINUS>();
+      return true;
+    case OPCODE_D_NEGATE:
+      effect = pure<OPCODE_D_NEGATE>();
+      return true;
+    case OPCODE_UM_STAR:
+      effect = pure<OPCODE_UM_STAR>();
+      return true;
+    case OPCODE_M_STAR:
+      effect = pure<OPCODE_M_STAR>();
+      return true;
+    case OPCODE_UM_SLASH_MOD:
+      effect = pure<OPCODE_UM_SLASH_MOD>();
+      return true;
+    case OPCODE_FM_SLASH_MOD:
+      effect = pure<OPCODE_FM_SLASH_MOD>();
+      return true;
+    case OPCODE_SM_SLASH_REM:
+      effect = pure<OPCODE_SM_SLASH_REM>();
+      return true;
+    case OPCODE_M_STAR_SLASH:
+      effect = pure<OPCODE_M_STAR_SLASH>();
+      return true;
+    case OPCODE_D_LESS_THAN:
+      effect = pure<OPCODE_D_LESS_THAN>();
+      return true;
+    case OPCODE_D_EQUALS:
+      effect = pure<OPCODE_D_EQUALS>();
+      return true;
+    case OPCODE_CELLS:
+      effect = pure<OPCODE_CELLS>();
+      return true;
+
+    case OPCODE_LITERAL:
+      effect = StackEffect{0, 1, nullptr};
+      return true;
+
+    case OPCODE_DROP:
+      effect = StackEffect{1, 0, nullptr};
+      return true;
+    case OPCODE_DUP:
+      effect = StackEffect{1, 2, SHUFFLE_DUP};
+      return true;
+    case OPCODE_OVER:
+      effect = StackEffect{2, 3, SHUFFLE_OVER};
+      return true;
+    case OPCODE_SWAP:
+      effect = StackEffect{2, 2, SHUFFLE_SWAP};
+      return true;
+    case OPCODE_ROT:
+      effect = StackEffect{3, 3, SHUFFLE_ROT};
+      return true;
+    case OPCODE_TWO_DROP:
+      effect = StackEffect{2, 0, nullptr};
+      return true;
+    case OPCODE_TWO_DUP:
+      effect = StackEffect{2, 4, SHUFFLE_TWO_DUP};
+      return true;
+    case OPCODE_TWO_OVER:
+      effect = StackEffect{4, 6, SHUFFLE_TWO_OVER};
+      return true;
+    case OPCODE_TWO_SWAP:
+      effect = StackEffect{4, 4, SHUFFLE_TWO_SWAP};
+      return true;
+
+    case OPCODE_NOOP:
+      effect = StackEffect{0, 0, nullptr};
+      return true;
+
+    case OPCODE_F_PLUS:
+    case OPCODE_F_MINUS:
+    case OPCODE_F_STAR:
+    case OPCODE_F_SLASH:
+    case OPCODE_F_STAR_PLUS:
+    case OPCODE_F_SQRT:
+    case OPCODE_F_LESS_THAN:
+    case OPCODE_S_TO_F:
+    case OPCODE_F_TO_S:
+    case OPCODE_F_LITERAL:
+    case OPCODE_V_PLUS:
+    case OPCODE_V_STAR:
+    case OPCODE_V_AND:
+    case OPCODE_V_MIN:
+    case OPCODE_V_MAX:
+    case OPCODE_V_SUM:
+    case OPCODE_V_LOAD:
+    case OPCODE_V_STORE:
+    case OPCODE_FETCH:
+    case OPCODE_STORE:
+    case OPCODE_C_FETCH:
+    case OPCODE_C_STORE:
+    case OPCODE_PLUS_STORE:
+    case OPCODE_F_FETCH:
+    case OPCODE_F_STORE:
+    case OPCODE_HERE:
+    case OPCODE_ALLOT:
+    case OPCODE_COMMA:
+    case OPCODE_C_COMMA:
+    case OPCODE_ALIGN:
+    case OPCODE_MOVE:
+    case OPCODE_FILL:
+    case OPCODE_ERASE:
+    case OPCODE_CMOVE:
+    case OPCODE_COMPARE:
+    case OPCODE_SEARCH:
+    case OPCODE_ALLOCATE:
+    case OPCODE_FREE:
+    case OPCODE_RESIZE:
+    case OPCODE_REGION:
+    case OPCODE_R_ALLOT:
+    case OPCODE_R_FREE_ALL:
+    case OPCODE_SAVE_IMAGE:
+    case OPCODE_QUESTION_DUP:
+    case OPCODE_VALUE:
+    case OPCODE_CALL:
+    case OPCODE_CALL_GENERIC:
+    case OPCODE_EXIT:
+    case OPCODE_EXECUTE:
+    case OPCODE_EXECUTE_CACHED:
+    case OPCODE_DEFER:
+    case OPCODE_TO:
+    case OPCODE_IS:
+    case OPCODE_LAST:
+      return false;
+  }
+
+  return false;
+}
+
+
+/*
+ * Running compiled code
+ */
+
+bool RegisterBlock::operator()(DataStack &ds) const {
+  UCell registers[REGISTER_FILE_SIZE];
+
+  if (ds.depth() < myInputs.size()) {
+    return false;
+  }
+
+  for (size_t reg : myInputs) {
+    ds.pop(registers[reg]);
+  }
+
+  for (const Node &node : myNodes) {
+    if (node.instruction.opcode == OPCODE_LITERAL) {
+      registers[node.dst[0]] = node.instruction.operands[0];
+      continue;
+    }
+
+    UCell in[MAX_INPUTS], out[MAX_OUTPUTS];
+    for (size_t i = 0; i < node.inputs; i++) {
+      in[i] = registers[node.src[i]];
+    }
+    evaluate(node.instruction, in, out);
+    for (size_t i = 0; i < node.outputs; i++) {
+      registers[node.dst[i]] = out[i];
+    }
+  }
+
+  for (size_t reg : myOutputs) {
+    if (!ds.push(registers[reg])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool CompiledCode::operator()(DataStack &ds) const {
+  for (const Step &step : mySteps) {
+    if (step.isBlock) {
+      if (!myBlocks[step.iBlock](ds)) {
+        return false;
+      }
+    } else if (!dispatch(step.instruction, ds)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool CompiledCode::operator()(VirtualMachine &vm) const {
+  DataStack &ds = vm.dataStack();
+
+  for (const Step &step : mySteps) {
+    if (step.isBlock) {
+      if (!myBlocks[step.iBlock](ds)) {
+        return false;
+      }
+    } else if (!dispatch(step.instruction, vm)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+/*
+ * Compiling
+ */
+
+/*
+ * Instructions that transfer control, or that the dictionary rewrites in
+ * place, which only the interpreter can run.
+ */
+static bool control(enum OpCode opcode) {
+  switch (opcode) {
+    case OPCODE_VALUE:
+    case OPCODE_CALL:
+    case OPCODE_CALL_GENERIC:
+    case OPCODE_EXIT:
+    case OPCODE_EXECUTE:
+    case OPCODE_EXECUTE_CACHED:
+    case OPCODE_DEFER:
+    case OPCODE_TO:
+    case OPCODE_IS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool Compiler::compile(const Code &code, CompiledCode &compiled) {
+  compiled = CompiledCode{};
+
+  beginBlock();
+  for (size_t i = 0; i < code.size(); ) {
+    Instruction instruction;
+    if (!decode(code, i, instruction)) {
+      return false;
+    }
+
+    StackEffect effect;
+    if (!stackEffect(instruction.opcode, effect)) {
+      // Block boundary: spill, then let the interpreter handle it
+      endBlock(compiled);
+      compiled.myLeaf = compiled.myLeaf && !control(instruction.opcode);
+      compiled.mySteps.push_back(CompiledCode::Step{false, 0, instruction});
+      beginBlock();
+      continue;
+    }
+
+    // Every value gets a register in the worst case, so this is enough to
+    // make allocation succeed
+    if (myValueCount + effect.inputs + effect.outputs > REGISTER_FILE_SIZE) {
+      endBlock(compiled);
+      beginBlock();
+    }
+
+    apply(instruction, effect);
+  }
+  endBlock(compiled);
+
+  return true;
+}
+
+void Compiler::beginBlock() {
+  myValueCount = 0;
+  myNodes.clear();
+  myInputs.clear();
+  myStack.clear();
+}
+
+size_t Compiler::popValue() {
+  if (myStack.empty()) {
+    // Reading below the bottom of the virtual stack: that's another cell of
+    // the stack the block was entered with
+    myInputs.push_back(myValueCount);
+    return myValueCount++;
+  }
+
+  size_t value = myStack.back();
+  myStack.pop_back();
+  return value;
+}
+
+void Compiler::apply(const Instruction &instruction,
+                     const StackEffect &effect) {
+  size_t in[6];
+  for (size_t i = effect.inputs; i > 0; i--) {
+    in[i - 1] = popValue();
+  }
+
+  if (effect.shuffle) {
+    for (size_t i = 0; i < effect.outputs; i++) {
+      myStack.push_back(in[effect.shuffle[i]]);
+    }
+    return;
+  }
+
+  if (effect.outputs == 0) {
+    // DROP, 2DROP
+    return;
+  }
+
+  Node node{instruction, effect.inputs, effect.outputs, {}, {}};
+  for (size_t i = 0; i < effect.inputs; i++) {
+    node.src[i] = in[i];
+  }
+  for (size_t i = 0; i < effect.outputs; i++) {
+    node.dst[i] = myValueCount++;
+    myStack.push_back(node.dst[i]);
+  }
+  myNodes.push_back(node);
+}
+
+void Compiler::endBlock(CompiledCode &compiled) {
+  // Cells at the bottom of the block's stack that come out where they went
+  // in, and aren't otherwise used, don't have to be loaded at all
+  size_t nUntouched = 0;
+  while (nUntouched < myInputs.size() && nUntouched < myStack.size()) {
+    size_t value = myInputs[myInputs.size() - 1 - nUntouched];
+    if (myStack[nUntouched] != value
+        || std::count(myStack.begin(), myStack.end(), value) != 1) {
+      break;
+    }
+    bool used = false;
+    for (const Node &node : myNodes) {
+      used = used || std::count(node.src, node.src + node.inputs, value) > 0;
+    }
+    if (used) {
+      break;
+    }
+    nUntouched++;
+  }
+  myInputs.resize(myInputs.size() - nUntouched);
+  myStack.erase(myStack.begin(), myStack.begin() + nUntouched);
+
+  if (myInputs.empty() && myStack.empty() && myNodes.empty()) {
+    return;
+  }
+
+  RegisterBlock block;
+  block.myInputs = myInputs;
+  block.myOutputs = myStack;
+
+  // Dead code: drop nodes none of whose results are used
+  std::vector<bool> live(myValueCount, false);
+  for (size_t value : myStack) {
+    live[value] = true;
+  }
+  for (size_t i = myNodes.size(); i > 0; i--) {
+    const Node &node = myNodes[i - 1];
+    bool isLive = false;
+    for (size_t j = 0; j < node.outputs; j++) {
+      isLive = isLive || live[node.dst[j]];
+    }
+    if (isLive) {
+      for (size_t j = 0; j < node.inputs; j++) {
+        live[node.src[j]] = true;
+      }
+      block.myNodes.push_back(node);
+    }
+  }
+  std::reverse(block.myNodes.begin(), block.myNodes.end());
+
+  allocate(block);
+
+  compiled.mySteps.push_back(
+      CompiledCode::Step{true, compiled.myBlocks.size(), {}});
+  compiled.myBlocks.push_back(block);
+}
+
+/*
+ * Linear scan: a value holds its register from its definition to its last
+ * use, then the register goes back on the free list.
+ */
+void Compiler::allocate(RegisterBlock &block) {
+  const size_t UNUSED = static_cast<size_t>(-1);
+  const size_t nNodes = block.myNodes.size();
+
+  std::vector<size_t> lastUse(myValueCount, UNUSED);
+  for (size_t i = 0; i < nNodes; i++) {
+    const Node &node = block.myNodes[i];
+    for (size_t j = 0; j < node.inputs; j++) {
+      lastUse[node.src[j]] = i;
+    }
+  }
+  for (size_t value : block.myOutputs) {
+    lastUse[value] = nNodes;
+  }
+
+  std::vector<size_t> reg(myValueCount, UNUSED);
+  std::vector<size_t> free;
+  size_t nRegisters = 0;
+  auto take = [&](size_t value) {
+    if (free.empty()) {
+      reg[value] = nRegisters++;
+    } else {
+      reg[value] = free.back();
+      free.pop_back();
+    }
+  };
+
+  for (size_t value : block.myInputs) {
+    take(value);
+  }
+  for (size_t value : block.myInputs) {
+    if (lastUse[value] == UNUSED) {
+      free.push_back(reg[value]);
+    }
+  }
+
+  for (size_t i = 0; i < nNodes; i++) {
+    Node &node = block.myNodes[i];
+    // Inputs are all read before any output is written, so an output can
+    // reuse the register of an input that dies here
+    for (size_t j = 0; j < node.inputs; j++) {
+      size_t value = node.src[j];
+      if (lastUse[value] == i
+          && std::find(free.begin(), free.end(), reg[value]) == free.end()) {
+        free.push_back(reg[value]);
+      }
+      node.src[j] = reg[value];
+    }
+    for (size_t j = 0; j < node.outputs; j++) {
+      take(node.dst[j]);
+    }
+    for (size_t j = 0; j < node.outputs; j++) {
+      size_t value = node.dst[j];
+      if (lastUse[value] == UNUSED) {
+        free.push_back(reg[value]);
+      }
+      node.dst[j] = reg[value];
+    }
+  }
+
+  for (size_t &value : block.myOutputs) {
+    value = reg[value];
+  }
+  for (size_t &value : block.myInputs) {
+    value = reg[value];
+  }
+  block.myRegisterCount = nRegisters;
+}
@@ -0,0 +1,300 @@
+
+#include <algorithm>
+
+#include "dictionary.hpp"
+#include "operation.hpp"
+
+
+Dictionary::Dictionary()
+  : myCode{},
+  myWords{},
+  mySpecializations{},
+  myGenericCode{},
+  myQuickenedSites{},
+  myCompiled{},
+  myLeaves{}
+{
+}
+
+size_t Dictionary::define(const std::string &name, const Code &body) {
+  const size_t xt = myCode.size();
+
+  myCode.insert(myCode.end(), body.begin(), body.end());
+  myCode.push_back(OPCODE_EXIT);
+  myWords.push_back(Word{name, xt, body.size()});
+  prepare(xt);
+  compile(xt, body);
+
+  return xt;
+}
+
+bool Dictionary::find(const std::string &name, size_t &xt) const {
+  for (auto it = myWords.rbegin(); it != myWords.rend(); ++it) {
+    if (it->name == name) {
+      xt = it->xt;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool Dictionary::isIndirect(size_t xt) const {
+  return word(xt)
+    && (myCode[xt].get() == OPCODE_VALUE || myCode[xt].get() == OPCODE_DEFER);
+}
+
+bool Dictionary::body(size_t xt, Code &code) const {
+  const Word *w = word(xt);
+  if (!w) {
+    return false;
+  }
+
+  const size_t end = w->xt + w->length;
+  code.assign(myCode.begin() + w->xt, myCode.begin() + end);
+  // A quickened site is only right until the word it depends on changes,
+  // and a copy isn't put back when that happens
+  for (auto it = myGenericCode.lower_bound(w->xt);
+       it != myGenericCode.end() && it->first < end; ++it) {
+    std::copy(it->second.begin(), it->second.end(),
+              code.begin() + (it->first - w->xt));
+  }
+
+  return true;
+}
+
+bool Dictionary::forget(size_t xt) {
+  if (!word(xt)) {
+    return false;
+  }
+
+  // Sites that depend on the forgotten words go back to calling them,
+  // which is what they'd do if they had never been quickened
+  for (auto it = myQuickenedSites.lower_bound(xt);
+       it != myQuickenedSites.end(); it = myQuickenedSites.lower_bound(xt)) {
+    invalidate(it->first);
+  }
+  myGenericCode.erase(myGenericCode.lower_bound(xt), myGenericCode.end());
+  for (auto it = myQuickenedSites.begin(); it != myQuickenedSites.end(); ) {
+    if (it->second >= xt) {
+      it = myQuickenedSites.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  while (myWords.back().xt != xt) {
+    myWords.pop_back();
+  }
+  myWords.pop_back();
+  myCode.resize(xt);
+  // Leaves are compiled in order, so the forgotten ones are at the end
+  for (size_t i = xt; i < myLeaves.size(); i++) {
+    if (myLeaves[i] != NOT_COMPILED) {
+      myCompiled.resize(myLeaves[i]);
+      myLeaves.resize(xt);
+      break;
+    }
+  }
+
+  for (auto it = mySpecializations.begin(); it != mySpecializations.end(); ) {
+    if (it->first.first >= xt || it->second >= xt) {
+      it = mySpecializations.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  return true;
+}
+
+void Dictionary::restore(const Dictionary &other) {
+  myCode = other.myCode;
+  myWords = other.myWords;
+  mySpecializations = other.mySpecializations;
+  myGenericCode = other.myGenericCode;
+  myQuickenedSites = other.myQuickenedSites;
+  myCompiled = other.myCompiled;
+  myLeaves = other.myLeaves;
+}
+
+bool Dictionary::load(const Code &code, const std::vector<Word> &words) {
+  return load(code, words, {}, {});
+}
+
+bool Dictionary::load(const Code &code, const std::vector<Word> &words,
+                      const std::map<size_t, Code> &genericCode,
+                      const std::multimap<size_t, size_t> &quickenedSites) {
+  for (const auto &generic : genericCode) {
+    if (generic.first > code.size()
+        || code.size() - generic.first < generic.second.size()) {
+      return false;
+    }
+  }
+
+  size_t end = 0;
+  for (const Word &w : words) {
+    if (w.xt < end || w.xt > code.size() || code.size() - w.xt <= w.length
+        || code[w.xt + w.length].get() != OPCODE_EXIT) {
+      return false;
+    }
+    end = w.xt + w.length + 1;
+  }
+
+  myCode = code;
+  myWords = words;
+  mySpecializations.clear();
+  myGenericCode = genericCode;
+  myQuickenedSites = quickenedSites;
+  // A quickened site can look like a leaf's code, but it isn't one
+  myCompiled.clear();
+  myLeaves.clear();
+  const Code generic = Dictionary::genericCode();
+  for (const Word &w : myWords) {
+    compile(w.xt, Code(generic.begin() + w.xt,
+                       generic.begin() + w.xt + w.length));
+  }
+
+  return true;
+}
+
+Code Dictionary::genericCode() const {
+  Code code = myCode;
+  for (const auto &generic : myGenericCode) {
+    std::copy(generic.second.begin(), generic.second.end(),
+              code.begin() + generic.first);
+  }
+
+  return code;
+}
+
+bool Dictionary::findSpecialization(size_t xt, const Code &arguments,
+                                    size_t &clone) const {
+  auto it = mySpecializations.find(specialization(xt, arguments));
+  if (it == mySpecializations.end()) {
+    return false;
+  }
+
+  clone = it->second;
+
+  return true;
+}
+
+void Dictionary::addSpecialization(size_t xt, const Code &arguments,
+                                   size_t clone) {
+  mySpecializations[specialization(xt, arguments)] = clone;
+}
+
+bool Dictionary::patch(size_t address, const Code &cells) {
+  if (address > myCode.size() || myCode.size() - address < cells.size()) {
+    return false;
+  }
+
+  std::copy(cells.begin(), cells.end(), myCode.begin() + address);
+
+  return true;
+}
+
+bool Dictionary::quicken(size_t site, size_t target, const Code &cells) {
+  if (site > myCode.size() || myCode.size() - site < cells.size()) {
+    return false;
+  }
+
+  // Past the end of an earlier, shorter rewrite the code is still generic
+  Code &generic = myGenericCode[site];
+  for (size_t i = generic.size(); i < cells.size(); i++) {
+    generic.push_back(myCode[site + i]);
+  }
+  myQuickenedSites.insert({target, site});
+
+  return patch(site, cells);
+}
+
+bool Dictionary::update(size_t xt, enum OpCode kind, UCell value) {
+  if (!word(xt) || myCode.size() - xt < 2 || myCode[xt].get() != kind) {
+    return false;
+  }
+
+  myCode[xt + 1] = value;
+  invalidate(xt);
+
+  return true;
+}
+
+void Dictionary::invalidate(size_t target) {
+  auto range = myQuickenedSites.equal_range(target);
+  for (auto it = range.first; it != range.second; ++it) {
+    auto generic = myGenericCode.find(it->second);
+    if (generic != myGenericCode.end()) {
+      patch(it->second, generic->second);
+      myGenericCode.erase(generic);
+    }
+  }
+  myQuickenedSites.erase(range.first, range.second);
+}
+
+/*
+ * Everything but a call to a VALUE or deferred word is in its final form
+ * from the start, so that's all the interpreter ever quickens.
+ */
+void Dictionary::prepare(size_t xt) {
+  const size_t end = xt + word(xt)->length;
+  for (size_t i = xt; i < end; ) {
+    const size_t site = i;
+    Instruction instruction;
+    if (!decode(myCode, i, instruction)) {
+      return;
+    }
+
+    if (instruction.opcode == OPCODE_LITERAL && i < end
+        && myCode[i].get() == OPCODE_EXECUTE
+        && isWord(instruction.operands[0].get())) {
+      // EXECUTE of a constant xt. The NOOP keeps the site as long as it was.
+      patch(site, Code{OPCODE_CALL, instruction.operands[0], OPCODE_NOOP});
+      instruction.opcode = OPCODE_CALL;
+      i++;
+    }
+    if (instruction.opcode == OPCODE_CALL
+        && isIndirect(instruction.operands[0].get())) {
+      myCode[site] = OPCODE_CALL_GENERIC;
+    }
+  }
+}
+
+/*
+ * A leaf's code is never quickened or updated, so its compiled form stays
+ * valid for as long as the word exists. Words without a register block would
+ * only run the same dispatch the interpreter does.
+ */
+void Dictionary::compile(size_t xt, const Code &body) {
+  CompiledCode compiled;
+  if (Compiler{}.compile(body, compiled) && compiled.leaf()
+      && compiled.blockCount() > 0) {
+    myLeaves.resize(myCode.size(), NOT_COMPILED);
+    myLeaves[xt] = static_cast<uint32_t>(myCompiled.size());
+    myCompiled.push_back(compiled);
+  }
+}
+
+Dictionary::Specialization Dictionary::specialization(size_t xt,
+                                                      const Code &arguments) {
+  Specialization key{xt, {}};
+  for (const UCell &argument : arguments) {
+    key.second.push_back(argument.get());
+  }
+
+  return key;
+}
+
+const Dictionary::Word *Dictionary::word(size_t xt) const {
+  // Words are compiled in order, so they're sorted by xt
+  auto it = std::lower_bound(myWords.begin(), myWords.end(), xt,
+                             [](const Word &w, size_t xt) {
+                               return w.xt < xt;
+                             });
+  if (it == myWords.end() || it->xt != xt) {
+    return nullptr;
+  }
+
+  return &*it;
+}
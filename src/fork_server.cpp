@@ -0,0 +1,149 @@
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fork_server.hpp"
+#include "interpreter.hpp"
+
+
+static bool writeAll(int fd, const std::string &text) {
+  size_t written = 0;
+  while (written < text.size()) {
+    const ssize_t n = write(fd, text.data() + written, text.size() - written);
+    if (n < 0 && errno != EINTR) {
+      return false;
+    }
+    if (n > 0) {
+      written += n;
+    }
+  }
+
+  return true;
+}
+
+
+ForkServer::ForkServer(VirtualMachine &vm)
+  : myVm(vm),
+  mySocket{-1},
+  myPath{},
+  myChildren{0}
+{
+}
+
+ForkServer::~ForkServer() {
+  if (mySocket >= 0) {
+    close(mySocket);
+    unlink(myPath.c_str());
+  }
+}
+
+bool ForkServer::listen(const std::string &path) {
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (mySocket >= 0 || path.size() >= sizeof(address.sun_path)) {
+    return false;
+  }
+  std::memcpy(address.sun_path, path.c_str(), path.size());
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return false;
+  }
+  if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0
+      || ::listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return false;
+  }
+
+  mySocket = fd;
+  myPath = path;
+
+  return true;
+}
+
+bool ForkServer::serve(size_t count) {
+  if (mySocket < 0) {
+    return false;
+  }
+
+  size_t jobs = 0;
+  while (count == 0 || jobs < count) {
+    const int connection = accept4(mySocket, nullptr, nullptr, SOCK_CLOEXEC);
+    if (connection < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      reap(true);
+      return false;
+    }
+    jobs++;
+
+    const pid_t pid = fork();
+    if (pid == 0) {
+      close(mySocket);
+      runJob(connection);
+    }
+    close(connection);
+    if (pid > 0) {
+      myChildren++;
+    }
+    reap(false);
+  }
+
+  reap(true);
+
+  return true;
+}
+
+void ForkServer::runJob(int connection) {
+  std::string source;
+  char buffer[4096];
+  ssize_t n;
+  while ((n = read(connection, buffer, sizeof(buffer))) != 0) {
+    if (n < 0 && errno != EINTR) {
+      _exit(1);
+    }
+    if (n > 0) {
+      source.append(buffer, n);
+    }
+  }
+
+  Interpreter interpreter{myVm};
+  const bool ok = interpreter.interpret(source);
+  std::string reply;
+  if (ok) {
+    reply = "ok";
+    SCell c;
+    std::string stack;
+    while (myVm.dataStack().pop(c)) {
+      stack = " " + std::to_string(c.get()) + stack;
+    }
+    reply += stack;
+  } else {
+    reply = "error " + interpreter.error();
+  }
+  reply += "\n";
+
+  // Skip the server's atexit handlers and destructors: they're its, not
+  // the job's
+  _exit(writeAll(connection, reply) && ok ? 0 : 1);
+}
+
+void ForkServer::reap(bool block) {
+  while (myChildren > 0) {
+    const pid_t pid = waitpid(-1, nullptr, block ? 0 : WNOHANG);
+    if (pid < 0 && errno == EINTR) {
+      continue;
+    }
+    if (pid <= 0) {
+      break;
+    }
+    myChildren--;
+  }
+}
@@ -0,0 +1,248 @@
+
+#include <algorithm>
+
+#include "heap.hpp"
+
+
+// End of a free list
+static const UCell::type NO_BLOCK = static_cast<UCell::type>(-1);
+static const UCell::type HEADER = sizeof(UCell);
+// Set in the header of a block on a free list. Blocks are at least
+// HEAP_MIN_BLOCK bytes, so the size never uses the low bit.
+static const UCell::type FREE = 1;
+
+static_assert(HEAP_MIN_BLOCK << (HEAP_SIZE_CLASSES - 1) == HEAP_MAX_SMALL_BLOCK,
+              "size classes don't reach the largest small block");
+static_assert(HEAP_MIN_BLOCK >= 2 * HEADER,
+              "a free block doesn't fit its header and link");
+
+static size_t sizeClassOf(UCell::type size) {
+  size_t sizeClass = 0;
+  while ((HEAP_MIN_BLOCK << sizeClass) < size) {
+    sizeClass++;
+  }
+  return sizeClass;
+}
+
+
+Heap::Heap(DataSpace &space)
+  : mySpace(space),
+  myFree{},
+  myLarge{NO_BLOCK},
+  myBump{0},
+  myBumpEnd{0}
+{
+  std::fill(myFree, myFree + HEAP_SIZE_CLASSES, NO_BLOCK);
+}
+
+bool Heap::allocate(UCell::type size, UCell::type &address) {
+  if (size > mySpace.size()) {
+    return false;
+  }
+
+  const UCell::type total = size + HEADER;
+  UCell::type block, blockSize;
+  if (total <= HEAP_MAX_SMALL_BLOCK) {
+    const size_t sizeClass = sizeClassOf(total);
+    blockSize = HEAP_MIN_BLOCK << sizeClass;
+    if (!takeSmall(sizeClass, block)) {
+      return false;
+    }
+  } else {
+    blockSize = (total + HEAP_PAGE_SIZE - 1) / HEAP_PAGE_SIZE * HEAP_PAGE_SIZE;
+    if (!takeLarge(blockSize, block)) {
+      return false;
+    }
+  }
+
+  mySpace.store(block, UCell{blockSize});
+  address = block + HEADER;
+
+  return true;
+}
+
+bool Heap::free(UCell::type address) {
+  UCell::type size;
+  if (!blockSize(address, size)) {
+    return false;
+  }
+
+  // Free blocks keep their size, for first fit, and link after it
+  const UCell::type block = address - HEADER;
+  UCell::type &head = size <= HEAP_MAX_SMALL_BLOCK
+    ? myFree[sizeClassOf(size)] : myLarge;
+  mySpace.store(block, UCell{size | FREE});
+  mySpace.store(address, UCell{head});
+  head = block;
+
+  return true;
+}
+
+bool Heap::resize(UCell::type address, UCell::type size,
+                  UCell::type &moved) {
+  UCell::type oldSize;
+  if (!blockSize(address, oldSize)) {
+    return false;
+  }
+  if (size <= oldSize - HEADER) {
+    moved = address;
+    return true;
+  }
+
+  UCell::type newAddress;
+  if (!allocate(size, newAddress)) {
+    return false;
+  }
+  const UCell::type length = oldSize - HEADER;
+  std::memcpy(mySpace.bytes(newAddress, length), mySpace.bytes(address, length),
+              length);
+  free(address);
+  moved = newAddress;
+
+  return true;
+}
+
+bool Heap::allocateRegion(UCell::type size, UCell::type &region) {
+  if (size > mySpace.size() || !allocate(size + HEADER, region)) {
+    return false;
+  }
+
+  return releaseRegion(region);
+}
+
+bool Heap::regionAllocate(UCell::type region, UCell::type size,
+                          UCell::type &address) {
+  UCell::type end;
+  UCell top;
+  if (!regionEnd(region, end) || !mySpace.fetch(region, top)) {
+    return false;
+  }
+
+  // Keep what comes after cell-aligned
+  const UCell::type aligned = (size + HEADER - 1) / HEADER * HEADER;
+  if (size > end || top.get() < region + HEADER || top.get() > end
+      || aligned > end - top.get()) {
+    return false;
+  }
+
+  address = top.get();
+  return mySpace.store(region, UCell{top.get() + aligned});
+}
+
+bool Heap::releaseRegion(UCell::type region) {
+  UCell::type end;
+  return regionEnd(region, end) && mySpace.store(region, UCell{region + HEADER});
+}
+
+void Heap::clear() {
+  std::fill(myFree, myFree + HEAP_SIZE_CLASSES, NO_BLOCK);
+  myLarge = NO_BLOCK;
+  myBump = myBumpEnd = 0;
+  mySpace.release();
+}
+
+Heap::State Heap::state() const {
+  State state;
+  std::copy(myFree, myFree + HEAP_SIZE_CLASSES, state.free);
+  state.large = myLarge;
+  state.bump = myBump;
+  state.bumpEnd = myBumpEnd;
+
+  return state;
+}
+
+void Heap::setState(const State &state) {
+  std::copy(state.free, state.free + HEAP_SIZE_CLASSES, myFree);
+  myLarge = state.large;
+  myBump = state.bump;
+  myBumpEnd = state.bumpEnd;
+}
+
+bool Heap::blockSize(UCell::type address, UCell::type &size) const {
+  // Blocks start on HEAP_MIN_BLOCK boundaries within the heap's pages
+  const UCell::type block = address - HEADER;
+  if (address < HEADER || block < mySpace.limit()
+      || block >= mySpace.size() || block % HEAP_MIN_BLOCK != 0) {
+    return false;
+  }
+
+  UCell header;
+  if (!mySpace.fetch(block, header)) {
+    return false;
+  }
+  size = header.get();
+  if (size & FREE) {
+    return false;
+  }
+
+  const bool small = size >= HEAP_MIN_BLOCK && size <= HEAP_MAX_SMALL_BLOCK
+    && (size & (size - 1)) == 0;
+  const bool large = size > HEAP_MAX_SMALL_BLOCK && size % HEAP_PAGE_SIZE == 0
+    && mySpace.size() - block >= size;
+  return small || large;
+}
+
+bool Heap::regionEnd(UCell::type region, UCell::type &end) const {
+  UCell::type size;
+  if (!blockSize(region, size)) {
+    return false;
+  }
+
+  end = region - HEADER + size;
+
+  return true;
+}
+
+bool Heap::takeSmall(size_t sizeClass, UCell::type &block) {
+  UCell::type &head = myFree[sizeClass];
+  if (head != NO_BLOCK) {
+    UCell next;
+    if (!mySpace.fetch(head + HEADER, next)) {
+      return false;
+    }
+    block = head;
+    head = next.get();
+    return true;
+  }
+
+  const UCell::type size = HEAP_MIN_BLOCK << sizeClass;
+  if (myBumpEnd - myBump < size) {
+    UCell::type page;
+    if (!mySpace.reserve(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE, page)) {
+      return false;
+    }
+    myBump = page;
+    myBumpEnd = page + HEAP_PAGE_SIZE;
+  }
+  block = myBump;
+  myBump += size;
+
+  return true;
+}
+
+bool Heap::takeLarge(UCell::type &size, UCell::type &block) {
+  UCell::type previous = NO_BLOCK;
+  for (UCell::type candidate = myLarge; candidate != NO_BLOCK; ) {
+    UCell candidateSize, next;
+    if (!mySpace.fetch(candidate, candidateSize)
+        || !mySpace.fetch(candidate + HEADER, next)) {
+      return false;
+    }
+    const UCell::type available = candidateSize.get() & ~FREE;
+    if (available >= size) {
+      if (previous == NO_BLOCK) {
+        myLarge = next.get();
+      } else {
+        mySpace.store(previous + HEADER, next);
+      }
+      // The whole block is handed out, so it goes back whole when it's freed
+      size = available;
+      block = candidate;
+      return true;
+    }
+    previous = candidate;
+    candidate = next.get();
+  }
+
+  return mySpace.reserve(size, HEAP_PAGE_SIZE, block);
+}
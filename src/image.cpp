@@ -0,0 +1,481 @@
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dictionary.hpp"
+#include "heap.hpp"
+#include "image.hpp"
+
+
+static const char IMAGE_MAGIC[8] = {'B', 'B', 'F', 'O', 'R', 'T', 'H', '\n'};
+
+template<class T>
+static void append(std::vector<unsigned char> &bytes, const T &value) {
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(&value);
+  bytes.insert(bytes.end(), p, p + sizeof(T));
+}
+
+// A count, then that many elements
+template<class T>
+static void append(std::vector<unsigned char> &bytes, const T *elements,
+                   size_t count) {
+  append(bytes, static_cast<uint64_t>(count));
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(elements);
+  bytes.insert(bytes.end(), p, p + count * sizeof(T));
+}
+
+/*
+ * Reads fixed-size values and byte strings off a buffer, failing instead
+ * of reading past its end.
+ */
+class Reader {
+  public:
+    Reader(const unsigned char *bytes, size_t size)
+      : mypBytes{bytes}, mySize{size}, myiNext{0} {}
+
+    template<class T>
+    bool read(T &value) {
+      return read(&value, sizeof(T));
+    }
+
+    bool read(void *to, size_t n) {
+      if (mySize - myiNext < n) {
+        return false;
+      }
+      if (n == 0) {
+        return true;
+      }
+      std::memcpy(to, mypBytes + myiNext, n);
+      myiNext += n;
+      return true;
+    }
+
+    // The reverse of append() with a count
+    template<class T>
+    bool read(std::vector<T> &elements) {
+      uint64_t count;
+      if (!read(count) || count > (mySize - myiNext) / sizeof(T)) {
+        return false;
+      }
+      elements.resize(count);
+      return read(elements.data(), count * sizeof(T));
+    }
+
+  private:
+    const unsigned char *mypBytes;
+    size_t mySize;
+    size_t myiNext;
+};
+
+/*
+ * What a checkpoint holds besides the dictionary and data space: where the
+ * machine is up to, its stacks, the heap's bookkeeping, and the quickened
+ * sites in its code.
+ */
+struct MachineState {
+  uint64_t ip;
+  uint64_t limit;
+  Heap::State heap;
+  std::map<size_t, Code> genericSites;
+  std::multimap<size_t, size_t> quickenedSites;
+  std::vector<UCell> dataStack;
+  std::vector<UCell> returnStack;
+  std::vector<Float> floatStack;
+  std::vector<Vector> vectorStack;
+};
+
+template<class Element>
+static void appendStack(std::vector<unsigned char> &bytes,
+                        const Stack<Element> &stack) {
+  append(bytes, stack.view(stack.depth()), stack.depth());
+}
+
+template<class Element>
+static void restoreStack(Stack<Element> &stack,
+                         const std::vector<Element> &elements) {
+  stack.clear();
+  if (!elements.empty()) {
+    stack.pushN(elements.data(), elements.size());
+  }
+}
+
+static void unmap(unsigned char *memory, size_t size) {
+  munmap(memory, size);
+}
+
+/*
+ * Whether header describes an image this build can load, size bytes long.
+ */
+static bool validHeader(const ImageHeader &header, uint64_t size) {
+  return std::memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0
+    && header.version == IMAGE_VERSION && header.cellBits == CELL_BITS
+    && header.dataOffset % IMAGE_ALIGNMENT == 0
+    && header.dataOffset <= size
+    && header.dataSize <= size - header.dataOffset
+    && header.here <= header.dataSize && header.dataSize != 0;
+}
+
+/*
+ * Read the code and word list out of the part of an image before the data
+ * space, leaving reader at the machine state.
+ */
+static bool readContents(Reader &reader, const ImageHeader &header,
+                         Code &code, std::vector<Dictionary::Word> &words) {
+  ImageHeader skipped;
+  if (!reader.read(skipped)
+      || header.codeCells > header.dataOffset / sizeof(UCell)) {
+    return false;
+  }
+
+  code.resize(header.codeCells);
+  if (!reader.read(code.data(), code.size() * sizeof(UCell))) {
+    return false;
+  }
+  for (uint64_t i = 0; i < header.wordCount; i++) {
+    uint64_t xt, length, nameLength;
+    if (!reader.read(xt) || !reader.read(length) || !reader.read(nameLength)
+        || nameLength > header.wordBytes) {
+      return false;
+    }
+    std::string name(nameLength, '\0');
+    if (!reader.read(&name[0], nameLength)) {
+      return false;
+    }
+    words.push_back(Dictionary::Word{name, xt, length});
+  }
+
+  return true;
+}
+
+static void appendState(VirtualMachine &vm, std::vector<unsigned char> &bytes) {
+  const Dictionary &dictionary = vm.dictionary();
+
+  append(bytes, static_cast<uint64_t>(vm.ip()));
+  append(bytes, static_cast<uint64_t>(vm.dataSpace().limit()));
+  append(bytes, vm.heap().state());
+
+  append(bytes, static_cast<uint64_t>(dictionary.genericSites().size()));
+  for (const auto &generic : dictionary.genericSites()) {
+    append(bytes, static_cast<uint64_t>(generic.first));
+    append(bytes, generic.second.data(), generic.second.size());
+  }
+  append(bytes, static_cast<uint64_t>(dictionary.quickenedSites().size()));
+  for (const auto &quickened : dictionary.quickenedSites()) {
+    append(bytes, static_cast<uint64_t>(quickened.first));
+    append(bytes, static_cast<uint64_t>(quickened.second));
+  }
+
+  appendStack(bytes, vm.dataStack());
+  appendStack(bytes, vm.returnStack());
+  appendStack(bytes, vm.floatStack());
+  appendStack(bytes, vm.vectorStack());
+}
+
+static bool readState(Reader &reader, MachineState &state) {
+  uint64_t count;
+  if (!reader.read(state.ip) || !reader.read(state.limit)
+      || !reader.read(state.heap) || !reader.read(count)) {
+    return false;
+  }
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t site;
+    Code generic;
+    if (!reader.read(site) || !reader.read(generic)) {
+      return false;
+    }
+    state.genericSites[site] = generic;
+  }
+  if (!reader.read(count)) {
+    return false;
+  }
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t target, site;
+    if (!reader.read(target) || !reader.read(site)) {
+      return false;
+    }
+    state.quickenedSites.insert({target, site});
+  }
+
+  return reader.read(state.dataStack) && reader.read(state.returnStack)
+    && reader.read(state.floatStack) && reader.read(state.vectorStack);
+}
+
+/*
+ * Lay out vm's image in memory, exactly as it's stored. A checkpoint keeps
+ * the code as it runs, quickened sites and all, the machine state, and the
+ * whole data space; a plain image is generic code and the data space up to
+ * HERE.
+ */
+static void serialize(VirtualMachine &vm, bool checkpoint,
+                      std::vector<unsigned char> &image) {
+  const Dictionary &dictionary = vm.dictionary();
+  const DataSpace &space = vm.dataSpace();
+  const Code code = checkpoint ? dictionary.code() : dictionary.genericCode();
+
+  std::vector<unsigned char> words;
+  for (const Dictionary::Word &w : dictionary.words()) {
+    append(words, static_cast<uint64_t>(w.xt));
+    append(words, static_cast<uint64_t>(w.length));
+    append(words, static_cast<uint64_t>(w.name.size()));
+    words.insert(words.end(), w.name.begin(), w.name.end());
+  }
+
+  std::vector<unsigned char> state;
+  if (checkpoint) {
+    appendState(vm, state);
+  }
+
+  ImageHeader header;
+  std::memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+  header.version = IMAGE_VERSION;
+  header.cellBits = CELL_BITS;
+  header.codeCells = code.size();
+  header.wordCount = dictionary.words().size();
+  header.wordBytes = words.size();
+  header.stateBytes = state.size();
+  const uint64_t end = sizeof(header) + code.size() * sizeof(UCell)
+    + words.size() + state.size();
+  header.dataOffset = (end + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT
+    * IMAGE_ALIGNMENT;
+  header.dataSize = space.size();
+  header.here = space.here();
+
+  image.clear();
+  append(image, header);
+  const unsigned char *cells = reinterpret_cast<const unsigned char *>(
+    code.data());
+  image.insert(image.end(), cells, cells + code.size() * sizeof(UCell));
+  image.insert(image.end(), words.begin(), words.end());
+  image.insert(image.end(), state.begin(), state.end());
+  image.resize(header.dataOffset, 0);
+  std::vector<unsigned char> data;
+  space.save(checkpoint ? space.size() : space.here(), data);
+  image.insert(image.end(), data.begin(), data.end());
+  // In an image, everything past HERE, the heap included, starts out zeroed
+  image.resize(header.dataOffset + header.dataSize, 0);
+}
+
+static bool writeAll(int fd, const std::vector<unsigned char> &bytes) {
+  size_t written = 0;
+  while (written < bytes.size()) {
+    const ssize_t n = write(fd, bytes.data() + written,
+                            bytes.size() - written);
+    if (n < 0) {
+      return false;
+    }
+    written += n;
+  }
+
+  return true;
+}
+
+static bool save(VirtualMachine &vm, bool checkpoint,
+                 const std::string &path) {
+  std::vector<unsigned char> image;
+  serialize(vm, checkpoint, image);
+
+  // Written beside path and renamed over it, so the file at path is always
+  // a whole image. Machines that mapped the old one keep it: truncating it
+  // in place would pull the pages out from under them.
+  const std::string temporary = path + ".tmp";
+  const int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC
+                      | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  const bool written = writeAll(fd, image) && fsync(fd) == 0;
+  if (close(fd) != 0 || !written
+      || std::rename(temporary.c_str(), path.c_str()) != 0) {
+    unlink(temporary.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Load the image or checkpoint open on fd. Everything is read and checked
+ * before vm is touched.
+ */
+static bool load(VirtualMachine &vm, bool checkpoint, int fd) {
+  struct stat st;
+  ImageHeader header;
+  if (fstat(fd, &st) != 0
+      || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+      || !validHeader(header, st.st_size)
+      || (header.stateBytes != 0) != checkpoint) {
+    return false;
+  }
+
+  // The code and words are copied out; the data space stays mapped
+  void *front = mmap(nullptr, header.dataOffset, PROT_READ, MAP_PRIVATE, fd,
+                     0);
+  void *data = mmap(nullptr, header.dataSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE, fd, header.dataOffset);
+  if (front == MAP_FAILED || data == MAP_FAILED) {
+    if (front != MAP_FAILED) {
+      munmap(front, header.dataOffset);
+    }
+    if (data != MAP_FAILED) {
+      munmap(data, header.dataSize);
+    }
+    return false;
+  }
+
+  Reader reader{static_cast<const unsigned char *>(front),
+                static_cast<size_t>(header.dataOffset)};
+  Code code;
+  std::vector<Dictionary::Word> words;
+  MachineState state;
+  bool ok = readContents(reader, header, code, words)
+    && (!checkpoint || readState(reader, state));
+  munmap(front, header.dataOffset);
+
+  if (checkpoint) {
+    ok = ok && state.limit >= header.here && state.limit <= header.dataSize
+      && state.dataStack.size() <= vm.dataStack().size()
+      && state.returnStack.size() <= vm.returnStack().size()
+      && state.floatStack.size() <= vm.floatStack().size()
+      && state.vectorStack.size() <= vm.vectorStack().size()
+      && vm.dictionary().load(code, words, state.genericSites,
+                              state.quickenedSites);
+  } else {
+    ok = ok && vm.dictionary().load(code, words);
+  }
+  if (!ok) {
+    munmap(data, header.dataSize);
+    return false;
+  }
+
+  vm.heap().clear();
+  if (!checkpoint) {
+    // The image's data is the snapshot, so machines that load it share its
+    // pages even after reset()
+    vm.dataSpace().adopt(static_cast<unsigned char *>(data), header.dataSize,
+                         header.here, unmap, fd, header.dataOffset);
+    vm.markBooted();
+    return true;
+  }
+
+  vm.dataSpace().adopt(static_cast<unsigned char *>(data), header.dataSize,
+                       header.here, unmap);
+
+  vm.dataSpace().setLimit(state.limit);
+  vm.heap().setState(state.heap);
+  restoreStack(vm.dataStack(), state.dataStack);
+  restoreStack(vm.returnStack(), state.returnStack);
+  restoreStack(vm.floatStack(), state.floatStack);
+  restoreStack(vm.vectorStack(), state.vectorStack);
+  vm.jump(state.ip);
+
+  return true;
+}
+
+static bool load(VirtualMachine &vm, bool checkpoint,
+                 const std::string &path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  const bool loaded = load(vm, checkpoint, fd);
+  close(fd);
+
+  return loaded;
+}
+
+
+bool saveImage(VirtualMachine &vm, const std::string &path) {
+  return save(vm, false, path);
+}
+
+bool shareImage(VirtualMachine &vm, const std::string &name, int &fd) {
+  std::vector<unsigned char> image;
+  serialize(vm, false, image);
+
+  // An object already under name is unlinked rather than rewritten, so the
+  // machines that mapped it keep it
+  if (!name.empty()) {
+    shm_unlink(name.c_str());
+  }
+  fd = name.empty()
+    ? memfd_create("bbforth-image", MFD_CLOEXEC | MFD_ALLOW_SEALING)
+    : shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    return false;
+  }
+
+  // Nothing can change an anonymous image once it's written
+  const int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+  if (!writeAll(fd, image)
+      || (name.empty() && fcntl(fd, F_ADD_SEALS, seals) != 0)) {
+    close(fd);
+    if (!name.empty()) {
+      shm_unlink(name.c_str());
+    }
+    return false;
+  }
+
+  return true;
+}
+
+bool loadImage(VirtualMachine &vm, const std::string &path) {
+  return load(vm, false, path);
+}
+
+bool loadSharedImage(VirtualMachine &vm, const std::string &name) {
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return false;
+  }
+
+  const bool loaded = loadImage(vm, fd);
+  close(fd);
+
+  return loaded;
+}
+
+bool loadImage(VirtualMachine &vm, int fd) {
+  return load(vm, false, fd);
+}
+
+bool loadImage(VirtualMachine &vm, const unsigned char *image, size_t size) {
+  ImageHeader header;
+  if (size < sizeof(header)) {
+    return false;
+  }
+  std::memcpy(&header, image, sizeof(header));
+
+  Reader reader{image, static_cast<size_t>(header.dataOffset)};
+  Code code;
+  std::vector<Dictionary::Word> words;
+  if (!validHeader(header, size) || header.stateBytes != 0
+      || header.here > vm.dataSpace().size()
+      || !readContents(reader, header, code, words)
+      || !vm.dictionary().load(code, words)) {
+    return false;
+  }
+
+  // image may be read-only, so the data is copied instead of adopted
+  const unsigned char *data = image + header.dataOffset;
+  vm.heap().clear();
+  vm.dataSpace().restore(std::vector<unsigned char>(data, data + header.here));
+  vm.markBooted();
+
+  return true;
+}
+
+bool saveCheckpoint(VirtualMachine &vm, const std::string &path) {
+  return save(vm, true, path);
+}
+
+bool loadCheckpoint(VirtualMachine &vm, const std::string &path) {
+  return load(vm, true, path);
+}
@@ -0,0 +1,299 @@
+
+#include <cctype>
+
+#include "dictionary.hpp"
+#include "interpreter.hpp"
+
+
+/*
+ * Primitives by name. Opcodes with operands are left out: the interpreter
+ * compiles those itself.
+ */
+static const struct {
+  const char *name;
+  enum OpCode opcode;
+} PRIMITIVES[] = {
+  {"+", OPCODE_PLUS},
+  {"1+", OPCODE_ONE_PLUS},
+  {"-", OPCODE_MINUS},
+  {"1-", OPCODE_ONE_MINUS},
+  {"*", OPCODE_STAR},
+  {"/", OPCODE_SLASH},
+  {"MOD", OPCODE_MOD},
+  {"/MOD", OPCODE_SLASH_MOD},
+  {"NEGATE", OPCODE_NEGATE},
+  {"ABS", OPCODE_ABS},
+  {"MIN", OPCODE_MIN},
+  {"MAX", OPCODE_MAX},
+  {"AND", OPCODE_AND},
+  {"OR", OPCODE_OR},
+  {"XOR", OPCODE_XOR},
+  {"INVERT", OPCODE_INVERT},
+  {"LSHIFT", OPCODE_LSHIFT},
+  {"RSHIFT", OPCODE_RSHIFT},
+  {"2*", OPCODE_TWO_STAR},
+  {"2/", OPCODE_TWO_SLASH},
+  {"<", OPCODE_LESS_THAN},
+  {"=", OPCODE_EQUALS},
+  {">", OPCODE_GREATER_THAN},
+  {"0<", OPCODE_ZERO_LESS_THAN},
+  {"0=", OPCODE_ZERO_EQUALS},
+  {"U<", OPCODE_U_LESS_THAN},
+  {"*/", OPCODE_STAR_SLASH},
+  {"*/MOD", OPCODE_STAR_SLASH_MOD},
+  {"D+", OPCODE_D_PLUS},
+  {"D-", OPCODE_D_MINUS},
+  {"DNEGATE", OPCODE_D_NEGATE},
+  {"UM*", OPCODE_UM_STAR},
+  {"M*", OPCODE_M_STAR},
+  {"UM/MOD", OPCODE_UM_SLASH_MOD},
+  {"FM/MOD", OPCODE_FM_SLASH_MOD},
+  {"SM/REM", OPCODE_SM_SLASH_REM},
+  {"M*/", OPCODE_M_STAR_SLASH},
+  {"D<", OPCODE_D_LESS_THAN},
+  {"D=", OPCODE_D_EQUALS},
+  {"F+", OPCODE_F_PLUS},
+  {"F-", OPCODE_F_MINUS},
+  {"F*", OPCODE_F_STAR},
+  {"F/", OPCODE_F_SLASH},
+  {"F*+", OPCODE_F_STAR_PLUS},
+  {"FSQRT", OPCODE_F_SQRT},
+  {"F<", OPCODE_F_LESS_THAN},
+  {"S>F", OPCODE_S_TO_F},
+  {"F>S", OPCODE_F_TO_S},
+  {"V+", OPCODE_V_PLUS},
+  {"V*", OPCODE_V_STAR},
+  {"VAND", OPCODE_V_AND},
+  {"VMIN", OPCODE_V_MIN},
+  {"VMAX", OPCODE_V_MAX},
+  {"VSUM", OPCODE_V_SUM},
+  {"VLOAD", OPCODE_V_LOAD},
+  {"VSTORE", OPCODE_V_STORE},
+  {"@", OPCODE_FETCH},
+  {"!", OPCODE_STORE},
+  {"C@", OPCODE_C_FETCH},
+  {"C!", OPCODE_C_STORE},
+  {"+!", OPCODE_PLUS_STORE},
+  {"F@", OPCODE_F_FETCH},
+  {"F!", OPCODE_F_STORE},
+  {"HERE", OPCODE_HERE},
+  {"ALLOT", OPCODE_ALLOT},
+  {",", OPCODE_COMMA},
+  {"C,", OPCODE_C_COMMA},
+  {"ALIGN", OPCODE_ALIGN},
+  {"CELLS", OPCODE_CELLS},
+  {"MOVE", OPCODE_MOVE},
+  {"FILL", OPCODE_FILL},
+  {"ERASE", OPCODE_ERASE},
+  {"CMOVE", OPCODE_CMOVE},
+  {"COMPARE", OPCODE_COMPARE},
+  {"SEARCH", OPCODE_SEARCH},
+  {"ALLOCATE", OPCODE_ALLOCATE},
+  {"FREE", OPCODE_FREE},
+  {"RESIZE", OPCODE_RESIZE},
+  {"REGION", OPCODE_REGION},
+  {"RALLOT", OPCODE_R_ALLOT},
+  {"RFREE-ALL", OPCODE_R_FREE_ALL},
+  {"SAVE-IMAGE", OPCODE_SAVE_IMAGE},
+  {"DROP", OPCODE_DROP},
+  {"DUP", OPCODE_DUP},
+  {"OVER", OPCODE_OVER},
+  {"SWAP", OPCODE_SWAP},
+  {"ROT", OPCODE_ROT},
+  {"?DUP", OPCODE_QUESTION_DUP},
+  {"2DROP", OPCODE_TWO_DROP},
+  {"2DUP", OPCODE_TWO_DUP},
+  {"2OVER", OPCODE_TWO_OVER},
+  {"2SWAP", OPCODE_TWO_SWAP},
+  {"EXECUTE", OPCODE_EXECUTE},
+};
+
+bool primitive(const std::string &name, enum OpCode &opcode) {
+  for (const auto &p : PRIMITIVES) {
+    if (name == p.name) {
+      opcode = p.opcode;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool parseNumber(const std::string &name, UCell &value) {
+  size_t i = 0;
+  const bool negative = i < name.size() && name[i] == '-';
+  if (negative) {
+    i++;
+  }
+  unsigned int base = 10;
+  if (i < name.size() && name[i] == '$') {
+    base = 16;
+    i++;
+  }
+  if (i == name.size()) {
+    return false;
+  }
+
+  // Wraps around like cell arithmetic, so -1 and $FFFFFFFF are the same
+  UCell::type n = 0;
+  for (; i < name.size(); i++) {
+    const char c = static_cast<char>(std::toupper(name[i]));
+    unsigned int digit;
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if (c >= 'A' && c <= 'F') {
+      digit = c - 'A' + 10;
+    } else {
+      return false;
+    }
+    if (digit >= base) {
+      return false;
+    }
+    n = n * base + digit;
+  }
+
+  value = UCell{negative ? 0 - n : n};
+
+  return true;
+}
+
+
+Interpreter::Interpreter(VirtualMachine &vm)
+  : myVm(vm),
+  mySource{},
+  myiNext{0},
+  myCompiling{false},
+  myName{},
+  myBody{},
+  myError{}
+{
+}
+
+bool Interpreter::interpret(const std::string &source) {
+  mySource = source;
+  myiNext = 0;
+  myError.clear();
+
+  std::string name;
+  while (next(name)) {
+    if (name == "\\") {
+      skipPast('\n');
+    } else if (name == "(") {
+      skipPast(')');
+    } else if (!(myCompiling ? compileWord(name) : interpretWord(name))) {
+      return fail(name);
+    }
+  }
+
+  if (myCompiling) {
+    return fail(myName);
+  }
+
+  return true;
+}
+
+bool Interpreter::next(std::string &name) {
+  while (myiNext < mySource.size()
+         && std::isspace(static_cast<unsigned char>(mySource[myiNext]))) {
+    myiNext++;
+  }
+  const size_t start = myiNext;
+  while (myiNext < mySource.size()
+         && !std::isspace(static_cast<unsigned char>(mySource[myiNext]))) {
+    myiNext++;
+  }
+
+  name = mySource.substr(start, myiNext - start);
+
+  return !name.empty();
+}
+
+void Interpreter::skipPast(char delimiter) {
+  const size_t end = mySource.find(delimiter, myiNext);
+  myiNext = end == std::string::npos ? mySource.size() : end + 1;
+}
+
+bool Interpreter::interpretWord(const std::string &name) {
+  Dictionary &dictionary = myVm.dictionary();
+  DataSpace &space = myVm.dataSpace();
+  size_t xt;
+  enum OpCode opcode;
+  UCell value;
+
+  if (name == ":") {
+    myBody.clear();
+    myCompiling = next(myName);
+    return myCompiling;
+  } else if (name == "VARIABLE") {
+    if (!space.align()) {
+      return false;
+    }
+    const UCell address{static_cast<UCell::type>(space.here())};
+    return space.comma(UCell{0}) && defineNext(Code{OPCODE_LITERAL, address});
+  } else if (name == "CONSTANT" || name == "VALUE") {
+    return myVm.dataStack().pop(value)
+      && defineNext(Code{name == "VALUE" ? OPCODE_VALUE : OPCODE_LITERAL,
+                         value});
+  } else if (name == "TO") {
+    return tick(xt)
+      && myVm.execute(Code{OPCODE_TO, UCell{static_cast<UCell::type>(xt)}});
+  } else if (name == "'") {
+    return tick(xt) && myVm.dataStack().push(UCell{
+      static_cast<UCell::type>(xt)});
+  } else if (dictionary.find(name, xt)) {
+    return myVm.execute(xt);
+  } else if (primitive(name, opcode)) {
+    return myVm.execute(Code{opcode});
+  } else if (parseNumber(name, value)) {
+    return myVm.dataStack().push(value);
+  }
+
+  return false;
+}
+
+bool Interpreter::compileWord(const std::string &name) {
+  size_t xt;
+  enum OpCode opcode;
+  UCell value;
+
+  if (name == ";") {
+    myCompiling = false;
+    return myVm.define(myName, myBody, xt);
+  } else if (name == "TO" || name == "[']") {
+    if (!tick(xt)) {
+      return false;
+    }
+    myBody.push_back(name == "TO" ? OPCODE_TO : OPCODE_LITERAL);
+    myBody.push_back(UCell{static_cast<UCell::type>(xt)});
+  } else if (myVm.dictionary().find(name, xt)) {
+    myBody.push_back(OPCODE_CALL);
+    myBody.push_back(UCell{static_cast<UCell::type>(xt)});
+  } else if (primitive(name, opcode)) {
+    myBody.push_back(opcode);
+  } else if (parseNumber(name, value)) {
+    myBody.push_back(OPCODE_LITERAL);
+    myBody.push_back(value);
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+bool Interpreter::defineNext(const Code &body) {
+  std::string name;
+  size_t xt;
+  return next(name) && myVm.define(name, body, xt);
+}
+
+bool Interpreter::tick(size_t &xt) {
+  std::string name;
+  return next(name) && myVm.dictionary().find(name, xt);
+}
+
+bool Interpreter::fail(const std::string &name) {
+  // Drop any unfinished definition
+  myCompiling = false;
+  myError = name;
+  return false;
+}
@@ -1,6 +1,79 @@
+#include <cstdio>
+#include <cstring>
 
+#include <unistd.h>
+
+#include "dictionary.hpp"
+#include "fork_server.hpp"
+#include "image.hpp"
 #include "virtual_machine.hpp"
 
+// The core wordset, compiled at build time (see src/boot_image.S)
+extern "C" const unsigned char bbforth_boot_image[];
+extern "C" const unsigned char bbforth_boot_image_end[];
+
+static int usage(const char *program) {
+  std::fprintf(stderr, "usage: %s [--image FILE | --shared-image NAME]"
+               " [--share NAME | --serve SOCKET]\n", program);
+  return 2;
+}
+
 int main(int argc, char *argv[]) {
-   return 0;
+  VirtualMachine vm;
+  if (!loadImage(vm, bbforth_boot_image,
+                 bbforth_boot_image_end - bbforth_boot_image)) {
+    std::fprintf(stderr, "%s: can't load the boot image\n", argv[0]);
+    return 1;
+  }
+
+  // Sharing an image is all a run with --share does
+  bool shared = false;
+  const char *serveOn = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+      if (!loadImage(vm, argv[++i])) {
+        std::fprintf(stderr, "%s: can't load image %s\n", argv[0], argv[i]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "--shared-image") == 0 && i + 1 < argc) {
+      if (!loadSharedImage(vm, argv[++i])) {
+        std::fprintf(stderr, "%s: can't load shared image %s\n", argv[0],
+                     argv[i]);
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "--share") == 0 && i + 1 < argc) {
+      int fd;
+      if (!shareImage(vm, argv[++i], fd)) {
+        std::fprintf(stderr, "%s: can't share image as %s\n", argv[0],
+                     argv[i]);
+        return 1;
+      }
+      close(fd);
+      shared = true;
+    } else if (std::strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      serveOn = argv[++i];
+    } else {
+      return usage(argv[0]);
+    }
+  }
+  if (shared) {
+    return 0;
+  }
+
+  if (serveOn) {
+    ForkServer server{vm};
+    if (!server.listen(serveOn) || !server.serve()) {
+      std::fprintf(stderr, "%s: can't serve on %s\n", argv[0], serveOn);
+      return 1;
+    }
+    return 0;
+  }
+
+  // An image says what to do by defining MAIN
+  size_t xt;
+  if (vm.dictionary().find("MAIN", xt) && !vm.execute(xt)) {
+    return 1;
+  }
+
+  return 0;
 }
@@ -1,10 +1,14 @@
 
-#include "operation.hpp"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-template<>
-SCell operator-(SCell lhs) {
-  return SCell{-lhs.get()};
-}
+#include "heap.hpp"
+#include "image.hpp"
+#include "operation.hpp"
 
 UCell operator<<(UCell lhs, const SCell& rhs) {
   return UCell{lhs.get() << rhs.get()};
@@ -14,291 +18,1463 @@ UCell operator>>(UCell lhs, const SCell& rhs) {
 }
 
 
+static DoubleUnsigned magnitude(DoubleSigned d) {
+  return d < 0 ? 0 - static_cast<DoubleUnsigned>(d) : d;
+}
+
+/*
+ * The product takes three cells, which is more than the widest native
+ * integer when cells are 64 bits. It's formed as a double high part and a
+ * single low cell, and divided in two steps that each fit a double.
+ */
+DoubleSigned scaleDouble(DoubleSigned d, SCell n1, SCell n2) {
+  const bool negative = ((d < 0) != (n1.get() < 0)) != (n2.get() < 0);
+  const DoubleUnsigned ud = magnitude(d);
+  const DoubleUnsigned u1 = magnitude(n1.get()), u2 = magnitude(n2.get());
+  const DoubleUnsigned mask = static_cast<UCell::type>(-1);
+
+  const DoubleUnsigned low = (ud & mask) * u1;
+  const DoubleUnsigned high = (ud >> CELL_BITS) * u1 + (low >> CELL_BITS);
+  const DoubleUnsigned qHigh = high / u2, r = high % u2;
+  const DoubleUnsigned qLow = (r << CELL_BITS | (low & mask)) / u2;
+  const DoubleUnsigned q = qHigh << CELL_BITS | qLow;
+
+  return negative ? 0 - q : q;
+}
+
+
 /*
  * Now let's define translations from OpCodes to what the machine does
  */
 
 
-void Operation<OPCODE_PLUS>::operator()(DataStack &ds) {
-  UCell n1, n2;
-  ds.pop(n1);
-  ds.pop(n2);
-  ds.push(n1 + n2);
+void Operation<OPCODE_SLASH>::evaluate(const UCell *in, UCell *out) const {
+  SCell n1{in[0]}, n2{in[1]};
+  out[0] = n1 / n2;
 }
 
-void Operation<OPCODE_ONE_PLUS>::operator()(DataStack &ds) {
-  UCell n1;
-  ds.pop(n1);
-  ds.push(n1 + static_cast<unsigned int>(1));
+void Operation<OPCODE_MOD>::evaluate(const UCell *in, UCell *out) const {
+  SCell n1{in[0]}, n2{in[1]};
+  out[0] = n1 % n2;
 }
 
-void Operation<OPCODE_MINUS>::operator()(DataStack &ds) {
-  UCell n1, n2;
-  ds.pop(n2);
-  ds.pop(n1);
-  ds.push(n1 - n2);
+void Operation<OPCODE_SLASH_MOD>::evaluate(const UCell *in, UCell *out) const {
+  SCell n1{in[0]}, n2{in[1]};
+  out[0] = n1 / n2;
+  out[1] = n1 % n2;
 }
 
-void Operation<OPCODE_ONE_MINUS>::operator()(DataStack &ds) {
-  UCell n1;
-  ds.pop(n1);
-  ds.push(n1 - static_cast<unsigned int>(1));
+void Operation<OPCODE_ABS>::evaluate(const UCell *in, UCell *out) const {
+  SCell n1{in[0]};
+  out[0] = SCell{std::abs(n1.get())};
 }
 
-void Operation<OPCODE_STAR>::operator()(DataStack &ds) {
-  UCell n1, n2;
-  ds.pop(n1);
-  ds.pop(n2);
-  ds.push(n1 * n2);
+void Operation<OPCODE_INVERT>::evaluate(const UCell *in, UCell *out) const {
+  out[0] = ~in[0];
 }
 
-void Operation<OPCODE_SLASH>::operator()(DataStack &ds) {
-  SCell n1, n2;
-  ds.pop(n2);
-  ds.pop(n1);
-  ds.push(n1 / n2);
+void Operation<OPCODE_LSHIFT>::evaluate(const UCell *in, UCell *out) const {
+  out[0] = in[0] << SCell{in[1]};
 }
 
-void Operation<OPCODE_MOD>::operator()(DataStack &ds) {
-  SCell n1, n2;
-  ds.pop(n2);
-  ds.pop(n1);
-  ds.push(n1 % n2);
+void Operation<OPCODE_RSHIFT>::evaluate(const UCell *in, UCell *out) const {
+  out[0] = in[0] >> SCell{in[1]};
 }
 
-void Operation<OPCODE_SLASH_MOD>::operator()(DataStack &ds) {
-  SCell n1, n2;
-  ds.pop(n2);
-  ds.pop(n1);
-  ds.push(n1 / n2);
-  ds.push(n1 % n2);
+void Operation<OPCODE_TWO_STAR>::evaluate(const UCell *in, UCell *out) const {
+  SCell n1{in[0]};
+  out[0] = n1 * static_cast<SCell::type>(2);
 }
 
-void Operation<OPCODE_NEGATE>::operator()(DataStack &ds) {
-  SCell n1;
-  ds.pop(n1);
-  ds.push(std::negate<SCell>{}(n1));
+void Operation<OPCODE_TWO_SLASH>::evaluate(const UCell *in, UCell *out) const {
+  SCell n1{in[0]};
+  out[0] = n1 / static_cast<SCell::type>(2);
 }
 
-void Operation<OPCODE_ABS>::operator()(DataStack &ds) {
-  SCell n1;
-  ds.pop(n1);
-  ds.push<SCell::type>(std::abs<SCell::type>(n1));
+void Operation<OPCODE_LESS_THAN>::evaluate(const UCell *in, UCell *out) const {
+  SCell n1{in[0]}, n2{in[1]};
+  out[0] = n1 < n2;
 }
 
-void Operation<OPCODE_MIN>::operator()(DataStack &ds) {
-  SCell n1, n2;
-  ds.pop(n1);
-  ds.pop(n2);
-  ds.push(std::min<SCell::type>(n1, n2));
+void Operation<OPCODE_EQUALS>::evaluate(const UCell *in, UCell *out) const {
+  out[0] = in[0] == in[1];
 }
 
-void Operation<OPCODE_MAX>::operator()(DataStack &ds) {
-  SCell n1, n2;
-  ds.pop(n1);
-  ds.pop(n2);
-  ds.push(std::max<SCell::type>(n1, n2));
+void Operation<OPCODE_GREATER_THAN>::evaluate(const UCell *in,
+                                              UCell *out) const {
+  SCell n1{in[0]}, n2{in[1]};
+  out[0] = n1 > n2;
 }
 
-void Operation<OPCODE_AND>::operator()(DataStack &ds) {
-  UCell n1, n2;
-  ds.pop(n1);
-  ds.pop(n2);
-  ds.push(n1 & n2);
+void Operation<OPCODE_ZERO_LESS_THAN>::evaluate(const UCell *in,
+                                                UCell *out) const {
+  SCell n1{in[0]};
+  out[0] = n1 < static_cast<SCell::type>(0);
 }
 
-void Operation<OPCODE_OR>::operator()(DataStack &ds) {
-  UCell n1, n2;
-  ds.pop(n1);
-  ds.pop(n2);
-  ds.push(n1 | n2);
+void Operation<OPCODE_ZERO_EQUALS>::evaluate(const UCell *in,
+                                             UCell *out) const {
+  out[0] = in[0] == static_cast<UCell::type>(0);
 }
 
-void Operation<OPCODE_XOR>::operator()(DataStack &ds) {
-  UCell n1, n2;
-  ds.pop(n1);
-  ds.pop(n2);
-  ds.push(n1 ^ n2);
+void Operation<OPCODE_U_LESS_THAN>::evaluate(const UCell *in,
+                                             UCell *out) const {
+  out[0] = in[0] < in[1];
 }
 
-void Operation<OPCODE_INVERT>::operator()(DataStack &ds) {
-  UCell n1;
-  ds.pop(n1);
-  ds.push(~n1);
+// The product is kept double width, so it never overflows
+void Operation<OPCODE_STAR_SLASH>::evaluate(const UCell *in,
+                                            UCell *out) const {
+  SCell n1{in[0]}, n2{in[1]}, n3{in[2]};
+  const DoubleSigned d = static_cast<DoubleSigned>(n1.get()) * n2.get();
+  out[0] = SCell{static_cast<SCell::type>(d / n3.get())};
 }
 
-void Operation<OPCODE_LSHIFT>::operator()(DataStack &ds) {
-  UCell u1;
-  SCell n1;
-  ds.pop(n1);
-  ds.pop(u1);
-  ds.push(u1 << n1);
+void Operation<OPCODE_STAR_SLASH_MOD>::evaluate(const UCell *in,
+                                                UCell *out) const {
+  SCell n1{in[0]}, n2{in[1]}, n3{in[2]};
+  const DoubleSigned d = static_cast<DoubleSigned>(n1.get()) * n2.get();
+  out[0] = SCell{static_cast<SCell::type>(d % n3.get())};
+  out[1] = SCell{static_cast<SCell::type>(d / n3.get())};
 }
 
-void Operation<OPCODE_RSHIFT>::operator()(DataStack &ds) {
-  UCell u1;
-  SCell n1;
-  ds.pop(n1);
-  ds.pop(u1);
-  ds.push(u1 >> n1);
+void Operation<OPCODE_D_PLUS>::evaluate(const UCell *in, UCell *out) const {
+  splitDouble(joinDouble(in[0], in[1]) + joinDouble(in[2], in[3]),
+              out[0], out[1]);
 }
 
-void Operation<OPCODE_TWO_STAR>::operator()(DataStack &ds) {
-  SCell n1;
-  ds.pop(n1);
-  ds.push(n1 * 2);
+void Operation<OPCODE_D_MINUS>::evaluate(const UCell *in, UCell *out) const {
+  splitDouble(joinDouble(in[0], in[1]) - joinDouble(in[2], in[3]),
+              out[0], out[1]);
 }
 
-void Operation<OPCODE_TWO_SLASH>::operator()(DataStack &ds) {
-  SCell n1;
-  ds.pop(n1);
-  ds.push(n1 / 2);
+void Operation<OPCODE_D_NEGATE>::evaluate(const UCell *in, UCell *out) const {
+  splitDouble(0 - joinDouble(in[0], in[1]), out[0], out[1]);
 }
 
-void Operation<OPCODE_LESS_THAN>::operator()(DataStack &ds) {
-  SCell n1, n2;
-  ds.pop(n2);
-  ds.pop(n1);
-  ds.push(n1 < n2);
+void Operation<OPCODE_UM_STAR>::evaluate(const UCell *in, UCell *out) const {
+  splitDouble(static_cast<DoubleUnsigned>(in[0].get()) * in[1].get(),
+              out[0], out[1]);
 }
 
-void Operation<OPCODE_EQUALS>::operator()(DataStack &ds) {
-  UCell n1, n2;
-  ds.pop(n2);
-  ds.pop(n1);
-  ds.push(n1 == n2);
+void Operation<OPCODE_M_STAR>::evaluate(const UCell *in, UCell *out) const {
+  SCell n1{in[0]}, n2{in[1]};
+  splitDouble(static_cast<DoubleSigned>(n1.get()) * n2.get(), out[0], out[1]);
 }
 
-void Operation<OPCODE_GREATER_THAN>::operator()(DataStack &ds) {
-  SCell n1, n2;
-  ds.pop(n2);
-  ds.pop(n1);
-  ds.push(n1 > n2);
+void Operation<OPCODE_UM_SLASH_MOD>::evaluate(const UCell *in,
+                                              UCell *out) const {
+  const DoubleUnsigned ud = joinDouble(in[0], in[1]);
+  out[0] = UCell{static_cast<UCell::type>(ud % in[2].get())};
+  out[1] = UCell{static_cast<UCell::type>(ud / in[2].get())};
 }
 
-void Operation<OPCODE_ZERO_LESS_THAN>::operator()(DataStack &ds) {
-  SCell n1;
-  ds.pop(n1);
-  ds.push(n1 < 0);
+void Operation<OPCODE_FM_SLASH_MOD>::evaluate(const UCell *in,
+                                              UCell *out) const {
+  SCell r, q;
+  floorDivide(joinDouble(in[0], in[1]), SCell{in[2]}, r, q);
+  out[0] = r;
+  out[1] = q;
 }
 
-void Operation<OPCODE_ZERO_EQUALS>::operator()(DataStack &ds) {
-  UCell n1;
-  ds.pop(n1);
-  ds.push(n1 == static_cast<unsigned int>(0));
+void Operation<OPCODE_SM_SLASH_REM>::evaluate(const UCell *in,
+                                              UCell *out) const {
+  const DoubleSigned d = joinDouble(in[0], in[1]);
+  SCell n1{in[2]};
+  out[0] = SCell{static_cast<SCell::type>(d % n1.get())};
+  out[1] = SCell{static_cast<SCell::type>(d / n1.get())};
 }
 
-void Operation<OPCODE_U_LESS_THAN>::operator()(DataStack &ds) {
-  UCell n1, n2;
-  ds.pop(n2);
-  ds.pop(n1);
-  ds.push(n1 < n2);
+void Operation<OPCODE_M_STAR_SLASH>::evaluate(const UCell *in,
+                                              UCell *out) const {
+  splitDouble(scaleDouble(joinDouble(in[0], in[1]), SCell{in[2]},
+                          SCell{in[3]}),
+              out[0], out[1]);
 }
 
-void Operation<OPCODE_STAR_SLASH>::operator()(DataStack &ds) {
-  UCell n1, n2, n3;
-  ds.pop(n3);
-  ds.pop(n2);
-  ds.pop(n1);
-  ds.push((n1*n2)/n3);
-}
-
-void Operation<OPCODE_STAR_SLASH_MOD>::operator()(DataStack &ds) {
-  SCell n1, n2, n3, n4, n5;
-  ds.pop(n3);
-  ds.pop(n2);
-  ds.pop(n1);
-  n4 = (n1*n2) % n3;
-  n5 = (n1*n2) / n3;
-  ds.push(n4);
-  ds.push(n5);
+void Operation<OPCODE_D_LESS_THAN>::evaluate(const UCell *in,
+                                             UCell *out) const {
+  const DoubleSigned d1 = joinDouble(in[0], in[1]);
+  const DoubleSigned d2 = joinDouble(in[2], in[3]);
+  out[0] = SCell{d1 < d2};
+}
+
+void Operation<OPCODE_D_EQUALS>::evaluate(const UCell *in, UCell *out) const {
+  out[0] = SCell{joinDouble(in[0], in[1]) == joinDouble(in[2], in[3])};
+}
+
+void Operation<OPCODE_SLASH_CONSTANT>::evaluate(const UCell *in,
+                                                UCell *out) const {
+  out[0] = myDivisor.quotient(SCell{in[0]});
 }
 
-void Operation<OPCODE_DROP>::operator()(DataStack &ds) {
+void Operation<OPCODE_MOD_CONSTANT>::evaluate(const UCell *in,
+                                              UCell *out) const {
+  SCell n1{in[0]};
+  out[0] = myDivisor.remainder(n1, myDivisor.quotient(n1));
+}
+
+void Operation<OPCODE_SLASH_MOD_CONSTANT>::evaluate(const UCell *in,
+                                                    UCell *out) const {
+  SCell n1{in[0]}, q;
+  q = myDivisor.quotient(n1);
+  out[0] = q;
+  out[1] = myDivisor.remainder(n1, q);
+}
+
+void Operation<OPCODE_STAR_SLASH_MOD_CONSTANT>::evaluate(const UCell *in,
+                                                         UCell *out) const {
+  SCell r, q;
+  myDivisor.divideProduct(SCell{in[0]}, SCell{in[1]}, r, q);
+  out[0] = r;
+  out[1] = q;
+}
+
+bool Operation<OPCODE_DROP>::operator()(DataStack &ds) {
   UCell n1;
-  ds.pop(n1);
+  return ds.pop(n1);
 }
 
-void Operation<OPCODE_DUP>::operator()(DataStack &ds) {
+bool Operation<OPCODE_DUP>::operator()(DataStack &ds) {
   UCell n1;
-  ds.pop(n1);
-  ds.push(n1);
+  return ds.peek(n1) && ds.push(n1);
 }
 
-void Operation<OPCODE_OVER>::operator()(DataStack &ds) {
+bool Operation<OPCODE_OVER>::operator()(DataStack &ds) {
   UCell n1, n2;
-  ds.pop(n2);
-  ds.pop(n1);
+  if (!ds.pop(n2) || !ds.pop(n1)) {
+    return false;
+  }
   ds.push(n1);
   ds.push(n2);
-  ds.push(n1);
+  return ds.push(n1);
 }
 
-void Operation<OPCODE_SWAP>::operator()(DataStack &ds) {
+bool Operation<OPCODE_SWAP>::operator()(DataStack &ds) {
   UCell n1, n2;
-  ds.pop(n2);
-  ds.pop(n1);
+  if (!ds.pop(n2) || !ds.pop(n1)) {
+    return false;
+  }
   ds.push(n2);
-  ds.push(n1);
+  return ds.push(n1);
 }
 
-void Operation<OPCODE_ROT>::operator()(DataStack &ds) {
+bool Operation<OPCODE_ROT>::operator()(DataStack &ds) {
   UCell n1, n2, n3;
-  ds.pop(n3);
-  ds.pop(n2);
-  ds.pop(n1);
+  if (!ds.pop(n3) || !ds.pop(n2) || !ds.pop(n1)) {
+    return false;
+  }
   ds.push(n2);
   ds.push(n3);
-  ds.push(n1);
+  return ds.push(n1);
 }
 
-void Operation<OPCODE_QUESTION_DUP>::operator()(DataStack &ds) {
+bool Operation<OPCODE_QUESTION_DUP>::operator()(DataStack &ds) {
   UCell n1;
-  ds.peek(n1);
-  if (n1) {
-    ds.push(n1);
+  if (!ds.peek(n1)) {
+    return false;
   }
+  return !n1 || ds.push(n1);
 }
 
-void Operation<OPCODE_TWO_DROP>::operator()(DataStack &ds) {
+bool Operation<OPCODE_TWO_DROP>::operator()(DataStack &ds) {
   UCell n1, n2;
-  ds.pop(n2);
-  ds.pop(n1);
+  return ds.pop(n2) && ds.pop(n1);
 }
 
-void Operation<OPCODE_TWO_DUP>::operator()(DataStack &ds) {
+bool Operation<OPCODE_TWO_DUP>::operator()(DataStack &ds) {
   UCell n1, n2;
-  ds.pop(n2);
-  ds.peek(n1);
+  if (!ds.pop(n2) || !ds.peek(n1)) {
+    return false;
+  }
   ds.push(n2);
   ds.push(n1);
-  ds.push(n2);
+  return ds.push(n2);
 }
 
-void Operation<OPCODE_TWO_OVER>::operator()(DataStack &ds) {
+bool Operation<OPCODE_TWO_OVER>::operator()(DataStack &ds) {
   UCell n1, n2, n3, n4;
-  ds.pop(n4);
-  ds.pop(n3);
-  ds.pop(n2);
-  ds.pop(n1);
+  if (!ds.pop(n4) || !ds.pop(n3) || !ds.pop(n2) || !ds.pop(n1)) {
+    return false;
+  }
   ds.push(n1);
   ds.push(n2);
   ds.push(n3);
   ds.push(n4);
-  ds.push(n1);
-  ds.push(n2);
+  return ds.push(n1) && ds.push(n2);
 }
 
-void Operation<OPCODE_TWO_SWAP>::operator()(DataStack &ds) {
+bool Operation<OPCODE_TWO_SWAP>::operator()(DataStack &ds) {
   UCell n1, n2, n3, n4;
-  ds.pop(n4);
-  ds.pop(n3);
-  ds.pop(n2);
-  ds.pop(n1);
+  if (!ds.pop(n4) || !ds.pop(n3) || !ds.pop(n2) || !ds.pop(n1)) {
+    return false;
+  }
   ds.push(n3);
   ds.push(n4);
   ds.push(n1);
-  ds.push(n2);
+  return ds.push(n2);
+}
+
+void Operation<OPCODE_LITERAL>::operator()(DataStack &ds) {
+  ds.push(myValue);
+}
+
+bool Operation<OPCODE_F_PLUS>::operator()(DataStack &, FStack &fs) {
+  Float r1, r2;
+  if (!fs.pop(r2) || !fs.pop(r1)) {
+    return false;
+  }
+  return fs.push(r1 + r2);
+}
+
+bool Operation<OPCODE_F_MINUS>::operator()(DataStack &, FStack &fs) {
+  Float r1, r2;
+  if (!fs.pop(r2) || !fs.pop(r1)) {
+    return false;
+  }
+  return fs.push(r1 - r2);
+}
+
+bool Operation<OPCODE_F_STAR>::operator()(DataStack &, FStack &fs) {
+  Float r1, r2;
+  if (!fs.pop(r2) || !fs.pop(r1)) {
+    return false;
+  }
+  return fs.push(r1 * r2);
+}
+
+bool Operation<OPCODE_F_SLASH>::operator()(DataStack &, FStack &fs) {
+  Float r1, r2;
+  if (!fs.pop(r2) || !fs.pop(r1)) {
+    return false;
+  }
+  return fs.push(r1 / r2);
+}
+
+bool Operation<OPCODE_F_STAR_PLUS>::operator()(DataStack &, FStack &fs) {
+  Float r1, r2, r3;
+  if (!fs.pop(r3) || !fs.pop(r2) || !fs.pop(r1)) {
+    return false;
+  }
+  return fs.push(std::fma(r1, r2, r3));
+}
+
+bool Operation<OPCODE_F_SQRT>::operator()(DataStack &, FStack &fs) {
+  Float r1;
+  return fs.pop(r1) && fs.push(std::sqrt(r1));
+}
+
+bool Operation<OPCODE_F_LESS_THAN>::operator()(DataStack &ds, FStack &fs) {
+  Float r1, r2;
+  if (!fs.pop(r2) || !fs.pop(r1)) {
+    return false;
+  }
+  return ds.push(SCell{r1 < r2});
+}
+
+bool Operation<OPCODE_S_TO_F>::operator()(DataStack &ds, FStack &fs) {
+  SCell n1;
+  return ds.pop(n1) && fs.push(static_cast<Float>(n1.get()));
+}
+
+bool Operation<OPCODE_F_TO_S>::operator()(DataStack &ds, FStack &fs) {
+  Float r1;
+  return fs.pop(r1) && ds.push(SCell{static_cast<SCell::type>(r1)});
+}
+
+void Operation<OPCODE_F_LITERAL>::operator()(DataStack &, FStack &fs) {
+  fs.push(myValue);
+}
+
+/*
+ * Lane-wise kernels for the vector words. Built with AVX2 (make
+ * ARCH_FLAGS=-mavx2) they're an instruction or two each; otherwise they're
+ * plain loops over a fixed number of lanes, which -O2 vectorizes for
+ * whatever the target has.
+ * AVX2 has no 64-bit multiply, so V* always loops on 64-bit cells.
+ */
+#ifdef __AVX2__
+static __m256i load(const Vector &v) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(v.lanes));
+}
+
+static Vector store(__m256i x) {
+  Vector v;
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(v.lanes), x);
+  return v;
+}
+#endif
+
+template<class F>
+static Vector eachLane(const Vector &a, const Vector &b, F f) {
+  Vector v;
+  for (size_t i = 0; i < VECTOR_LANES; i++) {
+    v.lanes[i] = UCell{f(a.lanes[i].get(), b.lanes[i].get())};
+  }
+  return v;
+}
+
+static Vector addLanes(const Vector &a, const Vector &b) {
+#if defined(__AVX2__) && BBFORTH_CELL_BITS == 32
+  return store(_mm256_add_epi32(load(a), load(b)));
+#elif defined(__AVX2__)
+  return store(_mm256_add_epi64(load(a), load(b)));
+#else
+  return eachLane(a, b, [](UCell::type x, UCell::type y) -> UCell::type {
+                    return x + y;
+                  });
+#endif
+}
+
+static Vector multiplyLanes(const Vector &a, const Vector &b) {
+#if defined(__AVX2__) && BBFORTH_CELL_BITS == 32
+  return store(_mm256_mullo_epi32(load(a), load(b)));
+#else
+  return eachLane(a, b, [](UCell::type x, UCell::type y) -> UCell::type {
+                    return x * y;
+                  });
+#endif
+}
+
+static Vector andLanes(const Vector &a, const Vector &b) {
+#ifdef __AVX2__
+  return store(_mm256_and_si256(load(a), load(b)));
+#else
+  return eachLane(a, b, [](UCell::type x, UCell::type y) -> UCell::type {
+                    return x & y;
+                  });
+#endif
+}
+
+static Vector minLanes(const Vector &a, const Vector &b) {
+#if defined(__AVX2__) && BBFORTH_CELL_BITS == 32
+  return store(_mm256_min_epi32(load(a), load(b)));
+#elif defined(__AVX2__)
+  const __m256i x = load(a), y = load(b);
+  return store(_mm256_blendv_epi8(x, y, _mm256_cmpgt_epi64(x, y)));
+#else
+  return eachLane(a, b, [](UCell::type x, UCell::type y) -> UCell::type {
+                    return std::min(static_cast<SCell::type>(x),
+                                    static_cast<SCell::type>(y));
+                  });
+#endif
+}
+
+static Vector maxLanes(const Vector &a, const Vector &b) {
+#if defined(__AVX2__) && BBFORTH_CELL_BITS == 32
+  return store(_mm256_max_epi32(load(a), load(b)));
+#elif defined(__AVX2__)
+  const __m256i x = load(a), y = load(b);
+  return store(_mm256_blendv_epi8(y, x, _mm256_cmpgt_epi64(x, y)));
+#else
+  return eachLane(a, b, [](UCell::type x, UCell::type y) -> UCell::type {
+                    return std::max(static_cast<SCell::type>(x),
+                                    static_cast<SCell::type>(y));
+                  });
+#endif
+}
+
+bool Operation<OPCODE_V_PLUS>::operator()(DataStack &, VStack &vs) {
+  Vector v1, v2;
+  if (!vs.pop(v2) || !vs.pop(v1)) {
+    return false;
+  }
+  return vs.push(addLanes(v1, v2));
+}
+
+bool Operation<OPCODE_V_STAR>::operator()(DataStack &, VStack &vs) {
+  Vector v1, v2;
+  if (!vs.pop(v2) || !vs.pop(v1)) {
+    return false;
+  }
+  return vs.push(multiplyLanes(v1, v2));
+}
+
+bool Operation<OPCODE_V_AND>::operator()(DataStack &, VStack &vs) {
+  Vector v1, v2;
+  if (!vs.pop(v2) || !vs.pop(v1)) {
+    return false;
+  }
+  return vs.push(andLanes(v1, v2));
+}
+
+bool Operation<OPCODE_V_MIN>::operator()(DataStack &, VStack &vs) {
+  Vector v1, v2;
+  if (!vs.pop(v2) || !vs.pop(v1)) {
+    return false;
+  }
+  return vs.push(minLanes(v1, v2));
+}
+
+bool Operation<OPCODE_V_MAX>::operator()(DataStack &, VStack &vs) {
+  Vector v1, v2;
+  if (!vs.pop(v2) || !vs.pop(v1)) {
+    return false;
+  }
+  return vs.push(maxLanes(v1, v2));
+}
+
+bool Operation<OPCODE_V_SUM>::operator()(DataStack &ds, VStack &vs) {
+  Vector v1;
+  if (!vs.pop(v1)) {
+    return false;
+  }
+  UCell::type sum = 0;
+  for (size_t i = 0; i < VECTOR_LANES; i++) {
+    sum += v1.lanes[i].get();
+  }
+  return ds.push(UCell{sum});
+}
+
+bool Operation<OPCODE_V_LOAD>::operator()(DataStack &ds, VStack &vs,
+                                          DataSpace &space) {
+  UCell address;
+  Vector v;
+  if (!ds.pop(address) || !space.fetch(address.get(), v)) {
+    return false;
+  }
+  return vs.push(v);
+}
+
+bool Operation<OPCODE_V_STORE>::operator()(DataStack &ds, VStack &vs,
+                                           DataSpace &space) {
+  UCell address;
+  Vector v1;
+  if (!ds.pop(address) || !vs.pop(v1)) {
+    return false;
+  }
+  return space.store(address.get(), v1);
+}
+
+bool Operation<OPCODE_FETCH>::operator()(DataStack &ds, DataSpace &space) {
+  UCell address, x;
+  if (!ds.pop(address) || !space.fetch(address.get(), x)) {
+    return false;
+  }
+  ds.push(x);
+  return true;
+}
+
+bool Operation<OPCODE_STORE>::operator()(DataStack &ds, DataSpace &space) {
+  UCell x, address;
+  if (!ds.pop(address) || !ds.pop(x)) {
+    return false;
+  }
+  return space.store(address.get(), x);
+}
+
+bool Operation<OPCODE_C_FETCH>::operator()(DataStack &ds, DataSpace &space) {
+  UCell address;
+  unsigned char c;
+  if (!ds.pop(address) || !space.fetch(address.get(), c)) {
+    return false;
+  }
+  ds.push(UCell{c});
+  return true;
+}
+
+bool Operation<OPCODE_C_STORE>::operator()(DataStack &ds, DataSpace &space) {
+  UCell c, address;
+  if (!ds.pop(address) || !ds.pop(c)) {
+    return false;
+  }
+  return space.store(address.get(), static_cast<unsigned char>(c.get()));
+}
+
+bool Operation<OPCODE_PLUS_STORE>::operator()(DataStack &ds,
+                                              DataSpace &space) {
+  UCell n, address, x;
+  if (!ds.pop(address) || !ds.pop(n) || !space.fetch(address.get(), x)) {
+    return false;
+  }
+  return space.store(address.get(), x + n);
+}
+
+bool Operation<OPCODE_F_FETCH>::operator()(DataStack &ds, FStack &fs,
+                                           DataSpace &space) {
+  UCell address;
+  Float r;
+  if (!ds.pop(address) || !space.fetch(address.get(), r)) {
+    return false;
+  }
+  fs.push(r);
+  return true;
 }
 
+bool Operation<OPCODE_F_STORE>::operator()(DataStack &ds, FStack &fs,
+                                           DataSpace &space) {
+  UCell address;
+  Float r;
+  if (!ds.pop(address) || !fs.pop(r)) {
+    return false;
+  }
+  return space.store(address.get(), r);
+}
+
+void Operation<OPCODE_HERE>::operator()(DataStack &ds, DataSpace &space) {
+  ds.push(UCell{static_cast<UCell::type>(space.here())});
+}
+
+bool Operation<OPCODE_ALLOT>::operator()(DataStack &ds, DataSpace &space) {
+  SCell n;
+  return ds.pop(n) && space.allot(n.get());
+}
+
+bool Operation<OPCODE_COMMA>::operator()(DataStack &ds, DataSpace &space) {
+  UCell x;
+  return ds.pop(x) && space.comma(x);
+}
+
+bool Operation<OPCODE_C_COMMA>::operator()(DataStack &ds, DataSpace &space) {
+  UCell c;
+  return ds.pop(c) && space.comma(static_cast<unsigned char>(c.get()));
+}
+
+bool Operation<OPCODE_ALIGN>::operator()(DataStack &, DataSpace &space) {
+  return space.align();
+}
+
+void Operation<OPCODE_CELLS>::evaluate(const UCell *in, UCell *out) const {
+  out[0] = in[0] * static_cast<UCell::type>(sizeof(UCell));
+}
+
+bool Operation<OPCODE_MOVE>::operator()(DataStack &ds, DataSpace &space) {
+  UCell from, to, u;
+  if (!ds.pop(u) || !ds.pop(to) || !ds.pop(from)) {
+    return false;
+  }
+  const unsigned char *src = space.bytes(from.get(), u.get());
+  unsigned char *dst = space.bytes(to.get(), u.get());
+  if (!src || !dst) {
+    return false;
+  }
+  std::memmove(dst, src, u.get());
+  return true;
+}
+
+bool Operation<OPCODE_FILL>::operator()(DataStack &ds, DataSpace &space) {
+  UCell address, u, c;
+  if (!ds.pop(c) || !ds.pop(u) || !ds.pop(address)) {
+    return false;
+  }
+  unsigned char *dst = space.bytes(address.get(), u.get());
+  if (!dst) {
+    return false;
+  }
+  std::memset(dst, static_cast<unsigned char>(c.get()), u.get());
+  return true;
+}
+
+bool Operation<OPCODE_ERASE>::operator()(DataStack &ds, DataSpace &space) {
+  UCell address, u;
+  if (!ds.pop(u) || !ds.pop(address)) {
+    return false;
+  }
+  unsigned char *dst = space.bytes(address.get(), u.get());
+  if (!dst) {
+    return false;
+  }
+  std::memset(dst, 0, u.get());
+  return true;
+}
+
+bool Operation<OPCODE_CMOVE>::operator()(DataStack &ds, DataSpace &space) {
+  UCell from, to, u;
+  if (!ds.pop(u) || !ds.pop(to) || !ds.pop(from)) {
+    return false;
+  }
+  const unsigned char *src = space.bytes(from.get(), u.get());
+  unsigned char *dst = space.bytes(to.get(), u.get());
+  if (!src || !dst) {
+    return false;
+  }
+
+  const size_t length = u.get();
+  const size_t period = dst - src;
+  if (dst <= src || period >= length) {
+    // Nothing is read after it's written, so it's a plain move
+    std::memmove(dst, src, length);
+    return true;
+  }
+
+  // Copying forward over an overlap repeats the first period bytes. Each
+  // copy reads only what's already been written, and doubles it.
+  size_t done = 0;
+  while (done < length) {
+    const size_t n = std::min(done + period, length - done);
+    std::memcpy(dst + done, src, n);
+    done += n;
+  }
+  return true;
+}
+
+bool Operation<OPCODE_COMPARE>::operator()(DataStack &ds, DataSpace &space) {
+  UCell address1, u1, address2, u2;
+  if (!ds.pop(u2) || !ds.pop(address2) || !ds.pop(u1) || !ds.pop(address1)) {
+    return false;
+  }
+  const unsigned char *s1 = space.bytes(address1.get(), u1.get());
+  const unsigned char *s2 = space.bytes(address2.get(), u2.get());
+  if (!s1 || !s2) {
+    return false;
+  }
+
+  int n = std::memcmp(s1, s2, std::min(u1.get(), u2.get()));
+  if (n == 0) {
+    n = u1.get() < u2.get() ? -1 : u1.get() > u2.get();
+  }
+  ds.push(SCell{n < 0 ? -1 : n > 0});
+  return true;
+}
+
+/*
+ * First occurrence of needle in haystack, or nullptr. With SSE2, 16
+ * candidate positions are filtered at a time by comparing their first and
+ * last bytes against the needle's, and only the survivors are compared in
+ * full.
+ */
+static const unsigned char *search(const unsigned char *haystack, size_t n,
+                                   const unsigned char *needle, size_t m) {
+  if (m == 0) {
+    return haystack;
+  }
+  if (m > n) {
+    return nullptr;
+  }
+
+  // Candidates are haystack[0..last]
+  const size_t last = n - m;
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i first = _mm_set1_epi8(static_cast<char>(needle[0]));
+  const __m128i final = _mm_set1_epi8(static_cast<char>(needle[m - 1]));
+  for (; i <= last && last - i >= 15; i += 16) {
+    const __m128i starts = _mm_loadu_si128(
+      reinterpret_cast<const __m128i *>(haystack + i));
+    const __m128i ends = _mm_loadu_si128(
+      reinterpret_cast<const __m128i *>(haystack + i + m - 1));
+    unsigned int mask = _mm_movemask_epi8(
+      _mm_and_si128(_mm_cmpeq_epi8(starts, first),
+                    _mm_cmpeq_epi8(ends, final)));
+    while (mask) {
+      const unsigned int k = __builtin_ctz(mask);
+      if (std::memcmp(haystack + i + k, needle, m) == 0) {
+        return haystack + i + k;
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  while (i <= last) {
+    const void *p = std::memchr(haystack + i, needle[0], last - i + 1);
+    if (!p) {
+      return nullptr;
+    }
+    i = static_cast<const unsigned char *>(p) - haystack;
+    if (std::memcmp(haystack + i, needle, m) == 0) {
+      return haystack + i;
+    }
+    i++;
+  }
+
+  return nullptr;
+}
+
+bool Operation<OPCODE_SEARCH>::operator()(DataStack &ds, DataSpace &space) {
+  UCell address1, u1, address2, u2;
+  if (!ds.pop(u2) || !ds.pop(address2) || !ds.pop(u1) || !ds.pop(address1)) {
+    return false;
+  }
+  const unsigned char *s1 = space.bytes(address1.get(), u1.get());
+  const unsigned char *s2 = space.bytes(address2.get(), u2.get());
+  if (!s1 || !s2) {
+    return false;
+  }
+
+  const unsigned char *found = search(s1, u1.get(), s2, u2.get());
+  if (!found) {
+    ds.push(address1);
+    ds.push(u1);
+    ds.push(SCell{0});
+    return true;
+  }
+  const UCell::type offset = static_cast<UCell::type>(found - s1);
+  ds.push(address1 + offset);
+  ds.push(u1 - offset);
+  ds.push(SCell{1});
+  return true;
+}
+
+// I/O results: 0 for success, anything else for failure
+static SCell ior(bool success) {
+  return SCell{success ? 0 : -1};
+}
+
+bool Operation<OPCODE_ALLOCATE>::operator()(DataStack &ds, Heap &heap) {
+  UCell u;
+  UCell::type address = 0;
+  if (!ds.pop(u)) {
+    return false;
+  }
+  const bool success = heap.allocate(u.get(), address);
+  ds.push(UCell{address});
+  ds.push(ior(success));
+  return true;
+}
+
+bool Operation<OPCODE_FREE>::operator()(DataStack &ds, Heap &heap) {
+  UCell address;
+  if (!ds.pop(address)) {
+    return false;
+  }
+  ds.push(ior(heap.free(address.get())));
+  return true;
+}
+
+bool Operation<OPCODE_RESIZE>::operator()(DataStack &ds, Heap &heap) {
+  UCell address, u;
+  if (!ds.pop(u) || !ds.pop(address)) {
+    return false;
+  }
+  UCell::type moved = address.get();
+  const bool success = heap.resize(address.get(), u.get(), moved);
+  ds.push(UCell{moved});
+  ds.push(ior(success));
+  return true;
+}
+
+bool Operation<OPCODE_REGION>::operator()(DataStack &ds, Heap &heap) {
+  UCell u;
+  UCell::type region = 0;
+  if (!ds.pop(u)) {
+    return false;
+  }
+  const bool success = heap.allocateRegion(u.get(), region);
+  ds.push(UCell{region});
+  ds.push(ior(success));
+  return true;
+}
+
+bool Operation<OPCODE_R_ALLOT>::operator()(DataStack &ds, Heap &heap) {
+  UCell region, u;
+  UCell::type address = 0;
+  if (!ds.pop(u) || !ds.pop(region)) {
+    return false;
+  }
+  const bool success = heap.regionAllocate(region.get(), u.get(), address);
+  ds.push(UCell{address});
+  ds.push(ior(success));
+  return true;
+}
 
+bool Operation<OPCODE_R_FREE_ALL>::operator()(DataStack &ds, Heap &heap) {
+  UCell region;
+  if (!ds.pop(region)) {
+    return false;
+  }
+  ds.push(ior(heap.releaseRegion(region.get())));
+  return true;
+}
+
+bool Operation<OPCODE_SAVE_IMAGE>::operator()(DataStack &ds,
+                                              VirtualMachine &vm) {
+  UCell address, u;
+  if (!ds.pop(u) || !ds.pop(address)) {
+    return false;
+  }
+  const unsigned char *name = vm.dataSpace().bytes(address.get(), u.get());
+  ds.push(ior(name && saveImage(vm, std::string(
+    reinterpret_cast<const char *>(name), u.get()))));
+  return true;
+}
+
+
+bool magicDivisor(SCell divisor, MagicDivisor &md) {
+  using Unsigned = UCell::type;
+
+  const SCell::type d = divisor.get();
+  if (d == 0 || d == 1 || d == -1) {
+    return false;
+  }
+
+  const Unsigned two = static_cast<Unsigned>(1) << (CELL_BITS - 1);
+  const Unsigned ad = d < 0 ? 0 - static_cast<Unsigned>(d)
+                            : static_cast<Unsigned>(d);
+  const Unsigned t = two + (static_cast<Unsigned>(d) >> (CELL_BITS - 1));
+  // |nc|, the largest dividend with remainder d - 1
+  const Unsigned anc = t - 1 - t % ad;
+
+  Unsigned p = CELL_BITS - 1;
+  Unsigned q1 = two / anc, r1 = two - q1 * anc;
+  Unsigned q2 = two / ad, r2 = two - q2 * ad;
+  Unsigned delta;
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  Unsigned magic = q2 + 1;
+  if (d < 0) {
+    magic = 0 - magic;
+  }
+
+  md.divisor = UCell{divisor};
+  md.magic = UCell{magic};
+  md.shift = UCell{p - CELL_BITS};
+
+  return true;
+}
+
+
+size_t operandCount(enum OpCode opcode) {
+  switch (opcode) {
+    case OPCODE_LITERAL:
+    case OPCODE_VALUE:
+    case OPCODE_CALL:
+    case OPCODE_CALL_GENERIC:
+    case OPCODE_DEFER:
+    case OPCODE_TO:
+    case OPCODE_IS:
+      return 1;
+    case OPCODE_EXECUTE_CACHED:
+      return 2;
+    case OPCODE_F_LITERAL:
+      return FLOAT_CELLS;
+    case OPCODE_SLASH_CONSTANT:
+    case OPCODE_MOD_CONSTANT:
+    case OPCODE_SLASH_MOD_CONSTANT:
+    case OPCODE_STAR_SLASH_MOD_CONSTANT:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+bool decode(const Code &code, size_t &i, Instruction &instruction) {
+  if (i >= code.size() || code[i].get() >= OPCODE_LAST) {
+    return false;
+  }
+
+  instruction.opcode = static_cast<enum OpCode>(code[i].get());
+  const size_t nOperands = operandCount(instruction.opcode);
+  if (code.size() - i - 1 < nOperands) {
+    return false;
+  }
+  for (size_t j = 0; j < nOperands; j++) {
+    instruction.operands[j] = code[i + 1 + j];
+  }
+  i += 1 + nOperands;
+
+  return true;
+}
+
+void encode(const Instruction &instruction, Code &code) {
+  code.push_back(instruction.opcode);
+  for (size_t j = 0; j < operandCount(instruction.opcode); j++) {
+    code.push_back(instruction.operands[j]);
+  }
+}
+
+bool dispatch(enum OpCode opcode, DataStack &ds) {
+  if (opcode >= OPCODE_LAST) {
+    return false;
+  }
+
+  switch (opcode) {
+    /* -- ARITHMETIC -------------------------------------------------------- */
+    /* - single-Cell                                                          */
+    case OPCODE_PLUS:
+      return Operation<OPCODE_PLUS>{}(ds);
+    case OPCODE_ONE_PLUS:
+      return Operation<OPCODE_ONE_PLUS>{}(ds);
+    case OPCODE_MINUS:
+      return Operation<OPCODE_MINUS>{}(ds);
+    case OPCODE_ONE_MINUS:
+      return Operation<OPCODE_ONE_MINUS>{}(ds);
+    case OPCODE_STAR:
+      return Operation<OPCODE_STAR>{}(ds);
+    case OPCODE_SLASH:
+      return Operation<OPCODE_SLASH>{}(ds);
+    case OPCODE_MOD:
+      return Operation<OPCODE_MOD>{}(ds);
+    case OPCODE_SLASH_MOD:
+      return Operation<OPCODE_SLASH_MOD>{}(ds);
+    case OPCODE_NEGATE:
+      return Operation<OPCODE_NEGATE>{}(ds);
+    case OPCODE_ABS:
+      return Operation<OPCODE_ABS>{}(ds);
+    case OPCODE_MIN:
+      return Operation<OPCODE_MIN>{}(ds);
+    case OPCODE_MAX:
+      return Operation<OPCODE_MAX>{}(ds);
+
+      /* - single-Cell bitwise                                                  */
+    case OPCODE_AND:
+      return Operation<OPCODE_AND>{}(ds);
+    case OPCODE_OR:
+      return Operation<OPCODE_OR>{}(ds);
+    case OPCODE_XOR:
+      return Operation<OPCODE_XOR>{}(ds);
+    case OPCODE_INVERT:
+      return Operation<OPCODE_INVERT>{}(ds);
+    case OPCODE_LSHIFT:
+      return Operation<OPCODE_LSHIFT>{}(ds);
+    case OPCODE_RSHIFT:
+      return Operation<OPCODE_RSHIFT>{}(ds);
+    case OPCODE_TWO_STAR:
+      return Operation<OPCODE_TWO_STAR>{}(ds);
+    case OPCODE_TWO_SLASH:
+      return Operation<OPCODE_TWO_SLASH>{}(ds);
+
+      /* - single-Cell comparison                                               */
+    case OPCODE_LESS_THAN:
+      return Operation<OPCODE_LESS_THAN>{}(ds);
+    case OPCODE_EQUALS:
+      return Operation<OPCODE_EQUALS>{}(ds);
+    case OPCODE_GREATER_THAN:
+      return Operation<OPCODE_GREATER_THAN>{}(ds);
+    case OPCODE_ZERO_LESS_THAN:
+      return Operation<OPCODE_ZERO_LESS_THAN>{}(ds);
+    case OPCODE_ZERO_EQUALS:
+      return Operation<OPCODE_ZERO_EQUALS>{}(ds);
+    case OPCODE_U_LESS_THAN:
+      return Operation<OPCODE_U_LESS_THAN>{}(ds);
+
+      /* - single-Cell arithmetic                                               */
+    case OPCODE_STAR_SLASH: // (n1*n2)/n3
+      return Operation<OPCODE_STAR_SLASH>{}(ds);
+    case OPCODE_STAR_SLASH_MOD: // n1*n2 = n3*n5 + n4
+      return Operation<OPCODE_STAR_SLASH_MOD>{}(ds);
+
+      /* - double-Cell arithmetic                                               */
+    case OPCODE_D_PLUS:
+      return Operation<OPCODE_D_PLUS>{}(ds);
+    case OPCODE_D_MINUS:
+      return Operation<OPCODE_D_MINUS>{}(ds);
+    case OPCODE_D_NEGATE:
+      return Operation<OPCODE_D_NEGATE>{}(ds);
+    case OPCODE_UM_STAR:
+      return Operation<OPCODE_UM_STAR>{}(ds);
+    case OPCODE_M_STAR:
+      return Operation<OPCODE_M_STAR>{}(ds);
+    case OPCODE_UM_SLASH_MOD:
+      return Operation<OPCODE_UM_SLASH_MOD>{}(ds);
+    case OPCODE_FM_SLASH_MOD:
+      return Operation<OPCODE_FM_SLASH_MOD>{}(ds);
+    case OPCODE_SM_SLASH_REM:
+      return Operation<OPCODE_SM_SLASH_REM>{}(ds);
+    case OPCODE_M_STAR_SLASH:
+      return Operation<OPCODE_M_STAR_SLASH>{}(ds);
+
+      /* - double-Cell comparison                                               */
+    case OPCODE_D_LESS_THAN:
+      return Operation<OPCODE_D_LESS_THAN>{}(ds);
+    case OPCODE_D_EQUALS:
+      return Operation<OPCODE_D_EQUALS>{}(ds);
+
+      /* - single-Cell division by a constant                                   */
+    case OPCODE_SLASH_CONSTANT:
+    case OPCODE_MOD_CONSTANT:
+    case OPCODE_SLASH_MOD_CONSTANT:
+    case OPCODE_STAR_SLASH_MOD_CONSTANT:
+      return false;
+
+
+      /* -- FLOATING POINT ---------------------------------------------------- */
+      // These need the float stack
+    case OPCODE_F_PLUS:
+    case OPCODE_F_MINUS:
+    case OPCODE_F_STAR:
+    case OPCODE_F_SLASH:
+    case OPCODE_F_STAR_PLUS:
+    case OPCODE_F_SQRT:
+    case OPCODE_F_LESS_THAN:
+    case OPCODE_S_TO_F:
+    case OPCODE_F_TO_S:
+    case OPCODE_F_LITERAL:
+      return false;
+
+
+      /* -- VECTOR ------------------------------------------------------------ */
+      // These need the vector stack
+    case OPCODE_V_PLUS:
+    case OPCODE_V_STAR:
+    case OPCODE_V_AND:
+    case OPCODE_V_MIN:
+    case OPCODE_V_MAX:
+    case OPCODE_V_SUM:
+    case OPCODE_V_LOAD:
+    case OPCODE_V_STORE:
+      return false;
+
+
+      /* -- MEMORY ------------------------------------------------------------ */
+      // These need the data space
+    case OPCODE_FETCH:
+    case OPCODE_STORE:
+    case OPCODE_C_FETCH:
+    case OPCODE_C_STORE:
+    case OPCODE_PLUS_STORE:
+    case OPCODE_F_FETCH:
+    case OPCODE_F_STORE:
+    case OPCODE_HERE:
+    case OPCODE_ALLOT:
+    case OPCODE_COMMA:
+    case OPCODE_C_COMMA:
+    case OPCODE_ALIGN:
+    case OPCODE_MOVE:
+    case OPCODE_FILL:
+    case OPCODE_ERASE:
+    case OPCODE_CMOVE:
+    case OPCODE_COMPARE:
+    case OPCODE_SEARCH:
+    case OPCODE_ALLOCATE:
+    case OPCODE_FREE:
+    case OPCODE_RESIZE:
+    case OPCODE_REGION:
+    case OPCODE_R_ALLOT:
+    case OPCODE_R_FREE_ALL:
+      return false;
+
+
+      /* -- SYSTEM ------------------------------------------------------------ */
+      // These need the whole VirtualMachine
+    case OPCODE_SAVE_IMAGE:
+      return false;
+    case OPCODE_CELLS:
+      return Operation<OPCODE_CELLS>{}(ds);
+
+
+      /* -- STACK MANIPULATION ------------------------------------------------ */
+    case OPCODE_DROP:
+      return Operation<OPCODE_DROP>{}(ds);
+    case OPCODE_DUP:
+      return Operation<OPCODE_DUP>{}(ds);
+    case OPCODE_OVER:
+      return Operation<OPCODE_OVER>{}(ds);
+    case OPCODE_SWAP:
+      return Operation<OPCODE_SWAP>{}(ds);
+    case OPCODE_ROT:
+      return Operation<OPCODE_ROT>{}(ds);
+    case OPCODE_QUESTION_DUP:
+      return Operation<OPCODE_QUESTION_DUP>{}(ds);
+    case OPCODE_TWO_DROP:
+      return Operation<OPCODE_TWO_DROP>{}(ds);
+    case OPCODE_TWO_DUP:
+      return Operation<OPCODE_TWO_DUP>{}(ds);
+    case OPCODE_TWO_OVER:
+      return Operation<OPCODE_TWO_OVER>{}(ds);
+    case OPCODE_TWO_SWAP:
+      return Operation<OPCODE_TWO_SWAP>{}(ds);
+
+
+      /* -- LITERALS ---------------------------------------------------------- */
+      // These carry operands, so they can't be dispatched on their own
+    case OPCODE_LITERAL:
+    case OPCODE_VALUE:
+
+      /* -- CONTROL ----------------------------------------------------------- */
+      // These need the rest of the VirtualMachine
+    case OPCODE_CALL:
+    case OPCODE_CALL_GENERIC:
+    case OPCODE_EXIT:
+    case OPCODE_EXECUTE:
+    case OPCODE_EXECUTE_CACHED:
+    case OPCODE_DEFER:
+    case OPCODE_TO:
+    case OPCODE_IS:
+    case OPCODE_LAST:
+      return false;
+
+    case OPCODE_NOOP:
+      break;
+  }
+
+  return true;
+}
+
+static MagicDivisor divisorOf(const Instruction &instruction) {
+  const UCell *operands = instruction.operands;
+  return MagicDivisor{operands[0], operands[1], operands[2]};
+}
+
+bool dispatch(const Instruction &instruction, DataStack &ds) {
+  switch (instruction.opcode) {
+    case OPCODE_SLASH_CONSTANT:
+      return Operation<OPCODE_SLASH_CONSTANT>{divisorOf(instruction)}(ds);
+    case OPCODE_MOD_CONSTANT:
+      return Operation<OPCODE_MOD_CONSTANT>{divisorOf(instruction)}(ds);
+    case OPCODE_SLASH_MOD_CONSTANT:
+      return Operation<OPCODE_SLASH_MOD_CONSTANT>{divisorOf(instruction)}(ds);
+    case OPCODE_STAR_SLASH_MOD_CONSTANT:
+      return Operation<OPCODE_STAR_SLASH_MOD_CONSTANT>{
+        divisorOf(instruction)}(ds);
+
+    case OPCODE_LITERAL:
+    case OPCODE_VALUE:
+      Operation<OPCODE_LITERAL>{instruction.operands[0]}(ds);
+      return true;
+
+    default:
+      return dispatch(instruction.opcode, ds);
+  }
+}
+
+bool evaluate(const Instruction &instruction, const UCell *in, UCell *out) {
+  switch (instruction.opcode) {
+    case OPCODE_PLUS:
+      Operation<OPCODE_PLUS>{}.evaluate(in, out);
+      return true;
+    case OPCODE_ONE_PLUS:
+      Operation<OPCODE_ONE_PLUS>{}.evaluate(in, out);
+      return true;
+    case OPCODE_MINUS:
+      Operation<OPCODE_MINUS>{}.evaluate(in, out);
+      return true;
+    case OPCODE_ONE_MINUS:
+      Operation<OPCODE_ONE_MINUS>{}.evaluate(in, out);
+      return true;
+    case OPCODE_STAR:
+      Operation<OPCODE_STAR>{}.evaluate(in, out);
+      return true;
+    case OPCODE_SLASH:
+      Operation<OPCODE_SLASH>{}.evaluate(in, out);
+      return true;
+    case OPCODE_MOD:
+      Operation<OPCODE_MOD>{}.evaluate(in, out);
+      return true;
+    case OPCODE_SLASH_MOD:
+      Operation<OPCODE_SLASH_MOD>{}.evaluate(in, out);
+      return true;
+    case OPCODE_NEGATE:
+      Operation<OPCODE_NEGATE>{}.evaluate(in, out);
+      return true;
+    case OPCODE_ABS:
+      Operation<OPCODE_ABS>{}.evaluate(in, out);
+      return true;
+    case OPCODE_MIN:
+      Operation<OPCODE_MIN>{}.evaluate(in, out);
+      return true;
+    case OPCODE_MAX:
+      Operation<OPCODE_MAX>{}.evaluate(in, out);
+      return true;
+    case OPCODE_AND:
+      Operation<OPCODE_AND>{}.evaluate(in, out);
+      return true;
+    case OPCODE_OR:
+      Operation<OPCODE_OR>{}.evaluate(in, out);
+      return true;
+    case OPCODE_XOR:
+      Operation<OPCODE_XOR>{}.evaluate(in, out);
+      return true;
+    case OPCODE_INVERT:
+      Operation<OPCODE_INVERT>{}.evaluate(in, out);
+      return true;
+    case OPCODE_LSHIFT:
+      Operation<OPCODE_LSHIFT>{}.evaluate(in, out);
+      return true;
+    case OPCODE_RSHIFT:
+      Operation<OPCODE_RSHIFT>{}.evaluate(in, out);
+      return true;
+    case OPCODE_TWO_STAR:
+      Operation<OPCODE_TWO_STAR>{}.evaluate(in, out);
+      return true;
+    case OPCODE_TWO_SLASH:
+      Operation<OPCODE_TWO_SLASH>{}.evaluate(in, out);
+      return true;
+    case OPCODE_LESS_THAN:
+      Operation<OPCODE_LESS_THAN>{}.evaluate(in, out);
+      return true;
+    case OPCODE_EQUALS:
+      Operation<OPCODE_EQUALS>{}.evaluate(in, out);
+      return true;
+    case OPCODE_GREATER_THAN:
+      Operation<OPCODE_GREATER_THAN>{}.evaluate(in, out);
+      return true;
+    case OPCODE_ZERO_LESS_THAN:
+      Operation<OPCODE_ZERO_LESS_THAN>{}.evaluate(in, out);
+      return true;
+    case OPCODE_ZERO_EQUALS:
+      Operation<OPCODE_ZERO_EQUALS>{}.evaluate(in, out);
+      return true;
+    case OPCODE_U_LESS_THAN:
+      Operation<OPCODE_U_LESS_THAN>{}.evaluate(in, out);
+      return true;
+    case OPCODE_STAR_SLASH:
+      Operation<OPCODE_STAR_SLASH>{}.evaluate(in, out);
+      return true;
+    case OPCODE_STAR_SLASH_MOD:
+      Operation<OPCODE_STAR_SLASH_MOD>{}.evaluate(in, out);
+      return true;
+    case OPCODE_D_PLUS:
+      Operation<OPCODE_D_PLUS>{}.evaluate(in, out);
+      return true;
+    case OPCODE_D_MINUS:
+      Operation<OPCODE_D_MINUS>{}.evaluate(in, out);
+      return true;
+    case OPCODE_D_NEGATE:
+      Operation<OPCODE_D_NEGATE>{}.evaluate(in, out);
+      return true;
+    case OPCODE_UM_STAR:
+      Operation<OPCODE_UM_STAR>{}.evaluate(in, out);
+      return true;
+    case OPCODE_M_STAR:
+      Operation<OPCODE_M_STAR>{}.evaluate(in, out);
+      return true;
+    case OPCODE_UM_SLASH_MOD:
+      Operation<OPCODE_UM_SLASH_MOD>{}.evaluate(in, out);
+      return true;
+    case OPCODE_FM_SLASH_MOD:
+      Operation<OPCODE_FM_SLASH_MOD>{}.evaluate(in, out);
+      return true;
+    case OPCODE_SM_SLASH_REM:
+      Operation<OPCODE_SM_SLASH_REM>{}.evaluate(in, out);
+      return true;
+    case OPCODE_M_STAR_SLASH:
+      Operation<OPCODE_M_STAR_SLASH>{}.evaluate(in, out);
+      return true;
+    case OPCODE_D_LESS_THAN:
+      Operation<OPCODE_D_LESS_THAN>{}.evaluate(in, out);
+      return true;
+    case OPCODE_D_EQUALS:
+      Operation<OPCODE_D_EQUALS>{}.evaluate(in, out);
+      return true;
+    case OPCODE_CELLS:
+      Operation<OPCODE_CELLS>{}.evaluate(in, out);
+      return true;
+    case OPCODE_SLASH_CONSTANT:
+      Operation<OPCODE_SLASH_CONSTANT>{divisorOf(instruction)}
+        .evaluate(in, out);
+      return true;
+    case OPCODE_MOD_CONSTANT:
+      Operation<OPCODE_MOD_CONSTANT>{divisorOf(instruction)}.evaluate(in, out);
+      return true;
+    case OPCODE_SLASH_MOD_CONSTANT:
+      Operation<OPCODE_SLASH_MOD_CONSTANT>{divisorOf(instruction)}
+        .evaluate(in, out);
+      return true;
+    case OPCODE_STAR_SLASH_MOD_CONSTANT:
+      Operation<OPCODE_STAR_SLASH_MOD_CONSTANT>{divisorOf(instruction)}
+        .evaluate(in, out);
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool dispatch(const Instruction &instruction, VirtualMachine &vm) {
+  DataStack &ds = vm.dataStack();
+  FStack &fs = vm.floatStack();
+  VStack &vs = vm.vectorStack();
+  DataSpace &space = vm.dataSpace();
+
+  switch (instruction.opcode) {
+    case OPCODE_F_PLUS:
+      return Operation<OPCODE_F_PLUS>{}(ds, fs);
+    case OPCODE_F_MINUS:
+      return Operation<OPCODE_F_MINUS>{}(ds, fs);
+    case OPCODE_F_STAR:
+      return Operation<OPCODE_F_STAR>{}(ds, fs);
+    case OPCODE_F_SLASH:
+      return Operation<OPCODE_F_SLASH>{}(ds, fs);
+    case OPCODE_F_STAR_PLUS:
+      return Operation<OPCODE_F_STAR_PLUS>{}(ds, fs);
+    case OPCODE_F_SQRT:
+      return Operation<OPCODE_F_SQRT>{}(ds, fs);
+    case OPCODE_F_LESS_THAN:
+      return Operation<OPCODE_F_LESS_THAN>{}(ds, fs);
+    case OPCODE_S_TO_F:
+      return Operation<OPCODE_S_TO_F>{}(ds, fs);
+    case OPCODE_F_TO_S:
+      return Operation<OPCODE_F_TO_S>{}(ds, fs);
+    case OPCODE_F_LITERAL:
+      Operation<OPCODE_F_LITERAL>{floatOf(instruction.operands)}(ds, fs);
+      return true;
+
+    case OPCODE_V_PLUS:
+      return Operation<OPCODE_V_PLUS>{}(ds, vs);
+    case OPCODE_V_STAR:
+      return Operation<OPCODE_V_STAR>{}(ds, vs);
+    case OPCODE_V_AND:
+      return Operation<OPCODE_V_AND>{}(ds, vs);
+    case OPCODE_V_MIN:
+      return Operation<OPCODE_V_MIN>{}(ds, vs);
+    case OPCODE_V_MAX:
+      return Operation<OPCODE_V_MAX>{}(ds, vs);
+    case OPCODE_V_SUM:
+      return Operation<OPCODE_V_SUM>{}(ds, vs);
+    case OPCODE_V_LOAD:
+      return Operation<OPCODE_V_LOAD>{}(ds, vs, space);
+    case OPCODE_V_STORE:
+      return Operation<OPCODE_V_STORE>{}(ds, vs, space);
+
+    case OPCODE_FETCH:
+      return Operation<OPCODE_FETCH>{}(ds, space);
+    case OPCODE_STORE:
+      return Operation<OPCODE_STORE>{}(ds, space);
+    case OPCODE_C_FETCH:
+      return Operation<OPCODE_C_FETCH>{}(ds, space);
+    case OPCODE_C_STORE:
+      return Operation<OPCODE_C_STORE>{}(ds, space);
+    case OPCODE_PLUS_STORE:
+      return Operation<OPCODE_PLUS_STORE>{}(ds, space);
+    case OPCODE_ALLOT:
+      return Operation<OPCODE_ALLOT>{}(ds, space);
+    case OPCODE_COMMA:
+      return Operation<OPCODE_COMMA>{}(ds, space);
+    case OPCODE_C_COMMA:
+      return Operation<OPCODE_C_COMMA>{}(ds, space);
+    case OPCODE_ALIGN:
+      return Operation<OPCODE_ALIGN>{}(ds, space);
+    case OPCODE_MOVE:
+      return Operation<OPCODE_MOVE>{}(ds, space);
+    case OPCODE_FILL:
+      return Operation<OPCODE_FILL>{}(ds, space);
+    case OPCODE_ERASE:
+      return Operation<OPCODE_ERASE>{}(ds, space);
+    case OPCODE_CMOVE:
+      return Operation<OPCODE_CMOVE>{}(ds, space);
+    case OPCODE_COMPARE:
+      return Operation<OPCODE_COMPARE>{}(ds, space);
+    case OPCODE_SEARCH:
+      return Operation<OPCODE_SEARCH>{}(ds, space);
+    case OPCODE_ALLOCATE:
+      return Operation<OPCODE_ALLOCATE>{}(ds, vm.heap());
+    case OPCODE_FREE:
+      return Operation<OPCODE_FREE>{}(ds, vm.heap());
+    case OPCODE_RESIZE:
+      return Operation<OPCODE_RESIZE>{}(ds, vm.heap());
+    case OPCODE_REGION:
+      return Operation<OPCODE_REGION>{}(ds, vm.heap());
+    case OPCODE_R_ALLOT:
+      return Operation<OPCODE_R_ALLOT>{}(ds, vm.heap());
+    case OPCODE_R_FREE_ALL:
+      return Operation<OPCODE_R_FREE_ALL>{}(ds, vm.heap());
+
+    case OPCODE_SAVE_IMAGE:
+      return Operation<OPCODE_SAVE_IMAGE>{}(ds, vm);
+    case OPCODE_F_FETCH:
+      return Operation<OPCODE_F_FETCH>{}(ds, fs, space);
+    case OPCODE_F_STORE:
+      return Operation<OPCODE_F_STORE>{}(ds, fs, space);
+    case OPCODE_HERE:
+      Operation<OPCODE_HERE>{}(ds, space);
+      return true;
+
+    default:
+      return dispatch(instruction, ds);
+  }
+}
@@ -0,0 +1,480 @@
+
+#include <algorithm>
+
+#include "compiler.hpp"
+#include "optimizer.hpp"
+
+
+static SCell::type signedValue(UCell cell) {
+  return SCell{cell}.get();
+}
+
+static bool isPowerOfTwo(UCell::type n) {
+  return n > 1 && (n & (n - 1)) == 0;
+}
+
+static UCell::type exponentOf(UCell::type n) {
+  UCell::type log = 0;
+  while (n >>= 1) {
+    log++;
+  }
+  return log;
+}
+
+/*
+ * Whether folding opcode over in would do something the Operation would
+ * only do at run time (trap on division, shift out of range).
+ */
+static bool safeToFold(enum OpCode opcode, const UCell *in) {
+  switch (opcode) {
+    case OPCODE_SLASH:
+    case OPCODE_MOD:
+    case OPCODE_SLASH_MOD:
+      return signedValue(in[1]) != 0 && signedValue(in[1]) != -1;
+    case OPCODE_STAR_SLASH:
+      return in[2].get() != 0;
+    case OPCODE_STAR_SLASH_MOD:
+      return signedValue(in[2]) != 0 && signedValue(in[2]) != -1;
+    case OPCODE_UM_SLASH_MOD:
+      return in[2].get() != 0;
+    case OPCODE_FM_SLASH_MOD:
+    case OPCODE_SM_SLASH_REM:
+      return signedValue(in[2]) != 0 && signedValue(in[2]) != -1;
+    case OPCODE_M_STAR_SLASH:
+      return in[3].get() != 0;
+    case OPCODE_LSHIFT:
+    case OPCODE_RSHIFT:
+      return in[1].get() < CELL_BITS;
+    default:
+      return true;
+  }
+}
+
+static bool isCommutative(enum OpCode opcode) {
+  switch (opcode) {
+    case OPCODE_PLUS:
+    case OPCODE_STAR:
+    case OPCODE_MIN:
+    case OPCODE_MAX:
+    case OPCODE_AND:
+    case OPCODE_OR:
+    case OPCODE_XOR:
+    case OPCODE_EQUALS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+
+/*
+ * How many cells of the caller's stack body reads before the first
+ * instruction whose stack effect isn't known statically.
+ */
+static size_t argumentCount(const Code &body) {
+  size_t depth = 0, arguments = 0;
+
+  for (size_t i = 0; i < body.size(); ) {
+    Instruction instruction;
+    StackEffect effect;
+    if (!decode(body, i, instruction)
+        || !stackEffect(instruction.opcode, effect)) {
+      break;
+    }
+    if (effect.inputs > depth) {
+      arguments += effect.inputs - depth;
+      depth = effect.inputs;
+    }
+    depth = depth - effect.inputs + effect.outputs;
+  }
+
+  return arguments;
+}
+
+static bool sameCode(const Code &a, const Code &b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++) {
+    if (a[i].get() != b[i].get()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+Optimizer::Optimizer(Dictionary *pDictionary, size_t inlineBudget,
+                     size_t specializeBudget)
+  : mypDictionary{pDictionary},
+  myInlineBudget{inlineBudget},
+  mySpecializeBudget{specializeBudget},
+  myInstructions{},
+  myInlining{}
+{
+}
+
+bool Optimizer::optimize(const Code &code, Code &optimized) {
+  myInstructions.clear();
+  myInlining.clear();
+
+  for (size_t i = 0; i < code.size(); ) {
+    Instruction instruction;
+    if (!decode(code, i, instruction)) {
+      return false;
+    }
+    emit(instruction);
+  }
+
+  optimized.clear();
+  for (const Instruction &instruction : myInstructions) {
+    // Every EXECUTE site gets an inline cache of its own
+    if (instruction.opcode == OPCODE_EXECUTE) {
+      encode(Instruction{OPCODE_EXECUTE_CACHED, {EMPTY_CACHE_ENTRY,
+                                                 EMPTY_CACHE_ENTRY}},
+             optimized);
+      continue;
+    }
+    encode(instruction, optimized);
+  }
+
+  return true;
+}
+
+void Optimizer::emit(const Instruction &instruction) {
+  // A cache copied in from another word was filled for that site only
+  if (instruction.opcode == OPCODE_EXECUTE_CACHED) {
+    emit(Instruction{OPCODE_EXECUTE, {}});
+    return;
+  }
+
+  if (inlineCall(instruction) || specializeCall(instruction)) {
+    return;
+  }
+
+  myInstructions.push_back(instruction);
+
+  if (!fold() && !simplify()) {
+    divideByConstant();
+  }
+}
+
+void Optimizer::replace(size_t n, std::initializer_list<Instruction> with) {
+  myInstructions.resize(myInstructions.size() - n);
+  for (const Instruction &instruction : with) {
+    emit(instruction);
+  }
+}
+
+bool Optimizer::tailIs(std::initializer_list<enum OpCode> opcodes) const {
+  if (myInstructions.size() < opcodes.size()) {
+    return false;
+  }
+
+  size_t i = myInstructions.size() - opcodes.size();
+  for (enum OpCode opcode : opcodes) {
+    if (myInstructions[i++].opcode != opcode) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool Optimizer::fold() {
+  const size_t size = myInstructions.size();
+  const Instruction last = myInstructions.back();
+
+  if (last.opcode == OPCODE_LITERAL) {
+    return false;
+  }
+
+  if (last.opcode == OPCODE_QUESTION_DUP) {
+    if (size < 2 || myInstructions[size - 2].opcode != OPCODE_LITERAL) {
+      return false;
+    }
+    Instruction literal = myInstructions[size - 2];
+    if (literal.operands[0]) {
+      replace(2, {literal, literal});
+    } else {
+      replace(2, {literal});
+    }
+    return true;
+  }
+
+  StackEffect effect;
+  if (!stackEffect(last.opcode, effect) || size < effect.inputs + 1) {
+    return false;
+  }
+
+  UCell in[6], out[6];
+  for (size_t i = 0; i < effect.inputs; i++) {
+    const Instruction &input = myInstructions[size - 1 - effect.inputs + i];
+    if (input.opcode != OPCODE_LITERAL) {
+      return false;
+    }
+    in[i] = input.operands[0];
+  }
+
+  if (effect.shuffle) {
+    for (size_t i = 0; i < effect.outputs; i++) {
+      out[i] = in[effect.shuffle[i]];
+    }
+  } else if (effect.outputs > 0) {
+    if (!safeToFold(last.opcode, in) || !evaluate(last, in, out)) {
+      return false;
+    }
+  }
+
+  myInstructions.resize(size - 1 - effect.inputs);
+  for (size_t i = 0; i < effect.outputs; i++) {
+    emit(Instruction{OPCODE_LITERAL, {out[i]}});
+  }
+
+  return true;
+}
+
+bool Optimizer::simplify() {
+  const size_t size = myInstructions.size();
+  const enum OpCode last = myInstructions.back().opcode;
+
+  /* - Stack manipulation that cancels out ---------------------------------- */
+  if (tailIs({OPCODE_SWAP, OPCODE_SWAP})
+      || tailIs({OPCODE_TWO_SWAP, OPCODE_TWO_SWAP})
+      || tailIs({OPCODE_DUP, OPCODE_DROP})
+      || tailIs({OPCODE_OVER, OPCODE_DROP})
+      || tailIs({OPCODE_TWO_DUP, OPCODE_TWO_DROP})
+      || tailIs({OPCODE_INVERT, OPCODE_INVERT})
+      || tailIs({OPCODE_NEGATE, OPCODE_NEGATE})) {
+    replace(2, {});
+    return true;
+  }
+  if (tailIs({OPCODE_ROT, OPCODE_ROT, OPCODE_ROT})) {
+    replace(3, {});
+    return true;
+  }
+  if (size >= 2 && myInstructions[size - 2].opcode == OPCODE_SWAP
+      && isCommutative(last)) {
+    replace(2, {{last, {}}});
+    return true;
+  }
+
+  /* - x x op --------------------------------------------------------------- */
+  if (tailIs({OPCODE_DUP, OPCODE_MINUS}) || tailIs({OPCODE_DUP, OPCODE_XOR})) {
+    replace(2, {{OPCODE_DROP, {}}, {OPCODE_LITERAL, {0}}});
+    return true;
+  }
+  if (tailIs({OPCODE_DUP, OPCODE_EQUALS})) {
+    replace(2, {{OPCODE_DROP, {}}, {OPCODE_LITERAL, {1}}});
+    return true;
+  }
+  if (tailIs({OPCODE_DUP, OPCODE_AND}) || tailIs({OPCODE_DUP, OPCODE_OR})
+      || tailIs({OPCODE_DUP, OPCODE_MIN}) || tailIs({OPCODE_DUP, OPCODE_MAX})) {
+    replace(2, {});
+    return true;
+  }
+
+  /* - x n op --------------------------------------------------------------- */
+  if (size < 2 || myInstructions[size - 2].opcode != OPCODE_LITERAL) {
+    return false;
+  }
+  const UCell n = myInstructions[size - 2].operands[0];
+
+  switch (last) {
+    case OPCODE_PLUS:
+    case OPCODE_MINUS:
+    case OPCODE_OR:
+    case OPCODE_XOR:
+    case OPCODE_LSHIFT:
+    case OPCODE_RSHIFT:
+      if (n.get() == 0) {
+        replace(2, {});
+        return true;
+      }
+      return false;
+
+    case OPCODE_AND:
+      if (signedValue(n) == -1) {
+        replace(2, {});
+        return true;
+      }
+      if (n.get() == 0) {
+        replace(2, {{OPCODE_DROP, {}}, {OPCODE_LITERAL, {0}}});
+        return true;
+      }
+      return false;
+
+    case OPCODE_STAR:
+      if (n.get() == 1) {
+        replace(2, {});
+        return true;
+      }
+      if (n.get() == 0) {
+        replace(2, {{OPCODE_DROP, {}}, {OPCODE_LITERAL, {0}}});
+        return true;
+      }
+      if (isPowerOfTwo(n.get())) {
+        replace(2, {{OPCODE_LITERAL, {exponentOf(n.get())}},
+                    {OPCODE_LSHIFT, {}}});
+        return true;
+      }
+      return false;
+
+    case OPCODE_SLASH:
+      if (n.get() == 1) {
+        replace(2, {});
+        return true;
+      }
+      return false;
+
+    case OPCODE_MOD:
+      if (n.get() == 1) {
+        replace(2, {{OPCODE_DROP, {}}, {OPCODE_LITERAL, {0}}});
+        return true;
+      }
+      return false;
+
+    case OPCODE_EXECUTE:
+      if (mypDictionary && mypDictionary->isWord(n.get())) {
+        replace(2, {{OPCODE_CALL, {n}}});
+        return true;
+      }
+      return false;
+
+    default:
+      return false;
+  }
+}
+
+bool Optimizer::divideByConstant() {
+  const size_t size = myInstructions.size();
+  if (size < 2 || myInstructions[size - 2].opcode != OPCODE_LITERAL) {
+    return false;
+  }
+
+  enum OpCode opcode;
+  switch (myInstructions.back().opcode) {
+    case OPCODE_SLASH:
+      opcode = OPCODE_SLASH_CONSTANT;
+      break;
+    case OPCODE_MOD:
+      opcode = OPCODE_MOD_CONSTANT;
+      break;
+    case OPCODE_SLASH_MOD:
+      opcode = OPCODE_SLASH_MOD_CONSTANT;
+      break;
+    case OPCODE_STAR_SLASH_MOD:
+      opcode = OPCODE_STAR_SLASH_MOD_CONSTANT;
+      break;
+    default:
+      return false;
+  }
+
+  MagicDivisor md;
+  if (!magicDivisor(SCell{myInstructions[size - 2].operands[0]}, md)) {
+    return false;
+  }
+
+  replace(2, {{opcode, {md.divisor, md.magic, md.shift}}});
+  return true;
+}
+
+bool Optimizer::inlineCall(const Instruction &instruction) {
+  if (instruction.opcode != OPCODE_CALL || !mypDictionary) {
+    return false;
+  }
+
+  const size_t xt = instruction.operands[0].get();
+  Code body;
+  if (!mypDictionary->body(xt, body) || body.size() > myInlineBudget
+      || std::find(myInlining.begin(), myInlining.end(), xt)
+         != myInlining.end()) {
+    return false;
+  }
+
+  std::vector<Instruction> instructions;
+  for (size_t i = 0; i < body.size(); ) {
+    Instruction inlined;
+    if (!decode(body, i, inlined)) {
+      return false;
+    }
+    // An early EXIT returns from the word itself, which it wouldn't once
+    // the word is inlined into its caller
+    if (inlined.opcode == OPCODE_EXIT) {
+      return false;
+    }
+    // VALUE and deferred words are their own storage, and TO and IS have to
+    // keep finding it
+    if (inlined.opcode == OPCODE_VALUE || inlined.opcode == OPCODE_DEFER) {
+      return false;
+    }
+    instructions.push_back(inlined);
+  }
+
+  myInlining.push_back(xt);
+  for (const Instruction &inlined : instructions) {
+    emit(inlined);
+  }
+  myInlining.pop_back();
+
+  return true;
+}
+
+bool Optimizer::specializeCall(const Instruction &instruction) {
+  if (instruction.opcode != OPCODE_CALL || !mypDictionary) {
+    return false;
+  }
+
+  const size_t xt = instruction.operands[0].get();
+  Code body;
+  if (!mypDictionary->body(xt, body) || body.size() > mySpecializeBudget) {
+    return false;
+  }
+
+  const size_t size = myInstructions.size();
+  const size_t wanted = argumentCount(body);
+  size_t count = 0;
+  while (count < wanted && count < size
+         && myInstructions[size - 1 - count].opcode == OPCODE_LITERAL) {
+    count++;
+  }
+  if (count == 0) {
+    return false;
+  }
+
+  Code arguments;
+  for (size_t i = size - count; i < size; i++) {
+    arguments.push_back(myInstructions[i].operands[0]);
+  }
+
+  size_t clone;
+  if (!mypDictionary->findSpecialization(xt, arguments, clone)) {
+    Code code;
+    for (const UCell &argument : arguments) {
+      code.push_back(OPCODE_LITERAL);
+      code.push_back(argument);
+    }
+    code.insert(code.end(), body.begin(), body.end());
+
+    // Clones don't specialize the calls in them, so this always terminates
+    Optimizer optimizer{mypDictionary, myInlineBudget};
+    Code specialized;
+    if (!optimizer.optimize(code, specialized)) {
+      return false;
+    }
+
+    // Nothing folded: remember that, and keep calling the original
+    clone = sameCode(code, specialized)
+      ? xt
+      : mypDictionary->define("", specialized);
+    mypDictionary->addSpecialization(xt, arguments, clone);
+  }
+
+  if (clone == xt) {
+    return false;
+  }
+
+  replace(count, {{OPCODE_CALL, {UCell{static_cast<UCell::type>(clone)}}}});
+
+  return true;
+}
@@ -0,0 +1,49 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "image.hpp"
+#include "interpreter.hpp"
+
+/*
+ * The stage-1 build of bbforth: interprets Forth source into a fresh
+ * machine and saves the result as an image, for the build to link into
+ * bbforth itself.
+ */
+
+static int usage(const char *program) {
+  std::fprintf(stderr, "usage: %s IMAGE SOURCE...\n", program);
+  return 2;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    return usage(argv[0]);
+  }
+
+  VirtualMachine vm;
+  Interpreter interpreter{vm};
+
+  for (int i = 2; i < argc; i++) {
+    std::ifstream file{argv[i]};
+    if (!file) {
+      std::fprintf(stderr, "%s: can't read %s\n", argv[0], argv[i]);
+      return 1;
+    }
+    std::stringstream source;
+    source << file.rdbuf();
+    if (!interpreter.interpret(source.str())) {
+      std::fprintf(stderr, "%s: %s: can't interpret %s\n", argv[0], argv[i],
+                   interpreter.error().c_str());
+      return 1;
+    }
+  }
+
+  if (!saveImage(vm, argv[1])) {
+    std::fprintf(stderr, "%s: can't save image %s\n", argv[0], argv[1]);
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,86 @@
+
+#include <csignal>
+#include <cstring>
+#include <mutex>
+
+#include "time_slice.hpp"
+
+
+static_assert(ATOMIC_BOOL_LOCK_FREE == 2,
+              "the flag has to be safe to set from a signal handler");
+
+/*
+ * Only a slice's timer attaches a flag. Any other SIGALRM, from kill() or
+ * alarm(), carries no address and is ignored.
+ */
+static void expire(int, siginfo_t *info, void *) {
+  if (info->si_code != SI_TIMER || info->si_value.sival_ptr == nullptr) {
+    return;
+  }
+  static_cast<std::atomic<bool> *>(info->si_value.sival_ptr)->store(
+    true, std::memory_order_relaxed);
+}
+
+static bool installHandler() {
+  static std::once_flag once;
+  static bool installed = false;
+  std::call_once(once, [] {
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_sigaction = expire;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    installed = sigaction(SIGALRM, &action, nullptr) == 0;
+  });
+
+  return installed;
+}
+
+
+TimeSlice::TimeSlice()
+  : myExpired{false},
+  myTimer{},
+  myCreated{false}
+{
+}
+
+TimeSlice::~TimeSlice() {
+  // Deleting the timer drops a signal of its that's still pending, so the
+  // handler never sees a dead flag
+  if (myCreated) {
+    timer_delete(myTimer);
+  }
+}
+
+bool TimeSlice::start(size_t microseconds) {
+  if (!myCreated) {
+    struct sigevent event;
+    std::memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_SIGNAL;
+    event.sigev_signo = SIGALRM;
+    event.sigev_value.sival_ptr = &myExpired;
+    if (!installHandler()
+        || timer_create(CLOCK_MONOTONIC, &event, &myTimer) != 0) {
+      return false;
+    }
+    myCreated = true;
+  }
+
+  myExpired.store(false, std::memory_order_relaxed);
+  // A zero it_value would disarm the timer instead of firing at once
+  const size_t us = microseconds > 0 ? microseconds : 1;
+  struct itimerspec slice;
+  std::memset(&slice, 0, sizeof(slice));
+  slice.it_value.tv_sec = us / 1000000;
+  slice.it_value.tv_nsec = (us % 1000000) * 1000;
+
+  return timer_settime(myTimer, 0, &slice, nullptr) == 0;
+}
+
+void TimeSlice::stop() {
+  if (myCreated) {
+    struct itimerspec off;
+    std::memset(&off, 0, sizeof(off));
+    timer_settime(myTimer, 0, &off, nullptr);
+  }
+}
@@ -1,19 +1,149 @@
+#include <new>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dictionary.hpp"
+#include "heap.hpp"
 #include "operation.hpp"
+#include "optimizer.hpp"
+
+// Return address that ends execute()
+static const size_t HALT = static_cast<UCell::type>(-1);
+
+
+static void unmap(unsigned char *memory, size_t size) {
+  munmap(memory, size);
+}
+
+// A private read-write mapping of size bytes of fd at offset, or of zeroes
+// if fd is -1
+static unsigned char *mapPrivate(size_t size, int fd, size_t offset) {
+  void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_PRIVATE, fd,
+                      static_cast<off_t>(offset));
+  if (memory == MAP_FAILED) {
+    throw std::bad_alloc{};
+  }
 
+  return static_cast<unsigned char *>(memory);
+}
 
 
-Stack::Stack(size_t size)
-  : myStackSize{size},
-  mypStack{new UCell[size]},
-  myStackEmpty{false},
-  myiTop{0}
+DataSpace::DataSpace(size_t size)
+  : mySize{size},
+  mypSpace{mapPrivate(size, -1, 0), Deleter{unmap, size}},
+  myHere{0},
+  myLimit{size},
+  mySnapshot{-1, 0, size, 0},
+  myMapped{true},
+  myChanged{false}
 {
 }
 
+DataSpace::~DataSpace() {
+  if (mySnapshot.fd >= 0) {
+    close(mySnapshot.fd);
+  }
+}
+
+void DataSpace::adopt(unsigned char *memory, size_t size, size_t here,
+                      void (*destroy)(unsigned char *, size_t)) {
+  mypSpace = std::unique_ptr<unsigned char, Deleter>{
+    memory, Deleter{destroy, size}};
+  mySize = size;
+  myHere = here;
+  myLimit = size;
+  myMapped = false;
+}
+
+void DataSpace::adopt(unsigned char *memory, size_t size, size_t here,
+                      void (*destroy)(unsigned char *, size_t), int fd,
+                      size_t offset) {
+  const int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  adopt(memory, size, here, destroy);
+  if (copy < 0) {
+    // Without a file of its own it's snapshotted like any other memory
+    return;
+  }
+
+  if (mySnapshot.fd >= 0) {
+    close(mySnapshot.fd);
+  }
+  mySnapshot = Snapshot{copy, offset, size, here};
+  myMapped = true;
+  myChanged = false;
+}
+
+void DataSpace::snapshot() {
+  if (myMapped && !myChanged && myHere == mySnapshot.here) {
+    return;
+  }
+
+  const int fd = memfd_create("bbforth-data", MFD_CLOEXEC);
+  bool written = fd >= 0 && ftruncate(fd, mySize) == 0;
+  for (size_t n = 0; written && n < myHere; ) {
+    const ssize_t w = pwrite(fd, mypSpace.get() + n, myHere - n, n);
+    written = w > 0;
+    n += written ? w : 0;
+  }
+  if (!written) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    throw std::bad_alloc{};
+  }
+
+  if (mySnapshot.fd >= 0) {
+    close(mySnapshot.fd);
+  }
+  mySnapshot = Snapshot{fd, 0, mySize, myHere};
+  // The memory is left as it is, heap included, until the first rewind()
+  // swaps it for a mapping of the snapshot
+  myMapped = false;
+}
+
+/*
+ * Dropping the pages of a private mapping puts back the ones it was mapped
+ * from. Memory that isn't a mapping of the snapshot is replaced with one.
+ */
+void DataSpace::rewind() {
+  if (!myMapped
+      || madvise(mypSpace.get(), mySize, MADV_DONTNEED) != 0) {
+    mapSnapshot();
+  }
+  myHere = mySnapshot.here;
+  myLimit = mySize;
+  myChanged = false;
+}
+
+void DataSpace::mapSnapshot() {
+  unsigned char *memory = mapPrivate(mySnapshot.size, mySnapshot.fd,
+                                     mySnapshot.offset);
+  mypSpace = std::unique_ptr<unsigned char, Deleter>{
+    memory, Deleter{unmap, mySnapshot.size}};
+  mySize = mySnapshot.size;
+  myMapped = true;
+  myChanged = false;
+}
+
+
 VirtualMachine::VirtualMachine()
   : myDataStack{},
-  myInstructionStack{}
+  myFloatStack{},
+  myVectorStack{},
+  myDataSpace{},
+  mypHeap{new Heap{myDataSpace}},
+  myInstructionStack{},
+  mypDictionary{new Dictionary{}},
+  mypBootDictionary{new Dictionary{}},
+  myIp{HALT},
+  myFuel{0},
+  mypPreempt{nullptr},
+  myPausedIp{HALT},
+  myInlineBudget{INLINE_BUDGET_DEFAULT_SIZE},
+  mySpecializeBudget{SPECIALIZE_BUDGET_DEFAULT_SIZE}
 {
 }
 
@@ -21,141 +151,321 @@ VirtualMachine::~VirtualMachine() {
 }
 
 bool VirtualMachine::runOnce() {
-  UCell op;
-  myInstructionStack.pop(op);
-
-  switch (static_cast<enum OpCode>(op.get())) {
-    /* -- ARITHMETIC -------------------------------------------------------- */
-    /* - single-Cell                                                          */
-    case OPCODE_PLUS:
-      Operation<OPCODE_PLUS>{}(myDataStack);
-      break;
-    case OPCODE_ONE_PLUS:
-      Operation<OPCODE_ONE_PLUS>{}(myDataStack);
-      break;
-    case OPCODE_MINUS:
-      Operation<OPCODE_MINUS>{}(myDataStack);
-      break;
-    case OPCODE_ONE_MINUS:
-      Operation<OPCODE_ONE_MINUS>{}(myDataStack);
-      break;
-    case OPCODE_STAR:
-      Operation<OPCODE_STAR>{}(myDataStack);
-      break;
-    case OPCODE_SLASH:
-      Operation<OPCODE_SLASH>{}(myDataStack);
-      break;
-    case OPCODE_MOD:
-      Operation<OPCODE_MOD>{}(myDataStack);
-      break;
-    case OPCODE_SLASH_MOD:
-      Operation<OPCODE_SLASH_MOD>{}(myDataStack);
-      break;
-    case OPCODE_NEGATE:
-      Operation<OPCODE_NEGATE>{}(myDataStack);
-      break;
-    case OPCODE_ABS:
-      Operation<OPCODE_ABS>{}(myDataStack);
-      break;
-    case OPCODE_MIN:
-      Operation<OPCODE_MIN>{}(myDataStack);
-      break;
-    case OPCODE_MAX:
-      Operation<OPCODE_MAX>{}(myDataStack);
-      break;
-
-      /* - single-Cell bitwise                                                  */
-    case OPCODE_AND:
-      Operation<OPCODE_AND>{}(myDataStack);
-      break;
-    case OPCODE_OR:
-      Operation<OPCODE_OR>{}(myDataStack);
-      break;
-    case OPCODE_XOR:
-      Operation<OPCODE_XOR>{}(myDataStack);
-      break;
-    case OPCODE_INVERT:
-      Operation<OPCODE_INVERT>{}(myDataStack);
-      break;
-    case OPCODE_LSHIFT:
-      Operation<OPCODE_LSHIFT>{}(myDataStack);
-      break;
-    case OPCODE_RSHIFT:
-      Operation<OPCODE_RSHIFT>{}(myDataStack);
-      break;
-    case OPCODE_TWO_STAR:
-      Operation<OPCODE_TWO_STAR>{}(myDataStack);
-      break;
-    case OPCODE_TWO_SLASH:
-      Operation<OPCODE_TWO_SLASH>{}(myDataStack);
-      break;
-
-      /* - single-Cell comparison                                               */
-    case OPCODE_LESS_THAN:
-      Operation<OPCODE_LESS_THAN>{}(myDataStack);
-      break;
-    case OPCODE_EQUALS:
-      Operation<OPCODE_EQUALS>{}(myDataStack);
-      break;
-    case OPCODE_GREATER_THAN:
-      Operation<OPCODE_GREATER_THAN>{}(myDataStack);
-      break;
-    case OPCODE_ZERO_LESS_THAN:
-      Operation<OPCODE_ZERO_LESS_THAN>{}(myDataStack);
-      break;
-    case OPCODE_ZERO_EQUALS:
-      Operation<OPCODE_ZERO_EQUALS>{}(myDataStack);
-      break;
-    case OPCODE_U_LESS_THAN:
-      Operation<OPCODE_U_LESS_THAN>{}(myDataStack);
-      break;
-
-      /* - single-Cell arithmetic                                               */
-    case OPCODE_STAR_SLASH: // (n1*n2)/n3
-      Operation<OPCODE_STAR_SLASH>{}(myDataStack);
-      break;
-    case OPCODE_STAR_SLASH_MOD: // n1*n2 = n3*n5 + n4
-      Operation<OPCODE_STAR_SLASH_MOD>{}(myDataStack);
-      break;
-
-
-      /* -- STACK MANIPULATION ------------------------------------------------ */
-    case OPCODE_DROP:
-      Operation<OPCODE_DROP>{}(myDataStack);
-      break;
-    case OPCODE_DUP:
-      Operation<OPCODE_DUP>{}(myDataStack);
-      break;
-    case OPCODE_OVER:
-      Operation<OPCODE_OVER>{}(myDataStack);
-      break;
-    case OPCODE_SWAP:
-      Operation<OPCODE_SWAP>{}(myDataStack);
-      break;
-    case OPCODE_ROT:
-      Operation<OPCODE_ROT>{}(myDataStack);
-      break;
-    case OPCODE_QUESTION_DUP:
-      Operation<OPCODE_QUESTION_DUP>{}(myDataStack);
-      break;
-    case OPCODE_TWO_DROP:
-      Operation<OPCODE_TWO_DROP>{}(myDataStack);
-      break;
-    case OPCODE_TWO_DUP:
-      Operation<OPCODE_TWO_DUP>{}(myDataStack);
-      break;
-    case OPCODE_TWO_OVER:
-      Operation<OPCODE_TWO_OVER>{}(myDataStack);
-      break;
-    case OPCODE_TWO_SWAP:
-      Operation<OPCODE_TWO_SWAP>{}(myDataStack);
-      break;
-
-
-
-    case OPCODE_LAST:
-      break;
+  return step<SAFEPOINT_NONE>();
+}
+
+/*
+ * Run one instruction. Calls are the safepoints where a run can be
+ * stopped early, so that's the only place a step checks anything.
+ */
+template<enum VirtualMachine::Safepoint safepoint>
+bool VirtualMachine::step() {
+  const size_t site = myIp;
+  Instruction instruction;
+  if (!decode(mypDictionary->code(), myIp, instruction)) {
+    return false;
   }
 
+  switch (instruction.opcode) {
+    case OPCODE_CALL:
+      return call<safepoint>(instruction.operands[0].get());
+
+    case OPCODE_CALL_GENERIC:
+      if (quicken(site, instruction)) {
+        // Run the final form instead
+        myIp = site;
+        return true;
+      }
+      return call<safepoint>(instruction.operands[0].get());
+
+    case OPCODE_EXECUTE: {
+      UCell xt;
+      if (!myDataStack.pop(xt) || !mypDictionary->isWord(xt.get())) {
+        return false;
+      }
+      return call<safepoint>(xt.get());
+    }
+
+    case OPCODE_EXECUTE_CACHED: {
+      UCell xt;
+      if (!myDataStack.pop(xt)) {
+        return false;
+      }
+      return executeCached<safepoint>(site, instruction, xt.get());
+    }
+
+    case OPCODE_DEFER:
+      // The deferred word's own EXIT is never reached: the target returns
+      // straight to its caller
+      myIp = instruction.operands[0].get();
+      poll<safepoint>();
+      return true;
+
+    case OPCODE_TO:
+    case OPCODE_IS: {
+      UCell value;
+      if (!myDataStack.pop(value)) {
+        return false;
+      }
+      const enum OpCode kind = instruction.opcode == OPCODE_TO
+        ? OPCODE_VALUE
+        : OPCODE_DEFER;
+      return mypDictionary->update(instruction.operands[0].get(), kind, value);
+    }
+
+    case OPCODE_EXIT: {
+      UCell ip;
+      if (!myInstructionStack.pop(ip)) {
+        return false;
+      }
+      myIp = ip.get();
+      return true;
+    }
+
+    default:
+      return dispatch(instruction, *this);
+  }
+}
+
+/*
+ * A leaf the optimizing tier compiled runs to its end in registers and
+ * returns at once, unless the safepoint stopped the run on the way in; it's
+ * interpreted from there when the run carries on.
+ */
+template<enum VirtualMachine::Safepoint safepoint>
+bool VirtualMachine::call(size_t xt) {
+  if (!myInstructionStack.push(UCell{static_cast<UCell::type>(myIp)})) {
+    return false;
+  }
+  myIp = xt;
+  poll<safepoint>();
+
+  const CompiledCode *compiled = mypDictionary->compiled(xt);
+  if (compiled && myIp == xt) {
+    UCell ip;
+    if (!myInstructionStack.pop(ip)) {
+      return false;
+    }
+    myIp = ip.get();
+    return (*compiled)(*this);
+  }
+
+  return true;
+}
+
+/*
+ * At a call that has just been made: spend a unit of fuel, or check the
+ * preemption flag. To stop, the run loop is ended by the check it makes on
+ * every instruction anyway: myIp is parked in myPausedIp and replaced with
+ * HALT.
+ */
+template<enum VirtualMachine::Safepoint safepoint>
+void VirtualMachine::poll() {
+  const bool stop = (safepoint == SAFEPOINT_FUEL && --myFuel == 0)
+    || (safepoint == SAFEPOINT_FLAG
+        && mypPreempt->load(std::memory_order_relaxed));
+  if (stop) {
+    myPausedIp = myIp;
+    myIp = HALT;
+  }
+}
+
+/*
+ * Run until the machine stops, or a safepoint stops it. On an error the
+ * machine stops.
+ */
+template<enum VirtualMachine::Safepoint safepoint>
+bool VirtualMachine::loop() {
+  while (myIp != HALT) {
+    if (!step<safepoint>()) {
+      return false;
+    }
+  }
+
+  if (safepoint != SAFEPOINT_NONE && myPausedIp != HALT) {
+    myIp = myPausedIp;
+    myPausedIp = HALT;
+  }
+
+  return true;
+}
+
+/*
+ * Cached xts were words when they went in, and forgetting them empties the
+ * cache, so a hit skips the dictionary lookup. A miss fills an empty entry;
+ * with both full the site is megamorphic and stays as it is.
+ */
+template<enum VirtualMachine::Safepoint safepoint>
+bool VirtualMachine::executeCached(size_t site, const Instruction &instruction,
+                                   size_t xt) {
+  const UCell *entries = instruction.operands;
+  if ((xt == entries[0].get() || xt == entries[1].get())
+      && xt != EMPTY_CACHE_ENTRY) {
+    return call<safepoint>(xt);
+  }
+
+  if (!mypDictionary->isWord(xt)) {
+    return false;
+  }
+
+  const UCell cached{static_cast<UCell::type>(xt)};
+  if (entries[0].get() == EMPTY_CACHE_ENTRY) {
+    mypDictionary->quicken(site, xt, Code{OPCODE_EXECUTE_CACHED, cached,
+                                          entries[1]});
+  } else if (entries[1].get() == EMPTY_CACHE_ENTRY) {
+    mypDictionary->quicken(site, xt, Code{OPCODE_EXECUTE_CACHED, entries[0],
+                                          cached});
+  }
+
+  return call<safepoint>(xt);
+}
+
+/*
+ * Rewrite a generic call at site into its final form, against the VALUE or
+ * deferred word it calls. myIp is just past the call. A deferred word's
+ * target is called directly, whatever it is, so that quickening always
+ * ends even when deferred words jump to each other.
+ */
+bool VirtualMachine::quicken(size_t site, const Instruction &instruction) {
+  const Code &code = mypDictionary->code();
+  const bool executeNext = myIp < code.size()
+    && code[myIp].get() == OPCODE_EXECUTE;
+  const size_t xt = instruction.operands[0].get();
+  size_t i = xt;
+  Instruction target;
+  if (!decode(code, i, target)) {
+    return false;
+  }
+
+  if (target.opcode == OPCODE_VALUE) {
+    // EXECUTE of the value
+    if (executeNext && mypDictionary->isWord(target.operands[0].get())) {
+      return mypDictionary->quicken(site, xt, Code{OPCODE_CALL,
+                                                   target.operands[0],
+                                                   OPCODE_NOOP});
+    }
+    return mypDictionary->quicken(site, xt, Code{OPCODE_LITERAL,
+                                                 target.operands[0]});
+  }
+  if (target.opcode == OPCODE_DEFER) {
+    return mypDictionary->quicken(site, xt, Code{OPCODE_CALL,
+                                                 target.operands[0]});
+  }
+
+  return false;
+}
+
+bool VirtualMachine::execute(const Code &code) {
+  const size_t xt = mypDictionary->define("", code);
+  const bool ok = execute(xt);
+  mypDictionary->forget(xt);
+
+  return ok;
+}
+
+bool VirtualMachine::execute(size_t xt) {
+  const CompiledCode *compiled = mypDictionary->compiled(xt);
+  if (compiled) {
+    return (*compiled)(*this);
+  }
+
+  const size_t ip = myIp;
+  const size_t depth = myInstructionStack.depth();
+
+  if (!myInstructionStack.push(UCell{static_cast<UCell::type>(HALT)})) {
+    return false;
+  }
+
+  myIp = xt;
+  const bool ok = loop<SAFEPOINT_NONE>();
+  myIp = ip;
+  if (!ok) {
+    // The HALT and the frames of the calls that failed are still there
+    myInstructionStack.truncate(depth);
+  }
+
+  return ok;
+}
+
+bool VirtualMachine::start(size_t xt) {
+  // Returning from xt pops the HALT that's in myIp now. Even a leaf is
+  // entered without running, so it's interpreted.
+  if (running()
+      || !myInstructionStack.push(UCell{static_cast<UCell::type>(myIp)})) {
+    return false;
+  }
+  myIp = xt;
+
+  return true;
+}
+
+bool VirtualMachine::run() {
+  if (!loop<SAFEPOINT_NONE>()) {
+    myIp = HALT;
+    return false;
+  }
+
+  return true;
+}
+
+bool VirtualMachine::run(size_t &fuel) {
+  if (fuel == 0) {
+    return true;
+  }
+
+  myFuel = fuel;
+  const bool ok = loop<SAFEPOINT_FUEL>();
+  fuel = myFuel;
+  if (!ok) {
+    myIp = HALT;
+    myPausedIp = HALT;
+  }
+
+  return ok;
+}
+
+bool VirtualMachine::run(const std::atomic<bool> &preempt) {
+  mypPreempt = &preempt;
+  const bool ok = loop<SAFEPOINT_FLAG>();
+  mypPreempt = nullptr;
+  if (!ok) {
+    myIp = HALT;
+    myPausedIp = HALT;
+  }
+
+  return ok;
+}
+
+bool VirtualMachine::running() const {
+  return myIp != HALT;
+}
+
+void VirtualMachine::markBooted() {
+  mypBootDictionary->restore(*mypDictionary);
+  myDataSpace.snapshot();
+}
+
+void VirtualMachine::reset() {
+  myDataStack.clear();
+  myFloatStack.clear();
+  myVectorStack.clear();
+  myInstructionStack.clear();
+  myIp = HALT;
+  mypHeap->clear();
+  myDataSpace.rewind();
+  mypDictionary->restore(*mypBootDictionary);
+}
+
+bool VirtualMachine::define(const std::string &name, const Code &body,
+                            size_t &xt) {
+  Optimizer optimizer{mypDictionary.get(), myInlineBudget,
+                      mySpecializeBudget};
+  Code optimized;
+  if (!optimizer.optimize(body, optimized)) {
+    return false;
+  }
+
+  xt = mypDictionary->define(name, optimized);
+
   return true;
 }
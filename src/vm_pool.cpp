@@ -0,0 +1,64 @@
+
+#include "vm_pool.hpp"
+
+
+VMPool::VMPool(size_t size, std::function<void(VirtualMachine&)> boot)
+  : mySize{size},
+  mySlots{new std::atomic<VirtualMachine *>[size]},
+  myNext{0},
+  myBoot{boot}
+{
+  for (size_t i = 0; i < mySize; i++) {
+    mySlots[i].store(build(), std::memory_order_relaxed);
+  }
+}
+
+VMPool::~VMPool() {
+  for (size_t i = 0; i < mySize; i++) {
+    delete mySlots[i].load(std::memory_order_relaxed);
+  }
+}
+
+VirtualMachine *VMPool::acquire() {
+  const size_t start = myNext.fetch_add(1, std::memory_order_relaxed);
+  for (size_t i = 0; i < mySize; i++) {
+    std::atomic<VirtualMachine *> &slot = mySlots[(start + i) % mySize];
+    // Check first, so empty slots aren't written to
+    if (slot.load(std::memory_order_relaxed)) {
+      VirtualMachine *pVm = slot.exchange(nullptr, std::memory_order_acquire);
+      if (pVm) {
+        return pVm;
+      }
+    }
+  }
+
+  return build();
+}
+
+void VMPool::release(VirtualMachine *pVm) {
+  pVm->reset();
+
+  const size_t start = myNext.fetch_add(1, std::memory_order_relaxed);
+  for (size_t i = 0; i < mySize; i++) {
+    std::atomic<VirtualMachine *> &slot = mySlots[(start + i) % mySize];
+    VirtualMachine *empty = nullptr;
+    if (!slot.load(std::memory_order_relaxed)
+        && slot.compare_exchange_strong(empty, pVm,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+      return;
+    }
+  }
+
+  delete pVm;
+}
+
+VirtualMachine *VMPool::build() const {
+  VirtualMachine *pVm = new VirtualMachine{};
+  if (myBoot) {
+    myBoot(*pVm);
+  }
+  pVm->markBooted();
+
+  return pVm;
+}
@@ -0,0 +1,86 @@
+#include <vector>
+#include "catch.hpp"
+
+#include "batch_machine.hpp"
+
+
+static std::vector<int> interpret(const std::vector<int> &stack,
+                                  const Code &code) {
+  VirtualMachine vm;
+  for (int n : stack) {
+    vm.dataStack().push(SCell{n});
+  }
+  REQUIRE(vm.execute(code));
+  std::vector<int> cells;
+  SCell c;
+  while (vm.dataStack().pop(c)) {
+    cells.insert(cells.begin(), c.get());
+  }
+  return cells;
+}
+
+// The stack of one lane, bottom first
+static std::vector<int> lane(BatchMachine &batch, size_t i) {
+  std::vector<int> cells;
+  for (size_t k = 0; k < batch.depth(); k++) {
+    cells.push_back(SCell{batch.row(k)[i]}.get());
+  }
+  return cells;
+}
+
+
+TEST_CASE("Batches run every lane in lockstep", "[batch]") {
+  const size_t LANES = 37;
+  BatchMachine batch{LANES};
+
+  // Lane i starts with ( i-18 i*i+1 )
+  std::vector<int> bottom, top;
+  std::vector<UCell> row;
+  for (int i = 0; i < int(LANES); i++) {
+    bottom.push_back(i - 18);
+    top.push_back(i * i + 1);
+  }
+  row.assign(bottom.begin(), bottom.end());
+  REQUIRE(batch.push(row.data()));
+  row.assign(top.begin(), top.end());
+  REQUIRE(batch.push(row.data()));
+
+  SECTION("Each lane matches the interpreter") {
+    Code code{OPCODE_TWO_DUP, OPCODE_SWAP, OPCODE_MINUS, OPCODE_ROT,
+              OPCODE_STAR, OPCODE_OVER, OPCODE_MAX, OPCODE_LITERAL, 7,
+              OPCODE_SLASH_MOD, OPCODE_ROT, OPCODE_TWO_DUP, OPCODE_M_STAR,
+              OPCODE_D_NEGATE, OPCODE_TWO_SWAP, OPCODE_LESS_THAN,
+              OPCODE_NEGATE, OPCODE_ONE_PLUS, OPCODE_DROP};
+    REQUIRE(batch.execute(code));
+    for (size_t i = 0; i < LANES; i++) {
+      REQUIRE(lane(batch, i) ==
+              interpret({bottom[i], top[i]}, code));
+    }
+  }
+
+  SECTION("Calls are followed into the dictionary") {
+    Dictionary dictionary;
+    const size_t square = dictionary.define("SQUARE",
+                                            Code{OPCODE_DUP, OPCODE_STAR});
+    Code code{OPCODE_CALL, UCell{static_cast<UCell::type>(square)},
+              OPCODE_PLUS};
+    REQUIRE(batch.execute(code, &dictionary));
+    REQUIRE(batch.depth() == 1);
+    std::vector<UCell> sums(LANES);
+    REQUIRE(batch.pop(sums.data()));
+    for (size_t i = 0; i < LANES; i++) {
+      REQUIRE(SCell{sums[i]}.get() == bottom[i] + top[i] * top[i]);
+    }
+  }
+
+  SECTION("Data-dependent and VM-only instructions are rejected") {
+    REQUIRE_FALSE(batch.execute(Code{OPCODE_QUESTION_DUP}));
+    REQUIRE_FALSE(batch.execute(Code{OPCODE_EXECUTE}));
+    REQUIRE_FALSE(batch.execute(Code{OPCODE_CALL, 0}));
+  }
+
+  SECTION("Stack underflow is caught for every lane at once") {
+    REQUIRE_FALSE(batch.execute(Code{OPCODE_ROT}));
+    REQUIRE(batch.depth() == 2);
+  }
+}
@@ -0,0 +1,219 @@
+#include <vector>
+#include "catch.hpp"
+
+#include "compiler.hpp"
+#include "dictionary.hpp"
+
+
+static std::vector<int> drain(DataStack &ds) {
+  std::vector<int> cells;
+  SCell c;
+  while (ds.pop(c)) {
+    cells.insert(cells.begin(), c.get());
+  }
+  return cells;
+}
+
+static std::vector<int> interpret(const std::vector<int> &stack,
+                                  const Code &code) {
+  VirtualMachine vm;
+  for (int n : stack) {
+    vm.dataStack().push(SCell{n});
+  }
+  REQUIRE(vm.execute(code));
+  return drain(vm.dataStack());
+}
+
+static std::vector<int> run(const std::vector<int> &stack,
+                            const CompiledCode &compiled) {
+  DataStack ds;
+  for (int n : stack) {
+    ds.push(SCell{n});
+  }
+  REQUIRE(compiled(ds));
+  return drain(ds);
+}
+
+
+TEST_CASE("Stack manipulation compiles to renames", "[compiler]") {
+  Compiler compiler;
+  CompiledCode compiled;
+
+  SECTION("SWAP OVER ROT leaves no instructions") {
+    Code code{OPCODE_SWAP, OPCODE_OVER, OPCODE_ROT};
+    REQUIRE(compiler.compile(code, compiled));
+    REQUIRE(compiled.blockCount() == 1);
+    REQUIRE(compiled.block(0).instructionCount() == 0);
+    REQUIRE(run({1, 2, 3}, compiled) == interpret({1, 2, 3}, code));
+  }
+
+  SECTION("SWAP SWAP doesn't touch the stack at all") {
+    Code code{OPCODE_SWAP, OPCODE_SWAP, OPCODE_TWO_SWAP, OPCODE_TWO_SWAP};
+    REQUIRE(compiler.compile(code, compiled));
+    REQUIRE(compiled.blockCount() == 0);
+    REQUIRE(run({1, 2, 3, 4}, compiled) == std::vector<int>({1, 2, 3, 4}));
+  }
+
+  SECTION("Results nobody reads are never computed") {
+    Code code{OPCODE_OVER, OPCODE_OVER, OPCODE_STAR, OPCODE_DROP,
+              OPCODE_PLUS};
+    REQUIRE(compiler.compile(code, compiled));
+    REQUIRE(compiled.blockCount() == 1);
+    REQUIRE(compiled.block(0).instructionCount() == 1);
+    REQUIRE(run({5, 7}, compiled) == interpret({5, 7}, code));
+  }
+}
+
+TEST_CASE("Compiled code matches the interpreter", "[compiler]") {
+  Compiler compiler;
+  CompiledCode compiled;
+
+  SECTION("Arithmetic and shuffles") {
+    Code code{OPCODE_DUP, OPCODE_ROT, OPCODE_STAR, OPCODE_SWAP,
+              OPCODE_MINUS, OPCODE_TWO_DUP, OPCODE_SLASH_MOD, OPCODE_ROT,
+              OPCODE_MAX, OPCODE_NEGATE, OPCODE_OVER, OPCODE_LESS_THAN};
+    REQUIRE(compiler.compile(code, compiled));
+    REQUIRE(run({9, -4, 3}, compiled) == interpret({9, -4, 3}, code));
+    REQUIRE(run({1, 2, 3}, compiled) == interpret({1, 2, 3}, code));
+  }
+
+  SECTION("Registers are reused once their value is dead") {
+    Code code;
+    for (int i = 0; i < 20; i++) {
+      code.push_back(OPCODE_OVER);
+      code.push_back(OPCODE_PLUS);
+    }
+    REQUIRE(compiler.compile(code, compiled));
+    REQUIRE(compiled.blockCount() == 1);
+    REQUIRE(compiled.block(0).registerCount() <= 3);
+    REQUIRE(run({3, 1}, compiled) == interpret({3, 1}, code));
+  }
+
+  SECTION("Long blocks are split to fit the register file") {
+    Code code;
+    for (int i = 0; i < 40; i++) {
+      code.push_back(OPCODE_DUP);
+      code.push_back(OPCODE_ONE_PLUS);
+    }
+    REQUIRE(compiler.compile(code, compiled));
+    REQUIRE(compiled.blockCount() > 1);
+    REQUIRE(run({0}, compiled) == interpret({0}, code));
+  }
+
+  SECTION("Literals are loaded straight into registers") {
+    Code code{OPCODE_LITERAL, 10, OPCODE_SWAP, OPCODE_MINUS,
+              OPCODE_LITERAL, 3, OPCODE_STAR};
+    REQUIRE(compiler.compile(code, compiled));
+    REQUIRE(compiled.blockCount() == 1);
+    REQUIRE(compiled.block(0).inputCount() == 1);
+    REQUIRE(run({4}, compiled) == interpret({4}, code));
+  }
+
+  SECTION("?DUP ends the block and is interpreted") {
+    Code code{OPCODE_SWAP, OPCODE_QUESTION_DUP, OPCODE_PLUS};
+    REQUIRE(compiler.compile(code, compiled));
+    REQUIRE(compiled.blockCount() == 2);
+    REQUIRE(run({1, 0, 2}, compiled) == interpret({1, 0, 2}, code));
+    REQUIRE(run({1, 4, 2}, compiled) == interpret({1, 4, 2}, code));
+  }
+
+  SECTION("Calls leave the code to the interpreter") {
+    VirtualMachine vm;
+    size_t square;
+    REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+    Code code{OPCODE_SWAP, OPCODE_CALL,
+              UCell{static_cast<UCell::type>(square)}, OPCODE_PLUS};
+    REQUIRE(compiler.compile(code, compiled));
+    REQUIRE(compiled.blockCount() == 2);
+    REQUIRE_FALSE(compiled.leaf());
+
+    vm.dataStack().push(SCell{3});
+    vm.dataStack().push(SCell{5});
+    REQUIRE_FALSE(compiled(vm));
+  }
+
+  SECTION("Invalid opcodes are rejected") {
+    REQUIRE_FALSE(compiler.compile(Code{OPCODE_LAST}, compiled));
+  }
+}
+
+TEST_CASE("Double-cell words compile to registers", "[compiler]") {
+  Compiler compiler;
+  CompiledCode compiled;
+
+  Code code{OPCODE_TWO_DUP, OPCODE_M_STAR, OPCODE_TWO_SWAP, OPCODE_UM_STAR,
+            OPCODE_D_PLUS, OPCODE_TWO_DUP, OPCODE_D_NEGATE, OPCODE_D_MINUS,
+            OPCODE_LITERAL, 7, OPCODE_FM_SLASH_MOD};
+  REQUIRE(compiler.compile(code, compiled));
+  REQUIRE(compiled.blockCount() == 1);
+  REQUIRE(run({-3, 100000}, compiled) == interpret({-3, 100000}, code));
+  REQUIRE(run({12345, 678}, compiled) == interpret({12345, 678}, code));
+}
+
+TEST_CASE("The machine runs leaf words in register form", "[compiler]") {
+  VirtualMachine vm;
+  vm.setInlineBudget(0);
+  size_t square, sum, get, twice;
+  REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+  REQUIRE(vm.define("SUM", Code{OPCODE_OVER, OPCODE_OVER, OPCODE_PLUS,
+                                OPCODE_ROT, OPCODE_ROT, OPCODE_STAR,
+                                OPCODE_PLUS},
+                    sum));
+  REQUIRE(vm.define("V", Code{OPCODE_VALUE, 4}, get));
+  REQUIRE(vm.define("TWICE", Code{OPCODE_CALL,
+                                  UCell{static_cast<UCell::type>(square)},
+                                  OPCODE_CALL,
+                                  UCell{static_cast<UCell::type>(square)}},
+                    twice));
+
+  SECTION("Only leaves with register blocks are compiled") {
+    REQUIRE(vm.dictionary().compiled(square) != nullptr);
+    REQUIRE(vm.dictionary().compiled(sum) != nullptr);
+    REQUIRE(vm.dictionary().compiled(get) == nullptr);
+    REQUIRE(vm.dictionary().compiled(twice) == nullptr);
+  }
+
+  SECTION("Calls to leaves run the compiled form") {
+    vm.dataStack().push(SCell{3});
+    REQUIRE(vm.execute(twice));
+    vm.dataStack().push(SCell{2});
+    vm.dataStack().push(SCell{5});
+    REQUIRE(vm.execute(sum));
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({81, 17}));
+  }
+
+  SECTION("A leaf fails on underflow like the interpreter") {
+    REQUIRE_FALSE(vm.execute(square));
+    REQUIRE(vm.dataStack().depth() == 0);
+  }
+
+  SECTION("Forgetting a leaf drops its compiled form") {
+    REQUIRE(vm.dictionary().forget(sum));
+    REQUIRE(vm.dictionary().compiled(sum) == nullptr);
+    REQUIRE(vm.dictionary().compiled(square) != nullptr);
+
+    // Words defined in its place get compiled forms of their own, or none
+    size_t negate, value;
+    REQUIRE(vm.define("NEGATE", Code{OPCODE_NEGATE}, negate));
+    REQUIRE(negate == sum);
+    REQUIRE(vm.dictionary().compiled(negate) != nullptr);
+    REQUIRE(vm.define("V", Code{OPCODE_VALUE, 4}, value));
+    vm.dataStack().push(SCell{6});
+    REQUIRE(vm.execute(negate));
+    REQUIRE(vm.execute(value));
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({-6, 4}));
+    REQUIRE(vm.dictionary().forget(negate));
+    REQUIRE(vm.define("V", Code{OPCODE_VALUE, 4}, value));
+    REQUIRE(value == sum);
+    REQUIRE(vm.dictionary().compiled(value) == nullptr);
+  }
+
+  SECTION("Fuel still counts calls to leaves") {
+    size_t fuel = 10;
+    vm.dataStack().push(SCell{2});
+    REQUIRE(vm.start(twice));
+    REQUIRE(vm.run(fuel));
+    REQUIRE(fuel == 8);
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({16}));
+  }
+}
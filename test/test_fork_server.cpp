@@ -0,0 +1,71 @@
+#include <cstring>
+#include <string>
+#include "catch.hpp"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fork_server.hpp"
+#include "interpreter.hpp"
+
+
+// Send a job to the server at path and read back its reply
+static std::string submit(const std::string &path, const std::string &job) {
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, path.c_str(), path.size());
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  REQUIRE(fd >= 0);
+  REQUIRE(connect(fd, reinterpret_cast<sockaddr *>(&address),
+                  sizeof(address)) == 0);
+  REQUIRE(write(fd, job.data(), job.size())
+          == static_cast<ssize_t>(job.size()));
+  shutdown(fd, SHUT_WR);
+
+  std::string reply;
+  char buffer[256];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+    reply.append(buffer, n);
+  }
+  close(fd);
+
+  return reply;
+}
+
+
+TEST_CASE("The fork server runs each job in its own process",
+          "[fork_server]") {
+  const std::string path = "/tmp/bbforth-test-"
+    + std::to_string(getpid()) + ".sock";
+
+  VirtualMachine vm;
+  Interpreter interpreter{vm};
+  REQUIRE(interpreter.interpret(": SQUARE DUP * ; VARIABLE X 7 X !"));
+
+  ForkServer server{vm};
+  REQUIRE(server.listen(path));
+  REQUIRE_FALSE(server.listen(path));
+
+  const pid_t pid = fork();
+  REQUIRE(pid >= 0);
+  if (pid == 0) {
+    _exit(server.serve(4) ? 0 : 1);
+  }
+
+  REQUIRE(submit(path, "3 SQUARE X @") == "ok 9 7\n");
+  // A job's changes stay in its own process
+  REQUIRE(submit(path, ": CUBE DUP SQUARE * ; 2 CUBE 1 X +! X @")
+          == "ok 8 8\n");
+  REQUIRE(submit(path, "2 CUBE") == "error CUBE\n");
+  REQUIRE(submit(path, "X @") == "ok 7\n");
+
+  int status;
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+}
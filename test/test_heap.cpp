@@ -0,0 +1,218 @@
+#include <set>
+#include <vector>
+#include "catch.hpp"
+
+#include "heap.hpp"
+#include "operation.hpp"
+
+
+TEST_CASE("The heap hands out blocks from the top of the data space",
+          "[heap]") {
+  DataSpace space{16 * HEAP_PAGE_SIZE};
+  Heap heap{space};
+  UCell::type a, b, c;
+
+  SECTION("Blocks are aligned, disjoint and addressable") {
+    std::set<UCell::type> blocks;
+    for (UCell::type size : {1, 7, 16, 100, 100, 2000, 5000}) {
+      REQUIRE(heap.allocate(size, a));
+      REQUIRE(a % sizeof(UCell) == 0);
+      REQUIRE(a >= space.limit());
+      REQUIRE(space.bytes(a, size) != nullptr);
+      std::memset(space.bytes(a, size), 0xab, size);
+      blocks.insert(a);
+    }
+    REQUIRE(blocks.size() == 7);
+    REQUIRE(space.limit() < space.size());
+    REQUIRE(space.here() == 0);
+  }
+
+  SECTION("Freed blocks are reused by their size class") {
+    REQUIRE(heap.allocate(24, a));
+    REQUIRE(heap.allocate(24, b));
+    REQUIRE(heap.free(a));
+    REQUIRE(heap.allocate(20, c));
+    REQUIRE(c == a);
+    REQUIRE(heap.allocate(200, c));
+    REQUIRE(c != a);
+  }
+
+  SECTION("Large blocks take whole pages and are reused first fit") {
+    const size_t limit = space.limit();
+    REQUIRE(heap.allocate(3 * HEAP_PAGE_SIZE, a));
+    REQUIRE(limit - space.limit() == 4 * HEAP_PAGE_SIZE);
+    REQUIRE(heap.free(a));
+    REQUIRE(heap.allocate(HEAP_PAGE_SIZE, b));
+    REQUIRE(b == a);
+    REQUIRE(heap.free(b));
+    REQUIRE(heap.allocate(3 * HEAP_PAGE_SIZE, c));
+    REQUIRE(c == a);
+  }
+
+  SECTION("Freeing a small block twice fails") {
+    // In a one-page space the blocks sit low enough that a link to one
+    // would pass for a block size
+    DataSpace page{HEAP_PAGE_SIZE};
+    Heap pageHeap{page};
+    std::vector<UCell::type> blocks(3);
+    for (UCell::type &block : blocks) {
+      REQUIRE(pageHeap.allocate(24, block));
+    }
+    REQUIRE(pageHeap.free(blocks[1]));
+    REQUIRE(pageHeap.free(blocks[2]));
+    REQUIRE_FALSE(pageHeap.free(blocks[1]));
+    REQUIRE_FALSE(pageHeap.free(blocks[2]));
+    REQUIRE_FALSE(pageHeap.resize(blocks[2], 100, c));
+    // Both are on the free list once, so each is handed out once
+    REQUIRE(pageHeap.allocate(24, a));
+    REQUIRE(pageHeap.allocate(24, b));
+    REQUIRE(pageHeap.allocate(24, c));
+    REQUIRE(a == blocks[2]);
+    REQUIRE(b == blocks[1]);
+    REQUIRE(c != blocks[1]);
+    REQUIRE(c != blocks[2]);
+  }
+
+  SECTION("Freeing a large block twice fails") {
+    REQUIRE(heap.allocate(3 * HEAP_PAGE_SIZE, a));
+    REQUIRE(heap.free(a));
+    REQUIRE_FALSE(heap.free(a));
+    REQUIRE_FALSE(heap.resize(a, 4 * HEAP_PAGE_SIZE, b));
+    // It's on the free list once, so it's handed out once
+    REQUIRE(heap.allocate(3 * HEAP_PAGE_SIZE, b));
+    REQUIRE(heap.allocate(3 * HEAP_PAGE_SIZE, c));
+    REQUIRE(b == a);
+    REQUIRE(c != a);
+    REQUIRE(heap.free(b));
+  }
+
+  SECTION("Resizing keeps the contents") {
+    REQUIRE(heap.allocate(8, a));
+    std::memcpy(space.bytes(a, 8), "bbforth", 8);
+    REQUIRE(heap.resize(a, 5, b));
+    REQUIRE(b == a);
+    REQUIRE(heap.resize(a, 3000, b));
+    REQUIRE(b != a);
+    REQUIRE(std::memcmp(space.bytes(b, 8), "bbforth", 8) == 0);
+  }
+
+  SECTION("Bad addresses are refused") {
+    REQUIRE_FALSE(heap.free(0));
+    REQUIRE(heap.allocate(8, a));
+    REQUIRE_FALSE(heap.free(a + 1));
+    REQUIRE_FALSE(heap.resize(a + sizeof(UCell), 4, b));
+  }
+
+  SECTION("The heap and HERE don't cross") {
+    REQUIRE(space.allot(static_cast<SCell::type>(15 * HEAP_PAGE_SIZE)));
+    REQUIRE(heap.allocate(100, a));
+    REQUIRE_FALSE(heap.allocate(HEAP_PAGE_SIZE, b));
+    REQUIRE_FALSE(space.allot(1));
+  }
+
+  SECTION("Clearing frees everything at once") {
+    while (heap.allocate(1000, a)) {
+    }
+    heap.clear();
+    REQUIRE(space.limit() == space.size());
+    REQUIRE(heap.allocate(1000, b));
+  }
+}
+
+TEST_CASE("ALLOCATE, FREE and RESIZE push an ior", "[heap]") {
+  VirtualMachine vm;
+  DataStack &ds = vm.dataStack();
+  SCell address{0}, ior{0};
+
+  REQUIRE(vm.execute(Code{OPCODE_LITERAL, 10, OPCODE_ALLOCATE}));
+  REQUIRE(ds.pop(ior));
+  REQUIRE(ior.get() == 0);
+  REQUIRE(ds.peek(address));
+
+  REQUIRE(vm.execute(Code{OPCODE_LITERAL, 7, OPCODE_OVER, OPCODE_STORE,
+                          OPCODE_LITERAL, 100, OPCODE_RESIZE}));
+  REQUIRE(ds.pop(ior));
+  REQUIRE(ior.get() == 0);
+  REQUIRE(vm.execute(Code{OPCODE_DUP, OPCODE_FETCH, OPCODE_SWAP,
+                          OPCODE_FREE, OPCODE_LITERAL, 3, OPCODE_FREE}));
+  std::vector<SCell::type> stack;
+  while (ds.pop(ior)) {
+    stack.insert(stack.begin(), ior.get());
+  }
+  REQUIRE(stack == std::vector<SCell::type>({7, 0, -1}));
+
+  vm.dataStack().push(SCell{-1});
+  REQUIRE(vm.execute(Code{OPCODE_ALLOCATE}));
+  REQUIRE(ds.pop(ior));
+  REQUIRE(ior.get() != 0);
+}
+
+TEST_CASE("Regions allocate by bump pointer and release at once", "[heap]") {
+  DataSpace space{16 * HEAP_PAGE_SIZE};
+  Heap heap{space};
+  UCell::type region, a, b, c;
+
+  REQUIRE(heap.allocateRegion(100, region));
+
+  SECTION("Allocations are aligned and follow each other") {
+    REQUIRE(heap.regionAllocate(region, 3, a));
+    REQUIRE(heap.regionAllocate(region, 8, b));
+    REQUIRE(a % sizeof(UCell) == 0);
+    REQUIRE(b % sizeof(UCell) == 0);
+    REQUIRE(b - a == sizeof(UCell));
+    REQUIRE(a > region);
+  }
+
+  SECTION("A full region refuses, and releasing it empties it") {
+    REQUIRE(heap.regionAllocate(region, 100, a));
+    REQUIRE_FALSE(heap.regionAllocate(region, HEAP_PAGE_SIZE, b));
+    REQUIRE(heap.releaseRegion(region));
+    REQUIRE(heap.regionAllocate(region, 50, c));
+    REQUIRE(c == a);
+  }
+
+  SECTION("Only regions are allocated from") {
+    REQUIRE_FALSE(heap.regionAllocate(region + 1, 8, a));
+    REQUIRE_FALSE(heap.releaseRegion(0));
+  }
+
+  SECTION("A region is freed like any block") {
+    REQUIRE(heap.free(region));
+    REQUIRE(heap.allocateRegion(100, a));
+    REQUIRE(a == region);
+  }
+}
+
+TEST_CASE("REGION, RALLOT and RFREE-ALL push an ior", "[heap]") {
+  VirtualMachine vm;
+  DataStack &ds = vm.dataStack();
+  SCell x;
+
+  REQUIRE(vm.execute(Code{
+    OPCODE_LITERAL, 64, OPCODE_REGION, OPCODE_DROP,
+    OPCODE_DUP, OPCODE_LITERAL, 16, OPCODE_R_ALLOT, OPCODE_DROP,
+    OPCODE_LITERAL, 5, OPCODE_SWAP, OPCODE_STORE,
+    OPCODE_DUP, OPCODE_LITERAL, 200, OPCODE_R_ALLOT, OPCODE_SWAP, OPCODE_DROP,
+    OPCODE_SWAP, OPCODE_DUP, OPCODE_R_FREE_ALL,
+    OPCODE_SWAP, OPCODE_LITERAL, 8, OPCODE_R_ALLOT, OPCODE_DROP,
+    OPCODE_FETCH}));
+  std::vector<SCell::type> stack;
+  while (ds.pop(x)) {
+    stack.insert(stack.begin(), x.get());
+  }
+  // The second RALLOT didn't fit; the one after the release got the first
+  // allocation back
+  REQUIRE(stack == std::vector<SCell::type>({-1, 0, 5}));
+}
+
+TEST_CASE("Heap words fail on stack underflow", "[heap]") {
+  VirtualMachine vm;
+
+  for (UCell op : {OPCODE_ALLOCATE, OPCODE_FREE, OPCODE_REGION,
+                   OPCODE_R_FREE_ALL}) {
+    REQUIRE_FALSE(vm.execute(Code{op}));
+  }
+  for (UCell op : {OPCODE_RESIZE, OPCODE_R_ALLOT}) {
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_LITERAL, 8, op}));
+  }
+}
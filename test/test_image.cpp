@@ -0,0 +1,382 @@
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "catch.hpp"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dictionary.hpp"
+#include "image.hpp"
+
+
+static UCell cell(size_t xt) {
+  return UCell{static_cast<UCell::type>(xt)};
+}
+
+// A fresh file name, removed when it goes out of scope
+class TemporaryFile {
+  public:
+    TemporaryFile() {
+      char name[] = "/tmp/bbforth-image-XXXXXX";
+      const int fd = mkstemp(name);
+      REQUIRE(fd >= 0);
+      close(fd);
+      myName = name;
+    }
+
+    ~TemporaryFile() {
+      std::remove(myName.c_str());
+    }
+
+    const std::string &name() const {
+      return myName;
+    }
+
+  private:
+    std::string myName;
+};
+
+
+TEST_CASE("Images restore the dictionary and data space", "[image]") {
+  TemporaryFile file;
+  size_t square, counter, get, d;
+
+  {
+    VirtualMachine vm;
+    REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+    REQUIRE(vm.define("COUNTER", Code{OPCODE_VALUE, 5}, counter));
+    REQUIRE(vm.define("GET", Code{OPCODE_CALL, cell(counter)}, get));
+    REQUIRE(vm.define("D", Code{OPCODE_DEFER, cell(square)}, d));
+    REQUIRE(vm.dataSpace().comma(UCell{1234}));
+    // Quicken the call in GET, which the image has to undo
+    REQUIRE(vm.execute(Code{OPCODE_CALL, cell(get), OPCODE_DROP}));
+    REQUIRE(vm.dictionary().code()[get].get() == OPCODE_LITERAL);
+    REQUIRE(saveImage(vm, file.name()));
+  }
+
+  VirtualMachine vm;
+  REQUIRE(loadImage(vm, file.name()));
+
+  size_t xt;
+  REQUIRE(vm.dictionary().find("SQUARE", xt));
+  REQUIRE(xt == square);
+  REQUIRE(vm.dataSpace().here() == sizeof(UCell));
+
+  REQUIRE(vm.execute(Code{OPCODE_LITERAL, 0, OPCODE_FETCH,
+                          OPCODE_LITERAL, 3, OPCODE_CALL, cell(d),
+                          OPCODE_LITERAL, 8, OPCODE_TO, cell(counter),
+                          OPCODE_CALL, cell(get)}));
+  SCell c;
+  std::vector<SCell::type> stack;
+  while (vm.dataStack().pop(c)) {
+    stack.insert(stack.begin(), c.get());
+  }
+  REQUIRE(stack == std::vector<SCell::type>({1234, 9, 8}));
+
+  SECTION("The mapped data space is private and writable") {
+    REQUIRE(vm.dataSpace().store(0, UCell{1}));
+    REQUIRE(vm.dataSpace().allot(100));
+    VirtualMachine other;
+    REQUIRE(loadImage(other, file.name()));
+    UCell x{0};
+    REQUIRE(other.dataSpace().fetch(0, x));
+    REQUIRE(x.get() == 1234);
+  }
+
+  SECTION("Reset goes back to the image") {
+    REQUIRE(vm.dataSpace().store(0, UCell{1}));
+    vm.reset();
+    UCell x{0};
+    REQUIRE(vm.dataSpace().fetch(0, x));
+    REQUIRE(x.get() == 1234);
+  }
+
+  SECTION("Saving over the file leaves loaded machines their image") {
+    VirtualMachine other;
+    REQUIRE(other.dataSpace().comma(UCell{5678}));
+    REQUIRE(saveImage(other, file.name()));
+    REQUIRE(access((file.name() + ".tmp").c_str(), F_OK) != 0);
+
+    UCell x{0};
+    REQUIRE(vm.dataSpace().fetch(0, x));
+    REQUIRE(x.get() == 1234);
+    VirtualMachine reloaded;
+    REQUIRE(loadImage(reloaded, file.name()));
+    REQUIRE(reloaded.dataSpace().fetch(0, x));
+    REQUIRE(x.get() == 5678);
+  }
+}
+
+TEST_CASE("SAVE-IMAGE writes an image from a running program", "[image]") {
+  TemporaryFile file;
+  VirtualMachine vm;
+  size_t square;
+  REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+
+  Code code;
+  for (char c : file.name()) {
+    code.insert(code.end(), {OPCODE_LITERAL, UCell{static_cast<UCell::type>(c)},
+                             OPCODE_C_COMMA});
+  }
+  code.insert(code.end(), {OPCODE_LITERAL, 0,
+                           OPCODE_LITERAL, cell(file.name().size()),
+                           OPCODE_SAVE_IMAGE});
+  REQUIRE(vm.execute(code));
+  SCell ior{0};
+  REQUIRE(vm.dataStack().pop(ior));
+  REQUIRE(ior.get() == 0);
+
+  VirtualMachine loaded;
+  REQUIRE(loadImage(loaded, file.name()));
+  size_t xt;
+  REQUIRE(loaded.dictionary().find("SQUARE", xt));
+  REQUIRE(loaded.dataSpace().here() == file.name().size());
+
+  // Without a name there's nothing to save to
+  vm.dataStack().clear();
+  REQUIRE_FALSE(vm.execute(Code{OPCODE_LITERAL, 0, OPCODE_SAVE_IMAGE}));
+}
+
+TEST_CASE("Files that aren't images are rejected", "[image]") {
+  TemporaryFile file;
+  VirtualMachine vm;
+  size_t square;
+  REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+
+  REQUIRE_FALSE(loadImage(vm, "/nonexistent/image"));
+  FILE *f = std::fopen(file.name().c_str(), "wb");
+  std::fputs("BBFORTH\nbut not really", f);
+  std::fclose(f);
+  REQUIRE_FALSE(loadImage(vm, file.name()));
+
+  size_t xt;
+  REQUIRE(vm.dictionary().find("SQUARE", xt));
+}
+
+TEST_CASE("Images load from memory", "[image]") {
+  TemporaryFile file;
+  size_t square;
+
+  {
+    VirtualMachine vm;
+    REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+    REQUIRE(vm.dataSpace().comma(UCell{1234}));
+    REQUIRE(saveImage(vm, file.name()));
+  }
+
+  std::vector<unsigned char> image;
+  FILE *f = std::fopen(file.name().c_str(), "rb");
+  REQUIRE(f);
+  int c;
+  while ((c = std::fgetc(f)) != EOF) {
+    image.push_back(static_cast<unsigned char>(c));
+  }
+  std::fclose(f);
+
+  VirtualMachine vm;
+  REQUIRE(loadImage(vm, image.data(), image.size()));
+  // The machine's data space is its own, not the image's
+  std::fill(image.begin(), image.end(), 0);
+  size_t xt;
+  REQUIRE(vm.dictionary().find("SQUARE", xt));
+  REQUIRE(xt == square);
+  REQUIRE(vm.dataSpace().here() == sizeof(UCell));
+  REQUIRE(vm.execute(Code{OPCODE_LITERAL, 0, OPCODE_FETCH,
+                          OPCODE_CALL, cell(square)}));
+  SCell x{0};
+  REQUIRE(vm.dataStack().pop(x));
+  REQUIRE(x.get() == 1234 * 1234);
+
+  REQUIRE_FALSE(loadImage(vm, image.data(), image.size()));
+  REQUIRE_FALSE(loadImage(vm, image.data(), 3));
+}
+
+TEST_CASE("Images load from shared memory", "[image]") {
+  VirtualMachine vm;
+  size_t square;
+  REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+  REQUIRE(vm.dataSpace().comma(UCell{1234}));
+
+  SECTION("Anonymous images are sealed") {
+    int fd;
+    REQUIRE(shareImage(vm, "", fd));
+    const char junk[] = "junk";
+    REQUIRE(pwrite(fd, junk, sizeof(junk), 0) < 0);
+
+    VirtualMachine a, b;
+    REQUIRE(loadImage(a, fd));
+    REQUIRE(loadImage(b, fd));
+    close(fd);
+    // Each machine's writes stay its own
+    REQUIRE(a.dataSpace().store(0, UCell{1}));
+    UCell x{0};
+    REQUIRE(b.dataSpace().fetch(0, x));
+    REQUIRE(x.get() == 1234);
+    size_t xt;
+    REQUIRE(b.dictionary().find("SQUARE", xt));
+    REQUIRE(xt == square);
+  }
+
+  SECTION("Named images outlive their descriptor") {
+    const std::string name = "/bbforth-test-" + std::to_string(getpid());
+    int fd;
+    REQUIRE(shareImage(vm, name, fd));
+    close(fd);
+
+    VirtualMachine loaded;
+    REQUIRE(loadSharedImage(loaded, name));
+    UCell x{0};
+    REQUIRE(loaded.dataSpace().fetch(0, x));
+    REQUIRE(x.get() == 1234);
+    REQUIRE(shm_unlink(name.c_str()) == 0);
+    REQUIRE_FALSE(loadSharedImage(loaded, name));
+  }
+
+  SECTION("Sharing under a name again leaves loaded machines their image") {
+    const std::string name = "/bbforth-test-" + std::to_string(getpid());
+    int fd;
+    REQUIRE(shareImage(vm, name, fd));
+    close(fd);
+    VirtualMachine loaded;
+    REQUIRE(loadSharedImage(loaded, name));
+
+    VirtualMachine other;
+    REQUIRE(other.dataSpace().comma(UCell{5678}));
+    REQUIRE(shareImage(other, name, fd));
+    close(fd);
+
+    UCell x{0};
+    REQUIRE(loaded.dataSpace().fetch(0, x));
+    REQUIRE(x.get() == 1234);
+    VirtualMachine reloaded;
+    REQUIRE(loadSharedImage(reloaded, name));
+    REQUIRE(reloaded.dataSpace().fetch(0, x));
+    REQUIRE(x.get() == 5678);
+    REQUIRE(shm_unlink(name.c_str()) == 0);
+  }
+}
+
+// Kilobytes of the mapping that holds address that are the process's own
+// copies, from /proc/self/smaps
+static size_t anonymousKb(const void *address) {
+  const uintptr_t a = reinterpret_cast<uintptr_t>(address);
+  std::ifstream smaps{"/proc/self/smaps"};
+  std::string line;
+  bool inside = false;
+  while (std::getline(smaps, line)) {
+    unsigned long start, end;
+    if (std::sscanf(line.c_str(), "%lx-%lx", &start, &end) == 2) {
+      inside = a >= start && a < end;
+    } else if (inside && line.compare(0, 10, "Anonymous:") == 0) {
+      return std::stoul(line.substr(10));
+    }
+  }
+  return static_cast<size_t>(-1);
+}
+
+TEST_CASE("Reset drops the pages a machine wrote to", "[image]") {
+  TemporaryFile file;
+  VirtualMachine vm;
+  REQUIRE(vm.dataSpace().comma(UCell{1234}));
+
+  SECTION("Booted in memory") {
+    vm.markBooted();
+  }
+
+  SECTION("Loaded from an image") {
+    REQUIRE(saveImage(vm, file.name()));
+    REQUIRE(loadImage(vm, file.name()));
+  }
+
+  DataSpace &space = vm.dataSpace();
+  const size_t page = sysconf(_SC_PAGESIZE);
+  // Twice, since the first reset may have to map the snapshot
+  for (int i = 0; i < 2; i++) {
+    for (size_t address = 0; address < space.size(); address += page) {
+      REQUIRE(space.store(address, UCell{5}));
+    }
+    REQUIRE(anonymousKb(space.bytes(0, 0)) * 1024 >= space.size());
+
+    vm.reset();
+    REQUIRE(anonymousKb(space.bytes(0, 0)) == 0);
+    UCell x{0};
+    REQUIRE(space.fetch(0, x));
+    REQUIRE(x.get() == 1234);
+    REQUIRE(space.fetch(space.size() - page, x));
+    REQUIRE(x.get() == 0);
+    REQUIRE(space.here() == sizeof(UCell));
+  }
+}
+
+// Run a started machine until it stops, and take its data stack
+static std::vector<SCell::type> finish(VirtualMachine &vm) {
+  while (vm.running()) {
+    REQUIRE(vm.runOnce());
+  }
+
+  SCell c;
+  std::vector<SCell::type> stack;
+  while (vm.dataStack().pop(c)) {
+    stack.insert(stack.begin(), c.get());
+  }
+  return stack;
+}
+
+TEST_CASE("Checkpoints resume a machine where it stopped", "[image]") {
+  TemporaryFile file;
+  VirtualMachine vm;
+  vm.setInlineBudget(0);
+  vm.setSpecializeBudget(0);
+  size_t counter, get, work;
+  REQUIRE(vm.define("COUNTER", Code{OPCODE_VALUE, 5}, counter));
+  REQUIRE(vm.define("GET", Code{OPCODE_CALL, cell(counter)}, get));
+  REQUIRE(vm.define("WORK", Code{OPCODE_LITERAL, 16, OPCODE_ALLOCATE,
+                                 OPCODE_DROP, OPCODE_DUP, OPCODE_LITERAL, 100,
+                                 OPCODE_SWAP, OPCODE_STORE,
+                                 OPCODE_CALL, cell(get),
+                                 OPCODE_LITERAL, 9, OPCODE_TO, cell(counter),
+                                 OPCODE_CALL, cell(get),
+                                 OPCODE_ROT, OPCODE_DUP, OPCODE_FETCH},
+                    work));
+  REQUIRE(vm.floatStack().push(2.5));
+
+  REQUIRE(vm.start(work));
+  REQUIRE_FALSE(vm.start(work));
+  // Stop inside the first GET, once the call to COUNTER in it is quickened
+  while (vm.returnStack().depth() < 2 || vm.dataStack().depth() < 2) {
+    REQUIRE(vm.runOnce());
+  }
+  REQUIRE(vm.dictionary().code()[get].get() == OPCODE_LITERAL);
+  REQUIRE(saveCheckpoint(vm, file.name()));
+
+  VirtualMachine resumed;
+  REQUIRE_FALSE(loadImage(resumed, file.name()));
+  REQUIRE(loadCheckpoint(resumed, file.name()));
+  REQUIRE(resumed.running());
+  const std::vector<SCell::type> expected = finish(vm);
+  const std::vector<SCell::type> stack = finish(resumed);
+  REQUIRE(stack == expected);
+  REQUIRE(stack.size() == 4);
+  REQUIRE(stack[0] == 5);
+  REQUIRE(stack[1] == 9);
+  REQUIRE(stack[3] == 100);
+
+  // The heap carries on from where it was, too
+  Float f;
+  REQUIRE(resumed.floatStack().pop(f));
+  REQUIRE(f == 2.5);
+  REQUIRE(resumed.execute(Code{OPCODE_LITERAL, 16, OPCODE_ALLOCATE,
+                               OPCODE_DROP, OPCODE_LITERAL, cell(stack[2]),
+                               OPCODE_FREE}));
+  SCell ior{0}, block{0};
+  REQUIRE(resumed.dataStack().pop(ior));
+  REQUIRE(resumed.dataStack().pop(block));
+  REQUIRE(ior.get() == 0);
+  REQUIRE(block.get() != stack[2]);
+
+  TemporaryFile image;
+  REQUIRE(saveImage(vm, image.name()));
+  REQUIRE_FALSE(loadCheckpoint(resumed, image.name()));
+}
@@ -0,0 +1,102 @@
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include "catch.hpp"
+
+#include "dictionary.hpp"
+#include "interpreter.hpp"
+
+
+static std::vector<SCell::type> stack(VirtualMachine &vm) {
+  std::vector<SCell::type> cells;
+  SCell c;
+  while (vm.dataStack().pop(c)) {
+    cells.insert(cells.begin(), c.get());
+  }
+  return cells;
+}
+
+
+TEST_CASE("Numbers parse in decimal and hex", "[interpreter]") {
+  UCell value;
+  REQUIRE(parseNumber("42", value));
+  REQUIRE(value.get() == 42);
+  REQUIRE(parseNumber("-7", value));
+  REQUIRE(SCell{value}.get() == -7);
+  REQUIRE(parseNumber("$ff", value));
+  REQUIRE(value.get() == 255);
+  REQUIRE(parseNumber("-$10", value));
+  REQUIRE(SCell{value}.get() == -16);
+
+  REQUIRE_FALSE(parseNumber("-", value));
+  REQUIRE_FALSE(parseNumber("$", value));
+  REQUIRE_FALSE(parseNumber("12a", value));
+  REQUIRE_FALSE(parseNumber("$fg", value));
+}
+
+TEST_CASE("The interpreter executes and compiles words", "[interpreter]") {
+  VirtualMachine vm;
+  Interpreter interpreter{vm};
+
+  SECTION("Numbers and primitives run right away") {
+    REQUIRE(interpreter.interpret("2 3 + 4 * DUP"));
+    REQUIRE(stack(vm) == std::vector<SCell::type>({20, 20}));
+  }
+
+  SECTION("Colon definitions compile") {
+    REQUIRE(interpreter.interpret(
+      ": SQUARE ( n -- n*n ) DUP * ;\n"
+      "\\ a comment, to the end of the line\n"
+      ": SUM-OF-SQUARES SQUARE SWAP SQUARE + ;\n"
+      "3 4 SUM-OF-SQUARES"));
+    REQUIRE(stack(vm) == std::vector<SCell::type>({25}));
+    size_t xt;
+    REQUIRE(vm.dictionary().find("SUM-OF-SQUARES", xt));
+  }
+
+  SECTION("Defining words") {
+    REQUIRE(interpreter.interpret(
+      "VARIABLE X 5 X !  10 CONSTANT TEN  1 VALUE V\n"
+      ": BUMP V 1+ TO V ;\n"
+      "BUMP BUMP X @ TEN V  30 TO V V"));
+    REQUIRE(stack(vm) == std::vector<SCell::type>({5, 10, 3, 30}));
+  }
+
+  SECTION("Ticks push execution tokens") {
+    REQUIRE(interpreter.interpret(
+      ": SQUARE DUP * ; : APPLY ['] SQUARE EXECUTE ;\n"
+      "3 APPLY 4 ' SQUARE EXECUTE"));
+    REQUIRE(stack(vm) == std::vector<SCell::type>({9, 16}));
+  }
+
+  SECTION("Errors stop at the word that caused them") {
+    REQUIRE_FALSE(interpreter.interpret("1 2 FROB 3"));
+    REQUIRE(interpreter.error() == "FROB");
+    REQUIRE_FALSE(interpreter.interpret(": F 1 + "));
+    REQUIRE(interpreter.error() == "F");
+    REQUIRE_FALSE(interpreter.interpret("' NOSUCH"));
+    REQUIRE(interpreter.error() == "'");
+    // A failed definition doesn't leave the interpreter compiling
+    REQUIRE(interpreter.interpret("7"));
+    SCell c{0};
+    REQUIRE(vm.dataStack().pop(c));
+    REQUIRE(c.get() == 7);
+  }
+}
+
+TEST_CASE("The core wordset interprets", "[interpreter]") {
+  std::ifstream file{"forth/core.fs"};
+  REQUIRE(file);
+  std::stringstream source;
+  source << file.rdbuf();
+
+  VirtualMachine vm;
+  Interpreter interpreter{vm};
+  REQUIRE(interpreter.interpret(source.str()));
+  REQUIRE(vm.dataStack().depth() == 0);
+
+  REQUIRE(interpreter.interpret(
+    "1 2 NIP  3 4 TUCK  5 0 10 WITHIN  10 0 10 WITHIN  -3 S>D  -3 S>D D0<"));
+  REQUIRE(stack(vm) == std::vector<SCell::type>({2, 4, 3, 4, 1, 0, -3, -1,
+                                                 1}));
+}
@@ -0,0 +1,322 @@
+#include <limits>
+#include <vector>
+#include "catch.hpp"
+
+#include "optimizer.hpp"
+
+
+static UCell cell(size_t xt) {
+  return UCell{static_cast<UCell::type>(xt)};
+}
+
+static std::vector<int> interpret(const std::vector<int> &stack,
+                                  const Code &code) {
+  VirtualMachine vm;
+  for (int n : stack) {
+    vm.dataStack().push(SCell{n});
+  }
+  REQUIRE(vm.execute(code));
+
+  std::vector<int> cells;
+  SCell c;
+  while (vm.dataStack().pop(c)) {
+    cells.insert(cells.begin(), c.get());
+  }
+  return cells;
+}
+
+
+TEST_CASE("Literals are folded through pure operations", "[optimizer]") {
+  Optimizer optimizer;
+  Code optimized;
+
+  SECTION("Arithmetic on literals becomes one literal") {
+    Code code{OPCODE_LITERAL, 2, OPCODE_LITERAL, 3, OPCODE_PLUS,
+              OPCODE_LITERAL, 4, OPCODE_STAR, OPCODE_ONE_MINUS};
+    REQUIRE(optimizer.optimize(code, optimized));
+    REQUIRE(optimized == Code({OPCODE_LITERAL, 19}));
+  }
+
+  SECTION("Shuffles of literals are folded") {
+    Code code{OPCODE_LITERAL, 1, OPCODE_LITERAL, 2, OPCODE_SWAP,
+              OPCODE_OVER, OPCODE_LITERAL, 7, OPCODE_DROP};
+    REQUIRE(optimizer.optimize(code, optimized));
+    REQUIRE(optimized == Code({OPCODE_LITERAL, 2, OPCODE_LITERAL, 1,
+                               OPCODE_LITERAL, 2}));
+  }
+
+  SECTION("Comparisons and bitwise operations are folded") {
+    Code code{OPCODE_LITERAL, 6, OPCODE_LITERAL, 3, OPCODE_AND,
+              OPCODE_LITERAL, 1, OPCODE_LSHIFT,
+              OPCODE_LITERAL, 5, OPCODE_GREATER_THAN};
+    REQUIRE(optimizer.optimize(code, optimized));
+    REQUIRE(optimized == Code({OPCODE_LITERAL, 0}));
+  }
+
+  SECTION("CELLS is folded, memory accesses aren't") {
+    Code code{OPCODE_LITERAL, 3, OPCODE_CELLS, OPCODE_FETCH};
+    REQUIRE(optimizer.optimize(code, optimized));
+    REQUIRE(optimized == Code({OPCODE_LITERAL, 3 * sizeof(UCell),
+                               OPCODE_FETCH}));
+  }
+
+  SECTION("Division by zero is left for run time") {
+    Code code{OPCODE_LITERAL, 1, OPCODE_LITERAL, 0, OPCODE_SLASH};
+    REQUIRE(optimizer.optimize(code, optimized));
+    REQUIRE(optimized == code);
+  }
+}
+
+TEST_CASE("Identities are simplified away", "[optimizer]") {
+  Optimizer optimizer;
+  Code optimized;
+
+  SECTION("0 + and 1 * are no-ops") {
+    Code code{OPCODE_LITERAL, 0, OPCODE_PLUS, OPCODE_LITERAL, 1, OPCODE_STAR};
+    REQUIRE(optimizer.optimize(code, optimized));
+    REQUIRE(optimized.empty());
+  }
+
+  SECTION("SWAP SWAP is a no-op") {
+    Code code{OPCODE_SWAP, OPCODE_SWAP, OPCODE_MINUS};
+    REQUIRE(optimizer.optimize(code, optimized));
+    REQUIRE(optimized == Code({OPCODE_MINUS}));
+  }
+
+  SECTION("DUP - is 0") {
+    Code code{OPCODE_DUP, OPCODE_MINUS};
+    REQUIRE(optimizer.optimize(code, optimized));
+    REQUIRE(optimized == Code({OPCODE_DROP, OPCODE_LITERAL, 0}));
+    REQUIRE(interpret({1, 9}, optimized) == interpret({1, 9}, code));
+  }
+
+  SECTION("Multiplying by a power of two is a shift") {
+    Code code{OPCODE_LITERAL, 8, OPCODE_STAR};
+    REQUIRE(optimizer.optimize(code, optimized));
+    REQUIRE(optimized == Code({OPCODE_LITERAL, 3, OPCODE_LSHIFT}));
+    REQUIRE(interpret({-5}, optimized) == interpret({-5}, code));
+  }
+
+  SECTION("Rewrites chain into folding") {
+    Code code{OPCODE_LITERAL, 5, OPCODE_DUP, OPCODE_MINUS,
+              OPCODE_SWAP, OPCODE_SWAP, OPCODE_LITERAL, 0, OPCODE_STAR};
+    REQUIRE(optimizer.optimize(code, optimized));
+    REQUIRE(optimized == Code({OPCODE_LITERAL, 0}));
+  }
+}
+
+TEST_CASE("Optimized code matches the interpreter", "[optimizer]") {
+  Optimizer optimizer;
+  Code optimized;
+
+  Code code{OPCODE_SWAP, OPCODE_LITERAL, 4, OPCODE_STAR, OPCODE_SWAP,
+            OPCODE_PLUS, OPCODE_LITERAL, 0, OPCODE_OR, OPCODE_DUP,
+            OPCODE_LITERAL, 3, OPCODE_LITERAL, 2, OPCODE_STAR, OPCODE_MINUS,
+            OPCODE_LITERAL, SCell{-1}, OPCODE_AND, OPCODE_SWAP, OPCODE_SWAP};
+  REQUIRE(optimizer.optimize(code, optimized));
+  REQUIRE(optimized.size() < code.size());
+  REQUIRE(interpret({3, 11}, optimized) == interpret({3, 11}, code));
+  REQUIRE(interpret({-7, 2}, optimized) == interpret({-7, 2}, code));
+
+  SECTION("Truncated code is rejected") {
+    REQUIRE_FALSE(optimizer.optimize(Code{OPCODE_LITERAL}, optimized));
+  }
+}
+
+TEST_CASE("Division by a literal uses a magic multiplier", "[optimizer]") {
+  const SCell::type divisors[] = {2, 3, 5, 7, 10, 16, 641, 1000000007,
+                          -2, -3, -7, -16, -1000,
+                          std::numeric_limits<SCell::type>::max(),
+                          std::numeric_limits<SCell::type>::min()};
+  const SCell::type dividends[] = {0, 1, -1, 2, -2, 6, -6, 7, -7, 99, -99, 12345678,
+                           -12345678, std::numeric_limits<SCell::type>::max(),
+                           std::numeric_limits<SCell::type>::min(),
+                           std::numeric_limits<SCell::type>::min() + 1};
+
+  SECTION("Quotients and remainders match / and MOD") {
+    for (SCell::type d : divisors) {
+      MagicDivisor md;
+      REQUIRE(magicDivisor(SCell{d}, md));
+      for (SCell::type n : dividends) {
+        SCell q = md.quotient(SCell{n});
+        REQUIRE(q.get() == n / d);
+        REQUIRE(md.remainder(SCell{n}, q).get() == n % d);
+      }
+    }
+  }
+
+  SECTION("0, 1 and -1 don't get one") {
+    MagicDivisor md;
+    REQUIRE_FALSE(magicDivisor(SCell{0}, md));
+    REQUIRE_FALSE(magicDivisor(SCell{1}, md));
+    REQUIRE_FALSE(magicDivisor(SCell{-1}, md));
+  }
+
+  SECTION("The optimizer specializes division by literals") {
+    Optimizer optimizer;
+    const enum OpCode opcodes[] = {OPCODE_SLASH, OPCODE_MOD,
+                                   OPCODE_SLASH_MOD, OPCODE_STAR_SLASH_MOD};
+    for (enum OpCode opcode : opcodes) {
+      Code code{OPCODE_LITERAL, 7, opcode}, optimized;
+      REQUIRE(optimizer.optimize(code, optimized));
+      REQUIRE(optimized.size() == 4);
+      REQUIRE(optimized[0].get() != static_cast<UCell::type>(opcode));
+      REQUIRE(interpret({3, -100}, optimized) == interpret({3, -100}, code));
+      REQUIRE(interpret({3, 100}, optimized) == interpret({3, 100}, code));
+    }
+  }
+
+  SECTION("Specialized division still folds on literals") {
+    Optimizer optimizer;
+    Code code{OPCODE_LITERAL, 10, OPCODE_SLASH, OPCODE_LITERAL, 1000,
+              OPCODE_SWAP, OPCODE_MINUS}, optimized;
+    REQUIRE(optimizer.optimize(code, optimized));
+    Code full{OPCODE_LITERAL, SCell{-55}}, folded;
+    full.insert(full.end(), optimized.begin(), optimized.end());
+    REQUIRE(optimizer.optimize(full, folded));
+    REQUIRE(folded == Code({OPCODE_LITERAL, 1005}));
+  }
+}
+
+TEST_CASE("Calls to small words are inlined", "[optimizer]") {
+  VirtualMachine vm;
+  Dictionary &dictionary = vm.dictionary();
+  size_t square, twice;
+  REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+  REQUIRE(vm.define("TWICE", Code{OPCODE_LITERAL, 2, OPCODE_STAR}, twice));
+
+  SECTION("The call disappears and the body folds with the caller") {
+    Optimizer optimizer{&dictionary, 8};
+    Code code{OPCODE_LITERAL, 3, OPCODE_CALL, cell(square), OPCODE_CALL, cell(twice)},
+         optimized;
+    REQUIRE(optimizer.optimize(code, optimized));
+    REQUIRE(optimized == Code({OPCODE_LITERAL, 18}));
+  }
+
+  SECTION("Inlined words are optimized in context") {
+    Optimizer optimizer{&dictionary, 8};
+    Code code{OPCODE_CALL, cell(twice)}, optimized;
+    REQUIRE(optimizer.optimize(code, optimized));
+    REQUIRE(optimized == Code({OPCODE_LITERAL, 1, OPCODE_LSHIFT}));
+  }
+
+  SECTION("Words over the budget are called") {
+    Optimizer optimizer{&dictionary, 2};
+    Code code{OPCODE_CALL, cell(square), OPCODE_CALL, cell(twice)}, optimized;
+    REQUIRE(optimizer.optimize(code, optimized));
+    REQUIRE(optimized == Code({OPCODE_DUP, OPCODE_STAR, OPCODE_CALL, cell(twice)}));
+  }
+
+  SECTION("Recursion isn't inlined") {
+    size_t countdown;
+    REQUIRE(vm.define("COUNTDOWN", Code{OPCODE_ONE_MINUS, OPCODE_QUESTION_DUP,
+                                        OPCODE_DROP}, countdown));
+    // Recursive definitions have to be patched in after the fact
+    Code body{OPCODE_ONE_MINUS, OPCODE_CALL, cell(countdown)}, optimized;
+    vm.dictionary().forget(countdown);
+    countdown = vm.dictionary().define("COUNTDOWN", body);
+    Optimizer optimizer{&dictionary, 8};
+    REQUIRE(optimizer.optimize(Code{OPCODE_CALL, cell(countdown)}, optimized));
+    REQUIRE(optimized == Code({OPCODE_ONE_MINUS, OPCODE_CALL, cell(countdown)}));
+  }
+
+  SECTION("Words that EXIT early aren't inlined") {
+    size_t early = dictionary.define("EARLY", Code{OPCODE_EXIT, OPCODE_DUP});
+    Optimizer optimizer{&dictionary, 8};
+    Code code{OPCODE_CALL, cell(early)}, optimized;
+    REQUIRE(optimizer.optimize(code, optimized));
+    REQUIRE(optimized == code);
+  }
+
+  SECTION("define() inlines according to the VM's budget") {
+    size_t caller;
+    REQUIRE(vm.define("CALLER", Code{OPCODE_CALL, cell(square)}, caller));
+    Code body;
+    REQUIRE(dictionary.body(caller, body));
+    REQUIRE(body == Code({OPCODE_DUP, OPCODE_STAR}));
+
+    vm.setInlineBudget(0);
+    REQUIRE(vm.define("CALLER", Code{OPCODE_CALL, cell(square)}, caller));
+    REQUIRE(dictionary.body(caller, body));
+    REQUIRE(body == Code({OPCODE_CALL, cell(square)}));
+
+    vm.dataStack().push(SCell{-4});
+    REQUIRE(vm.execute(caller));
+    SCell result{0};
+    REQUIRE(vm.dataStack().pop(result));
+    REQUIRE(result.get() == 16);
+  }
+}
+
+TEST_CASE("Calls with literal arguments are specialized", "[optimizer]") {
+  VirtualMachine vm;
+  Dictionary &dictionary = vm.dictionary();
+  size_t scale, square, nip;
+  // ( x n -- x*n*n )
+  REQUIRE(vm.define("SCALE", Code{OPCODE_DUP, OPCODE_STAR, OPCODE_STAR},
+                    scale));
+  REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+  REQUIRE(vm.define("NIP", Code{OPCODE_SWAP, OPCODE_DROP}, nip));
+  Optimizer optimizer{&dictionary, 0, 64};
+
+  SECTION("The clone has the arguments folded in") {
+    Code optimized, body;
+    REQUIRE(optimizer.optimize(Code{OPCODE_LITERAL, 4, OPCODE_CALL,
+                                    cell(scale)}, optimized));
+    REQUIRE(optimized.size() == 2);
+    REQUIRE(optimized[0].get() == OPCODE_CALL);
+    REQUIRE(dictionary.body(optimized[1].get(), body));
+    REQUIRE(body == Code({OPCODE_LITERAL, 4, OPCODE_LSHIFT}));
+
+    vm.dataStack().push(SCell{3});
+    REQUIRE(vm.execute(optimized));
+    SCell result{0};
+    REQUIRE(vm.dataStack().pop(result));
+    REQUIRE(result.get() == 48);
+  }
+
+  SECTION("Clones are shared per argument tuple") {
+    Code first, second, other;
+    REQUIRE(optimizer.optimize(Code{OPCODE_LITERAL, 4, OPCODE_CALL,
+                                    cell(scale)}, first));
+    const size_t here = dictionary.here();
+    REQUIRE(optimizer.optimize(Code{OPCODE_DUP, OPCODE_LITERAL, 4,
+                                    OPCODE_CALL, cell(scale)}, second));
+    REQUIRE(dictionary.here() == here);
+    REQUIRE(second == Code({OPCODE_DUP, first[0], first[1]}));
+
+    REQUIRE(optimizer.optimize(Code{OPCODE_LITERAL, 3, OPCODE_CALL,
+                                    cell(scale)}, other));
+    REQUIRE(other[1].get() != first[1].get());
+  }
+
+  SECTION("Only the arguments the word reads are taken") {
+    Code optimized, body;
+    REQUIRE(optimizer.optimize(Code{OPCODE_LITERAL, 1, OPCODE_LITERAL, 2,
+                                    OPCODE_CALL, cell(square)}, optimized));
+    REQUIRE(optimized.size() == 4);
+    REQUIRE(optimized[0].get() == OPCODE_LITERAL);
+    REQUIRE(optimized[1].get() == 1);
+    REQUIRE(dictionary.body(optimized[3].get(), body));
+    REQUIRE(body == Code({OPCODE_LITERAL, 4}));
+  }
+
+  SECTION("Words that don't fold keep being called") {
+    const size_t here = dictionary.here();
+    Code code{OPCODE_LITERAL, 5, OPCODE_CALL, cell(nip)}, optimized;
+    REQUIRE(optimizer.optimize(code, optimized));
+    REQUIRE(optimized == code);
+    REQUIRE(dictionary.here() == here);
+  }
+
+  SECTION("Forgetting a word forgets its clones") {
+    Code first, second;
+    REQUIRE(optimizer.optimize(Code{OPCODE_LITERAL, 4, OPCODE_CALL,
+                                    cell(scale)}, first));
+    REQUIRE(dictionary.forget(first[1].get()));
+    REQUIRE(optimizer.optimize(Code{OPCODE_LITERAL, 4, OPCODE_CALL,
+                                    cell(scale)}, second));
+    REQUIRE(second == first);
+    REQUIRE(dictionary.here() > first[1].get());
+  }
+}
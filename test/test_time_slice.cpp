@@ -0,0 +1,78 @@
+#include <chrono>
+#include <csignal>
+#include <unistd.h>
+#include "catch.hpp"
+
+#include "dictionary.hpp"
+#include "time_slice.hpp"
+
+
+static UCell cell(size_t xt) {
+  return UCell{static_cast<UCell::type>(xt)};
+}
+
+// A deferred word that jumps to itself, which never stops on its own
+static size_t spin(VirtualMachine &vm) {
+  size_t xt;
+  REQUIRE(vm.define("SPIN", Code{OPCODE_DEFER, 0}, xt));
+  REQUIRE(vm.execute(Code{OPCODE_LITERAL, cell(xt), OPCODE_IS, cell(xt)}));
+  return xt;
+}
+
+
+TEST_CASE("A set flag pauses a run at the next call", "[time_slice]") {
+  VirtualMachine vm;
+  vm.setInlineBudget(0);
+  size_t square, quad;
+  REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+  REQUIRE(vm.define("QUAD", Code{OPCODE_CALL, cell(square),
+                                 OPCODE_CALL, cell(square)}, quad));
+
+  std::atomic<bool> preempt{true};
+  vm.dataStack().push(SCell{3});
+  REQUIRE(vm.start(quad));
+  REQUIRE(vm.run(preempt));
+  REQUIRE(vm.running());
+  REQUIRE(vm.ip() == square);
+
+  preempt = false;
+  REQUIRE(vm.run(preempt));
+  REQUIRE_FALSE(vm.running());
+  SCell c{0};
+  REQUIRE(vm.dataStack().pop(c));
+  REQUIRE(c.get() == 81);
+}
+
+TEST_CASE("Time slices preempt a machine that never stops",
+          "[time_slice]") {
+  VirtualMachine vm;
+  const size_t xt = spin(vm);
+  REQUIRE(vm.start(xt));
+
+  TimeSlice slice;
+  for (int i = 0; i < 3; i++) {
+    const auto begin = std::chrono::steady_clock::now();
+    REQUIRE(slice.start(5000));
+    REQUIRE(vm.run(slice.expired()));
+    const auto elapsed = std::chrono::steady_clock::now() - begin;
+    REQUIRE(vm.running());
+    REQUIRE(slice.expired());
+    REQUIRE(elapsed >= std::chrono::milliseconds(5));
+  }
+
+  SECTION("A stopped slice doesn't expire") {
+    REQUIRE(slice.start(1000));
+    slice.stop();
+    size_t fuel = 1000000;
+    REQUIRE(vm.run(fuel));
+    REQUIRE_FALSE(slice.expired());
+  }
+
+  SECTION("Stray alarms are ignored") {
+    REQUIRE(slice.start(1000000));
+    slice.stop();
+    REQUIRE(kill(getpid(), SIGALRM) == 0);
+    REQUIRE(raise(SIGALRM) == 0);
+    REQUIRE_FALSE(slice.expired());
+  }
+}
@@ -0,0 +1,932 @@
+#include <cmath>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <string>
+#include <vector>
+#include "catch.hpp"
+
+#include "dictionary.hpp"
+#include "operation.hpp"
+
+
+static UCell cell(size_t xt) {
+  return UCell{static_cast<UCell::type>(xt)};
+}
+
+// The body of the word at xt as it runs, with its quickened sites
+static bool liveBody(const Dictionary &dictionary, size_t xt, Code &code) {
+  for (const Dictionary::Word &w : dictionary.words()) {
+    if (w.xt == xt) {
+      code.assign(dictionary.code().begin() + xt,
+                  dictionary.code().begin() + xt + w.length);
+      return true;
+    }
+  }
+  return false;
+}
+
+static std::vector<int> drain(DataStack &ds) {
+  std::vector<int> cells;
+  SCell c;
+  while (ds.pop(c)) {
+    cells.insert(cells.begin(), c.get());
+  }
+  return cells;
+}
+
+
+TEST_CASE("Stacks push and pop in LIFO order", "[stack]") {
+  DataStack ds{2};
+  UCell c;
+
+  REQUIRE(ds.depth() == 0);
+  REQUIRE_FALSE(ds.pop(c));
+  REQUIRE_FALSE(ds.peek(c));
+
+  REQUIRE(ds.push(UCell{1}));
+  REQUIRE(ds.push(UCell{2}));
+  REQUIRE_FALSE(ds.push(UCell{3}));
+  REQUIRE(ds.depth() == 2);
+
+  REQUIRE(ds.peek(c));
+  REQUIRE(c.get() == 2);
+  REQUIRE(ds.pop(c));
+  REQUIRE(c.get() == 2);
+  REQUIRE(ds.pop(c));
+  REQUIRE(c.get() == 1);
+  REQUIRE(ds.depth() == 0);
+}
+
+TEST_CASE("Stacks transfer cells in bulk", "[stack]") {
+  DataStack ds{4};
+  const SCell in[] = {1, -2, 3};
+  SCell out[3];
+
+  REQUIRE(ds.pushN(in, 3));
+  REQUIRE(ds.depth() == 3);
+  REQUIRE_FALSE(ds.pushN(in, 2));
+  REQUIRE(ds.depth() == 3);
+
+  const UCell *top = ds.view(2);
+  REQUIRE(top != nullptr);
+  REQUIRE(SCell{top[0]}.get() == -2);
+  REQUIRE(top[1].get() == 3);
+  REQUIRE(ds.view(4) == nullptr);
+
+  SCell c;
+  REQUIRE(ds.peek(c));
+  REQUIRE(c.get() == 3);
+
+  REQUIRE_FALSE(ds.popN(out, 4));
+  REQUIRE(ds.popN(out, 3));
+  REQUIRE(ds.depth() == 0);
+  REQUIRE(out[0].get() == 1);
+  REQUIRE(out[1].get() == -2);
+  REQUIRE(out[2].get() == 3);
+}
+
+TEST_CASE("Words fail on stack underflow", "[vm]") {
+  SECTION("Stack manipulation") {
+    const std::vector<std::pair<enum OpCode, size_t>> words{
+      {OPCODE_DROP, 1}, {OPCODE_DUP, 1}, {OPCODE_OVER, 2}, {OPCODE_SWAP, 2},
+      {OPCODE_ROT, 3}, {OPCODE_QUESTION_DUP, 1}, {OPCODE_TWO_DROP, 2},
+      {OPCODE_TWO_DUP, 2}, {OPCODE_TWO_OVER, 4}, {OPCODE_TWO_SWAP, 4},
+    };
+    for (const auto &word : words) {
+      // One cell short
+      DataStack ds;
+      for (size_t i = 1; i < word.second; i++) {
+        REQUIRE(ds.push(SCell{1}));
+      }
+      REQUIRE_FALSE(dispatch(word.first, ds));
+    }
+  }
+
+  SECTION("Float words") {
+    const std::vector<std::pair<enum OpCode, size_t>> words{
+      {OPCODE_F_PLUS, 2}, {OPCODE_F_MINUS, 2}, {OPCODE_F_STAR, 2},
+      {OPCODE_F_SLASH, 2}, {OPCODE_F_STAR_PLUS, 3}, {OPCODE_F_SQRT, 1},
+      {OPCODE_F_LESS_THAN, 2}, {OPCODE_F_TO_S, 1},
+    };
+    for (const auto &word : words) {
+      VirtualMachine vm;
+      for (size_t i = 1; i < word.second; i++) {
+        REQUIRE(vm.floatStack().push(Float{1}));
+      }
+      REQUIRE_FALSE(vm.execute(Code{word.first}));
+    }
+    VirtualMachine vm;
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_S_TO_F}));
+  }
+
+  SECTION("Vector words") {
+    const std::vector<std::pair<enum OpCode, size_t>> words{
+      {OPCODE_V_PLUS, 2}, {OPCODE_V_STAR, 2}, {OPCODE_V_AND, 2},
+      {OPCODE_V_MIN, 2}, {OPCODE_V_MAX, 2}, {OPCODE_V_SUM, 1},
+    };
+    for (const auto &word : words) {
+      VirtualMachine vm;
+      for (size_t i = 1; i < word.second; i++) {
+        REQUIRE(vm.vectorStack().push(Vector{}));
+      }
+      REQUIRE_FALSE(vm.execute(Code{word.first}));
+    }
+  }
+}
+
+TEST_CASE("Words are defined and called", "[vm]") {
+  VirtualMachine vm;
+  size_t square, cube;
+
+  vm.setInlineBudget(0);
+  REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+  REQUIRE(vm.define("CUBE", Code{OPCODE_DUP, OPCODE_CALL, cell(square),
+                                 OPCODE_STAR}, cube));
+
+  SECTION("Words are found by name") {
+    size_t xt;
+    REQUIRE(vm.dictionary().find("CUBE", xt));
+    REQUIRE(xt == cube);
+    REQUIRE_FALSE(vm.dictionary().find("NOPE", xt));
+  }
+
+  SECTION("Calls nest and return") {
+    vm.dataStack().push(SCell{3});
+    REQUIRE(vm.execute(cube));
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({27}));
+
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, 2, OPCODE_CALL, cell(cube),
+                            OPCODE_CALL, cell(square)}));
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({64}));
+  }
+
+  SECTION("Forgetting a word forgets everything after it") {
+    REQUIRE(vm.dictionary().forget(cube));
+    size_t xt;
+    REQUIRE_FALSE(vm.dictionary().find("CUBE", xt));
+    REQUIRE(vm.dictionary().find("SQUARE", xt));
+    REQUIRE(vm.dictionary().here() == cube);
+  }
+
+  SECTION("Bad code stops execution") {
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_CALL, 12345}));
+  }
+
+  SECTION("A failed execution leaves no frames behind") {
+    size_t fails;
+    // Fails after SQUARE returns, on an xt that isn't a word
+    REQUIRE(vm.define("FAILS", Code{OPCODE_CALL, cell(square),
+                                    OPCODE_LITERAL, 12345, OPCODE_EXECUTE},
+                      fails));
+    vm.dataStack().push(SCell{3});
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_CALL, cell(cube),
+                                  OPCODE_CALL, cell(fails)}));
+    REQUIRE(vm.returnStack().depth() == 0);
+    REQUIRE_FALSE(vm.running());
+
+    vm.dataStack().clear();
+    vm.dataStack().push(SCell{2});
+    REQUIRE(vm.execute(cube));
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({8}));
+  }
+}
+
+TEST_CASE("Indirect instructions quicken on first execution", "[vm]") {
+  VirtualMachine vm;
+  Dictionary &dictionary = vm.dictionary();
+  size_t square, cube, value, deferred, caller;
+  Code body;
+
+  vm.setInlineBudget(0);
+  REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+  REQUIRE(vm.define("CUBE", Code{OPCODE_DUP, OPCODE_DUP, OPCODE_STAR,
+                                 OPCODE_STAR}, cube));
+
+  SECTION("VALUE fetches become literals until TO") {
+    REQUIRE(vm.define("V", Code{OPCODE_VALUE, 5}, value));
+    REQUIRE(vm.define("USE", Code{OPCODE_CALL, cell(value)}, caller));
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == Code({OPCODE_CALL_GENERIC, cell(value)}));
+
+    REQUIRE(vm.execute(caller));
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == Code({OPCODE_LITERAL, 5}));
+
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, 7, OPCODE_TO, cell(value)}));
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == Code({OPCODE_CALL_GENERIC, cell(value)}));
+
+    REQUIRE(vm.execute(caller));
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({5, 7}));
+  }
+
+  SECTION("Deferred words become direct calls until IS") {
+    REQUIRE(vm.define("D", Code{OPCODE_DEFER, cell(square)}, deferred));
+    REQUIRE(vm.define("USE", Code{OPCODE_LITERAL, 3, OPCODE_CALL,
+                                  cell(deferred)}, caller));
+
+    REQUIRE(vm.execute(caller));
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == Code({OPCODE_LITERAL, 3, OPCODE_CALL, cell(square)}));
+
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, cell(cube), OPCODE_IS,
+                            cell(deferred)}));
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == Code({OPCODE_LITERAL, 3, OPCODE_CALL_GENERIC,
+                          cell(deferred)}));
+
+    REQUIRE(vm.execute(caller));
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({9, 27}));
+  }
+
+  SECTION("Quickened calls are final") {
+    // D calls through to another deferred word, which it then calls as is
+    size_t inner;
+    REQUIRE(vm.define("INNER", Code{OPCODE_DEFER, cell(square)}, inner));
+    REQUIRE(vm.define("D", Code{OPCODE_DEFER, cell(inner)}, deferred));
+    REQUIRE(vm.define("USE", Code{OPCODE_LITERAL, 3, OPCODE_CALL,
+                                  cell(deferred)}, caller));
+
+    for (int i = 0; i < 2; i++) {
+      REQUIRE(vm.execute(caller));
+      REQUIRE(liveBody(dictionary, caller, body));
+      REQUIRE(body == Code({OPCODE_LITERAL, 3, OPCODE_CALL, cell(inner)}));
+    }
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({9, 9}));
+  }
+
+  SECTION("EXECUTE of a constant xt becomes a call") {
+    // The optimizer would already have done this
+    caller = dictionary.define("USE", Code{OPCODE_LITERAL, 4, OPCODE_LITERAL,
+                                           cell(square), OPCODE_EXECUTE});
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == Code({OPCODE_LITERAL, 4, OPCODE_CALL, cell(square),
+                          OPCODE_NOOP}));
+    REQUIRE(vm.execute(caller));
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == Code({OPCODE_LITERAL, 4, OPCODE_CALL, cell(square),
+                          OPCODE_NOOP}));
+    REQUIRE(vm.execute(caller));
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({16, 16}));
+  }
+
+  SECTION("EXECUTE of a VALUE becomes a call until TO") {
+    REQUIRE(vm.define("V", Code{OPCODE_VALUE, cell(square)}, value));
+    caller = dictionary.define("USE", Code{OPCODE_LITERAL, 2, OPCODE_CALL,
+                                           cell(value), OPCODE_EXECUTE});
+    const Code generic{OPCODE_LITERAL, 2, OPCODE_CALL_GENERIC, cell(value),
+                       OPCODE_EXECUTE};
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == generic);
+
+    REQUIRE(vm.execute(caller));
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == Code({OPCODE_LITERAL, 2, OPCODE_CALL, cell(square),
+                          OPCODE_NOOP}));
+
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, cell(cube), OPCODE_TO,
+                            cell(value)}));
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == generic);
+
+    REQUIRE(vm.execute(caller));
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({4, 8}));
+  }
+
+  SECTION("Forgotten code isn't put back") {
+    REQUIRE(vm.define("V", Code{OPCODE_VALUE, 5}, value));
+    REQUIRE(vm.define("USE", Code{OPCODE_CALL, cell(value)}, caller));
+    REQUIRE(vm.execute(caller));
+
+    // Reuses the forgotten word's code space
+    REQUIRE(dictionary.forget(caller));
+    Code other{OPCODE_DUP, OPCODE_DROP, OPCODE_DUP};
+    REQUIRE(dictionary.define("OTHER", other) == caller);
+
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, 7, OPCODE_TO, cell(value)}));
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == other);
+  }
+
+  SECTION("TO and IS only change words of their kind") {
+    REQUIRE(vm.define("V", Code{OPCODE_VALUE, 5}, value));
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_LITERAL, 7, OPCODE_IS,
+                                  cell(value)}));
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_LITERAL, 7, OPCODE_TO,
+                                  cell(square)}));
+  }
+}
+
+TEST_CASE("Copies of quickened words follow TO and IS", "[vm]") {
+  VirtualMachine vm;
+  size_t value, deferred, square, cube, get, plus, call, copy;
+
+  REQUIRE(vm.define("V", Code{OPCODE_VALUE, 5}, value));
+  REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+  REQUIRE(vm.define("CUBE", Code{OPCODE_DUP, OPCODE_DUP, OPCODE_STAR,
+                                 OPCODE_STAR}, cube));
+  REQUIRE(vm.define("D", Code{OPCODE_DEFER, cell(square)}, deferred));
+  REQUIRE(vm.define("W", Code{OPCODE_CALL, cell(value)}, get));
+  REQUIRE(vm.define("V+", Code{OPCODE_CALL, cell(value), OPCODE_PLUS}, plus));
+  REQUIRE(vm.define("E", Code{OPCODE_CALL, cell(deferred)}, call));
+  // Quicken the calls in W, V+ and E
+  REQUIRE(vm.execute(Code{OPCODE_CALL, cell(get), OPCODE_CALL, cell(plus),
+                          OPCODE_CALL, cell(call)}));
+  vm.dataStack().clear();
+
+  SECTION("Inlined copies see TO") {
+    // : X W ;  : Y 3 W + ;
+    size_t y;
+    REQUIRE(vm.define("X", Code{OPCODE_CALL, cell(get)}, copy));
+    REQUIRE(vm.define("Y", Code{OPCODE_LITERAL, 3, OPCODE_CALL, cell(get),
+                                OPCODE_PLUS}, y));
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, 10, OPCODE_TO, cell(value),
+                            OPCODE_CALL, cell(copy), OPCODE_CALL, cell(get),
+                            OPCODE_CALL, cell(y)}));
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({10, 10, 13}));
+  }
+
+  SECTION("Specialized copies see TO") {
+    vm.setInlineBudget(0);
+    REQUIRE(vm.define("Z", Code{OPCODE_LITERAL, 3, OPCODE_CALL, cell(plus)},
+                      copy));
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, 10, OPCODE_TO, cell(value),
+                            OPCODE_CALL, cell(copy)}));
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({13}));
+  }
+
+  SECTION("Inlined copies see IS") {
+    REQUIRE(vm.define("F", Code{OPCODE_CALL, cell(call)}, copy));
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, cell(cube), OPCODE_IS,
+                            cell(deferred), OPCODE_LITERAL, 2,
+                            OPCODE_CALL, cell(copy)}));
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({8}));
+  }
+}
+
+TEST_CASE("EXECUTE sites cache the xts they see", "[vm]") {
+  VirtualMachine vm;
+  Dictionary &dictionary = vm.dictionary();
+  size_t square, twice, negate, caller;
+  const UCell empty{EMPTY_CACHE_ENTRY};
+  Code body;
+
+  vm.setInlineBudget(0);
+  REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+  REQUIRE(vm.define("TWICE", Code{OPCODE_DUP, OPCODE_PLUS}, twice));
+  REQUIRE(vm.define("NEG", Code{OPCODE_NEGATE}, negate));
+  REQUIRE(vm.define("USE", Code{OPCODE_EXECUTE}, caller));
+  REQUIRE(liveBody(dictionary, caller, body));
+  REQUIRE(body == Code({OPCODE_EXECUTE_CACHED, empty, empty}));
+
+  auto use = [&](int n, size_t xt) {
+    vm.dataStack().push(SCell{n});
+    vm.dataStack().push(cell(xt));
+    REQUIRE(vm.execute(caller));
+    SCell result{0};
+    REQUIRE(vm.dataStack().pop(result));
+    return result.get();
+  };
+
+  SECTION("Monomorphic, then polymorphic, then full") {
+    REQUIRE(use(3, square) == 9);
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == Code({OPCODE_EXECUTE_CACHED, cell(square), empty}));
+
+    REQUIRE(use(3, square) == 9);
+    REQUIRE(use(3, twice) == 6);
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == Code({OPCODE_EXECUTE_CACHED, cell(square), cell(twice)}));
+
+    REQUIRE(use(3, negate) == -3);
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == Code({OPCODE_EXECUTE_CACHED, cell(square), cell(twice)}));
+    REQUIRE(use(3, twice) == 6);
+  }
+
+  SECTION("Misses still check the xt is a word") {
+    vm.dataStack().push(SCell{3});
+    vm.dataStack().push(cell(square + 1));
+    REQUIRE_FALSE(vm.execute(caller));
+    vm.dataStack().push(cell(EMPTY_CACHE_ENTRY));
+    REQUIRE_FALSE(vm.execute(caller));
+  }
+
+  SECTION("Forgetting a cached word empties the cache") {
+    size_t late;
+    REQUIRE(vm.define("LATE", Code{OPCODE_ONE_PLUS}, late));
+    REQUIRE(use(3, late) == 4);
+    REQUIRE(dictionary.forget(late));
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == Code({OPCODE_EXECUTE_CACHED, empty, empty}));
+  }
+
+  SECTION("Copies of a site start out empty") {
+    REQUIRE(use(3, square) == 9);
+    size_t outer;
+    vm.setInlineBudget(8);
+    REQUIRE(vm.define("OUTER", Code{OPCODE_CALL, cell(caller)}, outer));
+    REQUIRE(liveBody(dictionary, outer, body));
+    REQUIRE(body == Code({OPCODE_EXECUTE_CACHED, empty, empty}));
+  }
+
+  SECTION("EXECUTE of a literal xt is compiled as a call") {
+    REQUIRE(vm.define("LIT-EXEC", Code{OPCODE_LITERAL, cell(twice),
+                                       OPCODE_EXECUTE}, caller));
+    REQUIRE(liveBody(dictionary, caller, body));
+    REQUIRE(body == Code({OPCODE_CALL, cell(twice)}));
+  }
+}
+
+TEST_CASE("Double-cell words compute with wide integers", "[vm]") {
+  using Signed = SCell::type;
+  using Unsigned = UCell::type;
+  const Signed maxS = std::numeric_limits<Signed>::max();
+  const Unsigned maxU = std::numeric_limits<Unsigned>::max();
+  VirtualMachine vm;
+
+  auto run = [&](const Code &code) {
+    REQUIRE(vm.execute(code));
+    std::vector<Unsigned> cells;
+    UCell c;
+    while (vm.dataStack().pop(c)) {
+      cells.insert(cells.begin(), c.get());
+    }
+    return cells;
+  };
+  auto lit = [](Unsigned n) {
+    return Code{OPCODE_LITERAL, UCell{n}};
+  };
+  auto cat = [](std::initializer_list<Code> parts) {
+    Code code;
+    for (const Code &part : parts) {
+      code.insert(code.end(), part.begin(), part.end());
+    }
+    return code;
+  };
+  const Unsigned minus = static_cast<Unsigned>(-1);
+
+  SECTION("D+ and D- carry between cells") {
+    REQUIRE(run(cat({lit(maxU), lit(0), lit(1), lit(0), {OPCODE_D_PLUS}}))
+            == std::vector<Unsigned>({0, 1}));
+    REQUIRE(run(cat({lit(0), lit(1), lit(1), lit(0), {OPCODE_D_MINUS}}))
+            == std::vector<Unsigned>({maxU, 0}));
+    REQUIRE(run(cat({lit(1), lit(0), {OPCODE_D_NEGATE}}))
+            == std::vector<Unsigned>({maxU, maxU}));
+  }
+
+  SECTION("Mixed multiplication keeps the whole product") {
+    REQUIRE(run(cat({lit(maxU), lit(maxU), {OPCODE_UM_STAR}}))
+            == std::vector<Unsigned>({1, maxU - 1}));
+    REQUIRE(run(cat({lit(minus), lit(1), {OPCODE_M_STAR}}))
+            == std::vector<Unsigned>({minus, minus}));
+  }
+
+  SECTION("Division rounds the way each word says") {
+    REQUIRE(run(cat({lit(0), lit(1), lit(3), {OPCODE_UM_SLASH_MOD}}))
+            == std::vector<Unsigned>({1, maxU / 3}));
+    // -7 2
+    Code d = cat({lit(static_cast<Unsigned>(-7)), lit(minus), lit(2)});
+    REQUIRE(run(cat({d, {OPCODE_FM_SLASH_MOD}}))
+            == std::vector<Unsigned>({1, static_cast<Unsigned>(-4)}));
+    REQUIRE(run(cat({d, {OPCODE_SM_SLASH_REM}}))
+            == std::vector<Unsigned>({minus, static_cast<Unsigned>(-3)}));
+  }
+
+  SECTION("M*/ has a triple-cell intermediate") {
+    const Unsigned max = static_cast<Unsigned>(maxS);
+    REQUIRE(run(cat({lit(max), lit(0), lit(max), lit(max),
+                     {OPCODE_M_STAR_SLASH}}))
+            == std::vector<Unsigned>({max, 0}));
+    REQUIRE(run(cat({lit(static_cast<Unsigned>(-10)), lit(minus), lit(3),
+                     lit(4), {OPCODE_M_STAR_SLASH}}))
+            == std::vector<Unsigned>({static_cast<Unsigned>(-7), minus}));
+  }
+
+  SECTION("Comparisons look at both cells") {
+    REQUIRE(run(cat({lit(minus), lit(minus), lit(0), lit(0),
+                     {OPCODE_D_LESS_THAN}}))
+            == std::vector<Unsigned>({1}));
+    REQUIRE(run(cat({lit(0), lit(1), lit(maxU), lit(0),
+                     {OPCODE_D_LESS_THAN}}))
+            == std::vector<Unsigned>({0}));
+    REQUIRE(run(cat({lit(5), lit(1), lit(5), lit(1), {OPCODE_D_EQUALS},
+                     lit(5), lit(1), lit(5), lit(0), {OPCODE_D_EQUALS}}))
+            == std::vector<Unsigned>({1, 0}));
+  }
+
+  SECTION("*/ and */MOD don't overflow the product") {
+    const Unsigned max = static_cast<Unsigned>(maxS);
+    REQUIRE(run(cat({lit(max), lit(4), lit(8), {OPCODE_STAR_SLASH}}))
+            == std::vector<Unsigned>({max / 2}));
+    REQUIRE(run(cat({lit(max), lit(3), lit(3), {OPCODE_STAR_SLASH_MOD}}))
+            == std::vector<Unsigned>({0, max}));
+
+    size_t scaled;
+    REQUIRE(vm.define("SCALED", Code{OPCODE_LITERAL, 3, OPCODE_LITERAL, 3,
+                                     OPCODE_STAR_SLASH_MOD}, scaled));
+    Code body;
+    REQUIRE(vm.dictionary().body(scaled, body));
+    REQUIRE(body[2].get() == OPCODE_STAR_SLASH_MOD_CONSTANT);
+    REQUIRE(run(cat({lit(max), {OPCODE_CALL, cell(scaled)}}))
+            == std::vector<Unsigned>({0, max}));
+  }
+}
+
+TEST_CASE("Float words use the float stack", "[vm]") {
+  VirtualMachine vm;
+  FStack &fs = vm.floatStack();
+
+  auto flit = [](Float f) {
+    UCell cells[FLOAT_CELLS];
+    floatCells(f, cells);
+    Code code{OPCODE_F_LITERAL};
+    code.insert(code.end(), cells, cells + FLOAT_CELLS);
+    return code;
+  };
+  auto run = [&](std::initializer_list<Code> parts) {
+    Code code;
+    for (const Code &part : parts) {
+      code.insert(code.end(), part.begin(), part.end());
+    }
+    REQUIRE(vm.execute(code));
+  };
+  Float r;
+
+  SECTION("Arithmetic") {
+    run({flit(1.5), flit(2.25), {OPCODE_F_PLUS}, flit(0.5), {OPCODE_F_MINUS},
+         flit(4), {OPCODE_F_STAR}, flit(2), {OPCODE_F_SLASH}, {OPCODE_F_SQRT}});
+    REQUIRE(fs.pop(r));
+    REQUIRE(r == std::sqrt(6.5));
+    REQUIRE(fs.depth() == 0);
+    REQUIRE(vm.dataStack().depth() == 0);
+  }
+
+  SECTION("Fused multiply-add rounds once") {
+    const Float e = 1.0 / (1 << 30);
+    run({flit(1 + e), flit(1 - e), flit(-1), {OPCODE_F_STAR_PLUS}});
+    REQUIRE(fs.pop(r));
+    REQUIRE(r == -e * e);
+  }
+
+  SECTION("Conversions and comparisons cross over to the data stack") {
+    run({{OPCODE_LITERAL, SCell{-7}}, {OPCODE_S_TO_F}, flit(2),
+         {OPCODE_F_SLASH}, {OPCODE_F_TO_S},
+         flit(1), flit(2), {OPCODE_F_LESS_THAN},
+         flit(2), flit(1), {OPCODE_F_LESS_THAN}});
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({-3, 1, 0}));
+    REQUIRE(fs.depth() == 0);
+  }
+}
+
+TEST_CASE("Vector words work lane by lane", "[vm]") {
+  VirtualMachine vm;
+  DataStack &ds = vm.dataStack();
+  DataSpace &space = vm.dataSpace();
+
+  // Loads lanes starting at first, stepping by step, from the data space
+  auto load = [&](int first, int step) {
+    const size_t address = space.here();
+    for (size_t i = 0; i < VECTOR_LANES; i++) {
+      const int lane = first + step * int(i);
+      REQUIRE(space.comma(SCell{static_cast<SCell::type>(lane)}));
+    }
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, cell(address), OPCODE_V_LOAD}));
+  };
+  auto lanes = [&](std::vector<int> expected) {
+    const size_t address = space.here();
+    REQUIRE(space.allot(sizeof(Vector)));
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, cell(address), OPCODE_V_STORE}));
+    std::vector<int> stored;
+    for (size_t i = 0; i < VECTOR_LANES; i++) {
+      SCell x{0};
+      REQUIRE(space.fetch(address + i * sizeof(UCell), x));
+      stored.push_back(x.get());
+    }
+    REQUIRE(stored == expected);
+  };
+
+  SECTION("Load and store round-trip through the data space") {
+    load(5, 1);
+    REQUIRE(ds.depth() == 0);
+    REQUIRE(vm.vectorStack().depth() == 1);
+    std::vector<int> expected;
+    for (size_t i = 0; i < VECTOR_LANES; i++) {
+      expected.push_back(5 + int(i));
+    }
+    lanes(expected);
+    REQUIRE(ds.depth() == 0);
+    REQUIRE(vm.vectorStack().depth() == 0);
+  }
+
+  SECTION("Load and store fail on underflow") {
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_V_LOAD}));
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_LITERAL, 0, OPCODE_V_STORE}));
+  }
+
+#if BBFORTH_CHECKED_MEMORY
+  SECTION("Load and store check the address") {
+    load(1, 1);
+    // Misaligned, and running off the end of the data space
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_LITERAL, 1, OPCODE_V_LOAD}));
+    const size_t last = space.size() - sizeof(UCell);
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_LITERAL, cell(last), OPCODE_V_LOAD}));
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_LITERAL, cell(last),
+                                  OPCODE_V_STORE}));
+  }
+#endif
+
+  SECTION("Arithmetic, AND, MIN and MAX") {
+    std::vector<int> sums, products, ands, mins, maxes;
+    for (int i = 0; i < int(VECTOR_LANES); i++) {
+      const int a = -3 + 2 * i, b = 4 - i;
+      sums.push_back(a + b);
+      products.push_back(a * b);
+      ands.push_back(a & b);
+      mins.push_back(std::min(a, b));
+      maxes.push_back(std::max(a, b));
+    }
+
+    const std::vector<std::pair<enum OpCode, std::vector<int>>> cases{
+      {OPCODE_V_PLUS, sums}, {OPCODE_V_STAR, products}, {OPCODE_V_AND, ands},
+      {OPCODE_V_MIN, mins}, {OPCODE_V_MAX, maxes},
+    };
+    for (const auto &c : cases) {
+      load(-3, 2);
+      load(4, -1);
+      REQUIRE(vm.execute(Code{c.first}));
+      lanes(c.second);
+    }
+  }
+
+  SECTION("VSUM adds the lanes onto the data stack") {
+    load(-1, 3);
+    REQUIRE(vm.execute(Code{OPCODE_V_SUM}));
+    const int n = int(VECTOR_LANES);
+    REQUIRE(drain(ds) == std::vector<int>({-n + 3 * n * (n - 1) / 2}));
+    REQUIRE(vm.vectorStack().depth() == 0);
+  }
+}
+
+TEST_CASE("Memory words use the data space", "[vm]") {
+  VirtualMachine vm;
+  DataSpace &space = vm.dataSpace();
+  const SCell::type CELL = sizeof(UCell);
+
+  SECTION("Cells and bytes are stored and fetched") {
+    REQUIRE(vm.execute(Code{
+      OPCODE_HERE, OPCODE_LITERAL, 3, OPCODE_CELLS, OPCODE_ALLOT,
+      OPCODE_LITERAL, SCell{-5}, OPCODE_OVER, OPCODE_STORE,
+      OPCODE_LITERAL, 12, OPCODE_OVER, OPCODE_PLUS_STORE,
+      OPCODE_LITERAL, 0x1ff, OPCODE_OVER, OPCODE_LITERAL, 2, OPCODE_CELLS,
+      OPCODE_PLUS, OPCODE_C_STORE,
+      OPCODE_DUP, OPCODE_FETCH, OPCODE_SWAP,
+      OPCODE_LITERAL, 2, OPCODE_CELLS, OPCODE_PLUS, OPCODE_C_FETCH}));
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({7, 0xff}));
+    REQUIRE(space.here() == size_t(3 * CELL));
+  }
+
+  SECTION(", and C, compile into the data space") {
+    REQUIRE(vm.execute(Code{
+      OPCODE_LITERAL, 9, OPCODE_C_COMMA, OPCODE_ALIGN, OPCODE_HERE,
+      OPCODE_LITERAL, 42, OPCODE_COMMA, OPCODE_HERE}));
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({CELL, 2 * CELL}));
+
+    UCell x{0};
+    unsigned char c;
+    REQUIRE(space.fetch(CELL, x));
+    REQUIRE(x.get() == 42);
+    REQUIRE(space.fetch(0, c));
+    REQUIRE(c == 9);
+  }
+
+  SECTION("Floats are stored and fetched") {
+    REQUIRE(space.allot(2 * CELL));
+    vm.floatStack().push(Float{2.5});
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, 0, OPCODE_F_STORE,
+                            OPCODE_LITERAL, 0, OPCODE_F_FETCH,
+                            OPCODE_LITERAL, 0, OPCODE_F_FETCH, OPCODE_F_STAR}));
+    Float r;
+    REQUIRE(vm.floatStack().pop(r));
+    REQUIRE(r == 6.25);
+  }
+
+  SECTION("Allocation stays inside the data space") {
+    vm.dataStack().push(SCell{-1});
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_ALLOT}));
+    vm.dataStack().push(SCell{static_cast<SCell::type>(space.size() + 1)});
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_ALLOT}));
+    REQUIRE(space.here() == 0);
+  }
+
+#if BBFORTH_CHECKED_MEMORY
+  SECTION("Checked accesses have to be aligned and in bounds") {
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_LITERAL, 1, OPCODE_FETCH}));
+    vm.dataStack().push(SCell{static_cast<SCell::type>(space.size())});
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_C_FETCH}));
+    vm.dataStack().push(SCell{0});
+    vm.dataStack().push(SCell{static_cast<SCell::type>(space.size())});
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_STORE}));
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, 1, OPCODE_C_FETCH}));
+  }
+#endif
+}
+
+TEST_CASE("Bulk memory words work on whole buffers", "[vm]") {
+  VirtualMachine vm;
+  DataSpace &space = vm.dataSpace();
+  REQUIRE(space.allot(256));
+
+  auto text = [&](size_t address, const std::string &s) {
+    std::memcpy(space.bytes(address, s.size()), s.data(), s.size());
+  };
+  auto read = [&](size_t address, size_t length) {
+    return std::string(reinterpret_cast<char *>(space.bytes(address, length)),
+                       length);
+  };
+  auto lit = [](size_t n) {
+    return UCell{static_cast<UCell::type>(n)};
+  };
+
+  SECTION("MOVE copies as if through a buffer") {
+    text(0, "abcdef");
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, 0, OPCODE_LITERAL, 2,
+                            OPCODE_LITERAL, 4, OPCODE_MOVE}));
+    REQUIRE(read(0, 6) == "ababcd");
+  }
+
+  SECTION("CMOVE copies forward, repeating over an overlap") {
+    text(0, "xyz");
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, 0, OPCODE_LITERAL, 3,
+                            OPCODE_LITERAL, 20, OPCODE_CMOVE}));
+    REQUIRE(read(0, 23) == "xyzxyzxyzxyzxyzxyzxyzxy");
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, 1, OPCODE_LITERAL, 0,
+                            OPCODE_LITERAL, 4, OPCODE_CMOVE}));
+    REQUIRE(read(0, 5) == "yzxyy");
+  }
+
+  SECTION("FILL and ERASE") {
+    REQUIRE(vm.execute(Code{OPCODE_LITERAL, 0, OPCODE_LITERAL, 5,
+                            OPCODE_LITERAL, '*', OPCODE_FILL,
+                            OPCODE_LITERAL, 1, OPCODE_LITERAL, 2,
+                            OPCODE_ERASE}));
+    REQUIRE(read(0, 6) == std::string("*\0\0**\0", 6));
+  }
+
+  SECTION("COMPARE orders by bytes, then by length") {
+    text(0, "apple");
+    text(8, "apply");
+    REQUIRE(vm.execute(Code{
+      OPCODE_LITERAL, 0, OPCODE_LITERAL, 5, OPCODE_LITERAL, 8,
+      OPCODE_LITERAL, 5, OPCODE_COMPARE,
+      OPCODE_LITERAL, 8, OPCODE_LITERAL, 4, OPCODE_LITERAL, 0,
+      OPCODE_LITERAL, 4, OPCODE_COMPARE,
+      OPCODE_LITERAL, 0, OPCODE_LITERAL, 5, OPCODE_LITERAL, 8,
+      OPCODE_LITERAL, 4, OPCODE_COMPARE}));
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({-1, 0, 1}));
+  }
+
+  SECTION("SEARCH finds the first occurrence") {
+    const std::string haystack =
+      "the quick brown fox jumps over the lazy dog; the lazy dog sleeps";
+    text(0, haystack);
+    text(128, "lazy dog");
+    text(144, "lazy cat");
+    for (size_t at : {size_t(128), size_t(144)}) {
+      REQUIRE(vm.execute(Code{OPCODE_LITERAL, 0,
+                              OPCODE_LITERAL, lit(haystack.size()),
+                              OPCODE_LITERAL, lit(at), OPCODE_LITERAL, 8,
+                              OPCODE_SEARCH}));
+    }
+    const int found = int(haystack.find("lazy dog"));
+    const int size = int(haystack.size());
+    REQUIRE(drain(vm.dataStack()) ==
+            std::vector<int>({found, size - found, 1, 0, size, 0}));
+  }
+
+  SECTION("Matches are found at every position") {
+    std::string haystack(100, 'a');
+    for (size_t i = 0; i + 3 <= haystack.size(); i += 7) {
+      std::string s = haystack;
+      s.replace(i, 3, "abc");
+      text(0, s);
+      text(128, "bc");
+      REQUIRE(vm.execute(Code{OPCODE_LITERAL, 0, OPCODE_LITERAL,
+                              lit(s.size()), OPCODE_LITERAL, 128,
+                              OPCODE_LITERAL, 2, OPCODE_SEARCH}));
+      REQUIRE(drain(vm.dataStack()) ==
+              std::vector<int>({int(i + 1), int(s.size() - i - 1), 1}));
+    }
+  }
+
+#if BBFORTH_CHECKED_MEMORY
+  SECTION("Ranges past the data space are rejected") {
+    REQUIRE_FALSE(vm.execute(Code{OPCODE_LITERAL, 0,
+                                  OPCODE_LITERAL, lit(space.size() - 4),
+                                  OPCODE_LITERAL, 8, OPCODE_MOVE}));
+  }
+#endif
+}
+
+TEST_CASE("Reset goes back to the booted state", "[vm]") {
+  VirtualMachine vm;
+  size_t square, cube, counter;
+  REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+  REQUIRE(vm.define("COUNTER", Code{OPCODE_VALUE, 1}, counter));
+  REQUIRE(vm.dataSpace().comma(UCell{7}));
+  vm.markBooted();
+
+  REQUIRE(vm.define("CUBE", Code{OPCODE_DUP, OPCODE_DUP, OPCODE_STAR,
+                                 OPCODE_STAR}, cube));
+  vm.dataStack().push(SCell{2});
+  vm.floatStack().push(Float{1.5});
+  REQUIRE(vm.execute(Code{OPCODE_LITERAL, 9, OPCODE_TO, cell(counter),
+                          OPCODE_LITERAL, 3, OPCODE_LITERAL, 0, OPCODE_STORE,
+                          OPCODE_LITERAL, 5, OPCODE_COMMA,
+                          OPCODE_LITERAL, 100, OPCODE_ALLOCATE}));
+  const size_t limit = vm.dataSpace().limit();
+  REQUIRE(limit < vm.dataSpace().size());
+
+  vm.reset();
+
+  size_t xt;
+  REQUIRE(vm.dataStack().depth() == 0);
+  REQUIRE(vm.floatStack().depth() == 0);
+  REQUIRE(vm.dictionary().find("SQUARE", xt));
+  REQUIRE_FALSE(vm.dictionary().find("CUBE", xt));
+  REQUIRE(vm.dataSpace().here() == sizeof(UCell));
+  REQUIRE(vm.dataSpace().limit() == vm.dataSpace().size());
+
+  REQUIRE(vm.execute(Code{OPCODE_LITERAL, 0, OPCODE_FETCH,
+                          OPCODE_CALL, cell(counter),
+                          OPCODE_LITERAL, SCell{sizeof(UCell)}, OPCODE_FETCH,
+                          OPCODE_LITERAL, 4, OPCODE_CALL, cell(square)}));
+  REQUIRE(drain(vm.dataStack()) == std::vector<int>({7, 1, 0, 16}));
+}
+
+TEST_CASE("Fuel bounds how many calls a run makes", "[vm]") {
+  VirtualMachine vm;
+  vm.setInlineBudget(0);
+  vm.setSpecializeBudget(0);
+  size_t square, quad, d, top;
+  REQUIRE(vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, square));
+  REQUIRE(vm.define("QUAD", Code{OPCODE_CALL, cell(square),
+                                 OPCODE_CALL, cell(square)}, quad));
+  REQUIRE(vm.define("D", Code{OPCODE_DEFER, cell(quad)}, d));
+  // Six calls: QUAD (once the call to D is quickened) and its two calls to
+  // SQUARE, then the same again through EXECUTE
+  REQUIRE(vm.define("TOP", Code{OPCODE_CALL, cell(d), OPCODE_SWAP,
+                                OPCODE_LITERAL, cell(quad), OPCODE_EXECUTE,
+                                OPCODE_PLUS},
+                    top));
+
+  SECTION("Enough fuel runs to the end") {
+    vm.dataStack().push(SCell{2});
+    vm.dataStack().push(SCell{3});
+    REQUIRE(vm.start(top));
+    size_t fuel = 100;
+    REQUIRE(vm.run(fuel));
+    REQUIRE_FALSE(vm.running());
+    REQUIRE(fuel == 100 - 6);
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({16 + 81}));
+  }
+
+  SECTION("Running out pauses inside a call") {
+    vm.dataStack().push(SCell{2});
+    vm.dataStack().push(SCell{3});
+    REQUIRE(vm.start(top));
+    size_t runs = 0;
+    while (vm.running()) {
+      size_t fuel = 2;
+      REQUIRE(vm.run(fuel));
+      runs++;
+      if (vm.running()) {
+        REQUIRE(fuel == 0);
+      }
+    }
+    // The third run stops just inside the last call
+    REQUIRE(runs == 4);
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({16 + 81}));
+  }
+
+  SECTION("No fuel doesn't run at all") {
+    REQUIRE(vm.start(square));
+    size_t fuel = 0;
+    REQUIRE(vm.run(fuel));
+    REQUIRE(vm.running());
+    vm.dataStack().push(SCell{5});
+    REQUIRE(vm.run());
+    REQUIRE_FALSE(vm.running());
+    REQUIRE(drain(vm.dataStack()) == std::vector<int>({25}));
+  }
+
+  SECTION("An error stops the machine") {
+    REQUIRE(vm.define("BAD", Code{OPCODE_LITERAL, 12345, OPCODE_EXECUTE},
+                      top));
+    REQUIRE(vm.start(top));
+    size_t fuel = 10;
+    REQUIRE_FALSE(vm.run(fuel));
+    REQUIRE_FALSE(vm.running());
+  }
+}
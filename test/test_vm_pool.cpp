@@ -0,0 +1,86 @@
+#include <thread>
+#include <vector>
+#include "catch.hpp"
+
+#include "dictionary.hpp"
+#include "vm_pool.hpp"
+
+
+static void boot(VirtualMachine &vm) {
+  size_t xt;
+  vm.define("SQUARE", Code{OPCODE_DUP, OPCODE_STAR}, xt);
+  vm.dataSpace().comma(UCell{42});
+}
+
+static bool runScript(VirtualMachine &vm, SCell::type n, SCell::type &result) {
+  size_t square;
+  SCell c;
+  if (!vm.dictionary().find("SQUARE", square) || vm.dataStack().depth() != 0
+      || vm.dataSpace().here() != sizeof(UCell)) {
+    return false;
+  }
+
+  // Leave garbage behind for reset() to clean up
+  vm.dataStack().push(SCell{n});
+  if (!vm.execute(Code{OPCODE_CALL, UCell{static_cast<UCell::type>(square)},
+                       OPCODE_LITERAL, 0, OPCODE_FETCH, OPCODE_PLUS,
+                       OPCODE_DUP, OPCODE_COMMA, OPCODE_LITERAL, 8,
+                       OPCODE_ALLOCATE, OPCODE_TWO_DROP})
+      || !vm.dataStack().pop(c)) {
+    return false;
+  }
+  result = c.get();
+  vm.dataStack().push(c);
+
+  return true;
+}
+
+
+TEST_CASE("Pooled machines come back booted and clean", "[pool]") {
+  VMPool pool{2, boot};
+  SCell::type result;
+
+  VirtualMachine *pVm = pool.acquire();
+  REQUIRE(runScript(*pVm, 5, result));
+  REQUIRE(result == 67);
+  pool.release(pVm);
+
+  VirtualMachine *pFirst = pool.acquire();
+  VirtualMachine *pSecond = pool.acquire();
+  VirtualMachine *pThird = pool.acquire();
+  REQUIRE(pFirst != pSecond);
+  for (VirtualMachine *p : {pFirst, pSecond, pThird}) {
+    REQUIRE(runScript(*p, 3, result));
+    REQUIRE(result == 51);
+  }
+  pool.release(pThird);
+  pool.release(pSecond);
+  pool.release(pFirst);
+}
+
+TEST_CASE("The pool is shared between threads", "[pool]") {
+  const int THREADS = 4;
+  const int SCRIPTS = 500;
+  VMPool pool{THREADS / 2, boot};
+  std::vector<int> failures(THREADS, 0);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < THREADS; t++) {
+    threads.emplace_back([&pool, &failures, t]() {
+      for (int i = 0; i < SCRIPTS; i++) {
+        VirtualMachine *pVm = pool.acquire();
+        SCell::type result;
+        if (!runScript(*pVm, t + i, result)
+            || result != (t + i) * (t + i) + 42) {
+          failures[t]++;
+        }
+        pool.release(pVm);
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  REQUIRE(failures == std::vector<int>(THREADS, 0));
+}